@@ -0,0 +1,134 @@
+#ifndef __GEEK_CORE_ARENA_H_
+#define __GEEK_CORE_ARENA_H_
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+namespace Geek
+{
+
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+// How many empty blocks are kept for reuse after a rewind
+#define ARENA_MAX_FREE_BLOCKS 4
+
+struct alignas(std::max_align_t) ArenaBlock
+{
+    ArenaBlock* next;
+    size_t size;
+    size_t used;
+
+    uint8_t* getData() { return (uint8_t*)(this + 1); }
+};
+
+/**
+ * A bump allocator for short lived scratch memory. Allocating is just
+ * moving a pointer, and nothing is freed individually: everything
+ * allocated since a mark is released at once by rewinding to it.
+ *
+ * Destructors are never run, so only use it for trivially destructible
+ * types. Not thread safe, each thread has its own (see Thread::getArena()).
+ */
+class Arena
+{
+ public:
+    struct Mark
+    {
+        ArenaBlock* block;
+        size_t used;
+    };
+
+ private:
+    ArenaBlock* m_current; // Most recent first
+    ArenaBlock* m_free;
+    unsigned int m_freeCount;
+    size_t m_blockSize;
+
+    void* allocSlow(size_t size, size_t align);
+    void releaseBlock(ArenaBlock* block);
+
+ public:
+    Arena(size_t blockSize = ARENA_BLOCK_SIZE);
+    ~Arena();
+
+    Arena(const Arena&) = delete;
+    Arena& operator=(const Arena&) = delete;
+
+    void* alloc(size_t size, size_t align = alignof(std::max_align_t))
+    {
+        if (m_current != NULL)
+        {
+            uintptr_t start = (uintptr_t)m_current->getData();
+            uintptr_t pos = (start + m_current->used + align - 1) & ~(uintptr_t)(align - 1);
+            if (pos + size <= start + m_current->size)
+            {
+                m_current->used = (pos + size) - start;
+                return (void*)pos;
+            }
+        }
+        return allocSlow(size, align);
+    }
+
+    /**
+     * Uninitialised space for count Ts
+     */
+    template <typename T>
+    T* alloc(size_t count)
+    {
+        return (T*)alloc(sizeof(T) * count, alignof(T));
+    }
+
+    template <typename T, typename... Args>
+    T* create(Args&&... args)
+    {
+        static_assert(std::is_trivially_destructible<T>::value, "Arena objects are never destroyed");
+        return new (alloc(sizeof(T), alignof(T))) T(std::forward<Args>(args)...);
+    }
+
+    Mark getMark()
+    {
+        Mark mark;
+        mark.block = m_current;
+        mark.used = m_current != NULL ? m_current->used : 0;
+        return mark;
+    }
+
+    /**
+     * Releases everything allocated since the mark was taken
+     */
+    void rewind(Mark mark);
+
+    /**
+     * Releases everything
+     */
+    void reset();
+
+    /**
+     * The bytes currently allocated, including alignment padding
+     */
+    size_t getUsed();
+};
+
+/**
+ * Rewinds an Arena to where it was when the scope was entered
+ */
+class ArenaScope
+{
+ private:
+    Arena& m_arena;
+    Arena::Mark m_mark;
+
+ public:
+    explicit ArenaScope(Arena& arena) : m_arena(arena), m_mark(arena.getMark()) {}
+    ~ArenaScope() { m_arena.rewind(m_mark); }
+
+    ArenaScope(const ArenaScope&) = delete;
+    ArenaScope& operator=(const ArenaScope&) = delete;
+};
+
+};
+
+#endif
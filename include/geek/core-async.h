@@ -0,0 +1,577 @@
+#ifndef __GEEK_CORE_ASYNC_H_
+#define __GEEK_CORE_ASYNC_H_
+
+/*
+ * Coroutines that run on a TaskExecutor. This needs C++20, so is header
+ * only and does nothing unless the including code is built with it.
+ */
+#if __cplusplus >= 202002L && __has_include(<coroutine>)
+
+#define GEEK_HAVE_COROUTINES 1
+
+#include <coroutine>
+#include <exception>
+#include <functional>
+#include <map>
+#include <optional>
+#include <string>
+#include <type_traits>
+#include <vector>
+
+#include <geek/core-clock.h>
+#include <geek/core-data.h>
+#include <geek/core-sync.h>
+#include <geek/core-tasks.h>
+#include <geek/core-thread.h>
+#include <geek/core-timers.h>
+
+namespace Geek
+{
+namespace Core
+{
+
+#define ASYNC_IO_WORKERS 4
+
+/**
+ * The state shared by all AsyncTask promises, whatever their result
+ */
+class AsyncPromiseBase
+{
+ private:
+    FastMutex m_mutex;
+    FastCondVar m_cond;
+    bool m_started = false;
+    bool m_done = false;
+    std::coroutine_handle<> m_continuation;
+    TaskExecutor* m_executor = NULL;
+
+ protected:
+    std::exception_ptr m_exception;
+
+ public:
+    struct FinalAwaiter
+    {
+        bool await_ready() noexcept { return false; }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> handle) noexcept
+        {
+            return handle.promise().complete();
+        }
+
+        void await_resume() noexcept {}
+    };
+
+    AsyncPromiseBase() {}
+
+    AsyncPromiseBase(const AsyncPromiseBase&) = delete;
+    AsyncPromiseBase& operator=(const AsyncPromiseBase&) = delete;
+
+    // Nothing runs until the task is started or awaited
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    FinalAwaiter final_suspend() noexcept { return {}; }
+
+    void unhandled_exception() { m_exception = std::current_exception(); }
+
+    /**
+     * Where to resume after suspending. Tasks inherit the executor of the
+     * task that awaits them, and default to the shared executor.
+     */
+    TaskExecutor* getExecutor()
+    {
+        return m_executor != NULL ? m_executor : TaskExecutor::getSharedExecutor();
+    }
+
+    void setExecutor(TaskExecutor* executor)
+    {
+        if (m_executor == NULL)
+        {
+            m_executor = executor;
+        }
+    }
+
+    /**
+     * Start running on the executor
+     */
+    void start(std::coroutine_handle<> self, TaskExecutor* executor)
+    {
+        {
+            LockGuard<FastMutex> lock(m_mutex);
+            if (m_started)
+            {
+                return;
+            }
+            m_started = true;
+            setExecutor(executor);
+        }
+
+        getExecutor()->forceAddTask(InlineTask::create([self]() { self.resume(); }));
+    }
+
+    /**
+     * Called when another coroutine awaits us. Returns the coroutine that
+     * should run next: us if we haven't started, or the awaiter if we have
+     * already finished.
+     */
+    std::coroutine_handle<> await(std::coroutine_handle<> self, std::coroutine_handle<> awaiter)
+    {
+        LockGuard<FastMutex> lock(m_mutex);
+        if (m_done)
+        {
+            return awaiter;
+        }
+
+        m_continuation = awaiter;
+        if (!m_started)
+        {
+            m_started = true;
+            return self;
+        }
+        return std::noop_coroutine();
+    }
+
+    /**
+     * Called from final_suspend, returns whoever is awaiting us
+     */
+    std::coroutine_handle<> complete()
+    {
+        // Once unlocked, we may be destroyed by a waiter, so don't touch
+        // anything afterwards
+        LockGuard<FastMutex> lock(m_mutex);
+        m_done = true;
+        m_cond.broadcast();
+        if (m_continuation)
+        {
+            return m_continuation;
+        }
+        return std::noop_coroutine();
+    }
+
+    /**
+     * Block until complete. If we haven't been started, we run on the
+     * calling thread until we first suspend.
+     */
+    void wait(std::coroutine_handle<> self)
+    {
+        m_mutex.lock();
+        if (!m_started)
+        {
+            m_started = true;
+            m_mutex.unlock();
+            self.resume();
+            m_mutex.lock();
+        }
+        m_cond.waitUntil(m_mutex, [this] { return m_done; });
+        m_mutex.unlock();
+    }
+
+    bool isStarted()
+    {
+        LockGuard<FastMutex> lock(m_mutex);
+        return m_started;
+    }
+
+    bool isDone()
+    {
+        LockGuard<FastMutex> lock(m_mutex);
+        return m_done;
+    }
+};
+
+template <typename T>
+class AsyncPromise : public AsyncPromiseBase
+{
+ private:
+    std::optional<T> m_value;
+
+ public:
+    void return_value(T value) { m_value.emplace(std::move(value)); }
+
+    T getResult()
+    {
+        if (m_exception)
+        {
+            std::rethrow_exception(m_exception);
+        }
+        return std::move(*m_value);
+    }
+};
+
+template <>
+class AsyncPromise<void> : public AsyncPromiseBase
+{
+ public:
+    void return_void() {}
+
+    void getResult()
+    {
+        if (m_exception)
+        {
+            std::rethrow_exception(m_exception);
+        }
+    }
+};
+
+/**
+ * Resume the awaiting coroutine on its executor
+ */
+template <typename P>
+void resumeOnExecutor(std::coroutine_handle<P> handle)
+{
+    TaskExecutor* executor = NULL;
+    if constexpr (std::is_base_of<AsyncPromiseBase, P>::value)
+    {
+        executor = handle.promise().getExecutor();
+    }
+    else
+    {
+        executor = TaskExecutor::getSharedExecutor();
+    }
+    executor->forceAddTask(InlineTask::create([handle]() { handle.resume(); }));
+}
+
+/**
+ * A coroutine that runs on a TaskExecutor. Whenever it suspends, its
+ * worker is free to run something else, and it is resumed on a worker
+ * once whatever it was waiting for is ready. This lets a few threads keep
+ * thousands of mostly waiting jobs in flight.
+ *
+ * Nothing runs until the task is started or awaited. Awaiting an AsyncTask
+ * from another one runs it on the same executor and returns its result.
+ */
+template <typename T>
+class AsyncTask
+{
+ public:
+    class promise_type : public AsyncPromise<T>
+    {
+     public:
+        AsyncTask get_return_object()
+        {
+            return AsyncTask(std::coroutine_handle<promise_type>::from_promise(*this));
+        }
+    };
+
+ private:
+    std::coroutine_handle<promise_type> m_handle;
+
+    explicit AsyncTask(std::coroutine_handle<promise_type> handle)
+    {
+        m_handle = handle;
+    }
+
+ public:
+    AsyncTask(AsyncTask&& other) noexcept
+    {
+        m_handle = other.m_handle;
+        other.m_handle = nullptr;
+    }
+
+    AsyncTask(const AsyncTask&) = delete;
+    AsyncTask& operator=(const AsyncTask&) = delete;
+
+    /**
+     * Waits for the task if it has been started
+     */
+    ~AsyncTask()
+    {
+        if (m_handle)
+        {
+            if (m_handle.promise().isStarted())
+            {
+                m_handle.promise().wait(m_handle);
+            }
+            m_handle.destroy();
+        }
+    }
+
+    /**
+     * Start running on the given executor, or the shared executor if NULL
+     */
+    void start(TaskExecutor* executor = NULL)
+    {
+        m_handle.promise().start(m_handle, executor);
+    }
+
+    bool isReady() { return m_handle.promise().isDone(); }
+
+    /**
+     * Block until complete
+     */
+    void wait() { m_handle.promise().wait(m_handle); }
+
+    /**
+     * Wait for the result and return it. If the coroutine threw an
+     * exception, it is rethrown here.
+     */
+    T get()
+    {
+        wait();
+        return m_handle.promise().getResult();
+    }
+
+    struct Awaiter
+    {
+        std::coroutine_handle<promise_type> handle;
+
+        bool await_ready() { return handle.promise().isDone(); }
+
+        template <typename P>
+        std::coroutine_handle<> await_suspend(std::coroutine_handle<P> awaiter)
+        {
+            if constexpr (std::is_base_of<AsyncPromiseBase, P>::value)
+            {
+                handle.promise().setExecutor(awaiter.promise().getExecutor());
+            }
+            return handle.promise().await(handle, awaiter);
+        }
+
+        T await_resume() { return handle.promise().getResult(); }
+    };
+
+    Awaiter operator co_await() noexcept
+    {
+        return Awaiter{m_handle};
+    }
+};
+
+/**
+ * Never deleted, for the same reasons as the shared executor
+ */
+inline TimerManager* getAsyncTimerManager()
+{
+    static TimerManager* timerManager = []()
+    {
+        TimerManager* timerManager = new TimerManager();
+        timerManager->setName("geek-async-timers");
+        timerManager->start();
+        return timerManager;
+    }();
+    return timerManager;
+}
+
+/**
+ * Calls functions once their time has come. Used to resume sleeping
+ * coroutines without tying up a worker. Rather than a Timer each, they
+ * share one on the async TimerManager, set for whichever is due first.
+ */
+class AsyncTimerQueue
+{
+ private:
+    TimerManager* m_timerManager;
+    Timer m_timer;
+
+    FastMutex m_mutex;
+    std::multimap<uint64_t, std::function<void()>> m_timers; // By Clock::getTime()
+
+    // Called with m_mutex held
+    void schedule()
+    {
+        if (m_timers.empty())
+        {
+            return;
+        }
+
+        // The timer thread reads the Timer under its own lock, so it's only
+        // changed through the TimerManager
+        m_timerManager->addTimerAt(&m_timer, m_timers.begin()->first);
+    }
+
+    void expire()
+    {
+        std::vector<std::function<void()>> due;
+        {
+            LockGuard<FastMutex> lock(m_mutex);
+            uint64_t now = Clock::getTime();
+            while (!m_timers.empty() && m_timers.begin()->first <= now)
+            {
+                due.push_back(m_timers.begin()->second);
+                m_timers.erase(m_timers.begin());
+            }
+            schedule();
+        }
+
+        for (std::function<void()>& function : due)
+        {
+            function();
+        }
+    }
+
+ public:
+    AsyncTimerQueue(TimerManager* timerManager) : m_timer(TIMER_ONE_SHOT, 0)
+    {
+        m_timerManager = timerManager;
+        m_timer.signal().connect(sigc::slot<void, Timer*>([this](Timer*) { expire(); }));
+    }
+
+    void add(uint64_t timeoutms, std::function<void()> function)
+    {
+        uint64_t when = Clock::getTime() + timeoutms * 1000000ull;
+
+        LockGuard<FastMutex> lock(m_mutex);
+        bool first = m_timers.empty() || when < m_timers.begin()->first;
+        m_timers.emplace(when, function);
+        if (first)
+        {
+            schedule();
+        }
+    }
+
+    /**
+     * Never deleted, for the same reasons as the shared executor
+     */
+    static AsyncTimerQueue* get()
+    {
+        static AsyncTimerQueue* queue = new AsyncTimerQueue(getAsyncTimerManager());
+        return queue;
+    }
+};
+
+/**
+ * Where blocking work is sent so that it doesn't hold up the workers
+ * running coroutines
+ */
+inline TaskExecutor* getAsyncIOExecutor()
+{
+    static TaskExecutor* executor = []()
+    {
+        TaskExecutor* executor = new TaskExecutor(ASYNC_IO_WORKERS, TASK_EXECUTOR_POOL);
+        executor->setTaskTracking(false);
+        return executor;
+    }();
+    return executor;
+}
+
+/**
+ * Suspend for at least the given time
+ */
+struct AsyncSleep
+{
+    uint64_t timeoutms;
+
+    bool await_ready() { return timeoutms == 0; }
+
+    template <typename P>
+    void await_suspend(std::coroutine_handle<P> handle)
+    {
+        AsyncTimerQueue::get()->add(timeoutms, [handle]() { resumeOnExecutor(handle); });
+    }
+
+    void await_resume() {}
+};
+
+inline AsyncSleep asyncSleep(uint64_t timeoutms)
+{
+    return AsyncSleep{timeoutms};
+}
+
+/**
+ * Call a blocking function on the I/O executor, and resume once it
+ * returns with its result
+ */
+template <typename F>
+struct AsyncBlocking
+{
+    typedef typename std::invoke_result<F>::type R;
+    typedef typename std::conditional<std::is_void<R>::value, char, R>::type ValueType;
+
+    F function;
+    std::optional<ValueType> value;
+    std::exception_ptr exception;
+
+    bool await_ready() { return false; }
+
+    template <typename P>
+    void await_suspend(std::coroutine_handle<P> handle)
+    {
+        // We live in the suspended coroutine's frame, so can be written to
+        // until it's resumed
+        getAsyncIOExecutor()->post([this, handle]()
+        {
+            try
+            {
+                if constexpr (std::is_void<R>::value)
+                {
+                    function();
+                }
+                else
+                {
+                    value.emplace(function());
+                }
+            }
+            catch (...)
+            {
+                exception = std::current_exception();
+            }
+            resumeOnExecutor(handle);
+        });
+    }
+
+    R await_resume()
+    {
+        if (exception)
+        {
+            std::rethrow_exception(exception);
+        }
+        if constexpr (!std::is_void<R>::value)
+        {
+            return std::move(*value);
+        }
+    }
+};
+
+template <typename F>
+AsyncBlocking<F> asyncBlocking(F function)
+{
+    return AsyncBlocking<F>{function};
+}
+
+/**
+ * Load a file without blocking a worker. Returns NULL if it couldn't be
+ * loaded, otherwise the caller owns the Data.
+ */
+inline AsyncBlocking<std::function<Geek::Data*()>> asyncReadFile(std::string filename)
+{
+    return asyncBlocking(std::function<Geek::Data*()>([filename]() -> Geek::Data*
+    {
+        Geek::Data* data = new Geek::Data();
+        if (!data->load(filename))
+        {
+            delete data;
+            return NULL;
+        }
+        return data;
+    }));
+}
+
+/**
+ * Wait for a Future without blocking a worker
+ */
+template <typename T>
+struct FutureAwaiter
+{
+    Future<T> future;
+
+    bool await_ready() { return future.isReady(); }
+
+    template <typename P>
+    void await_suspend(std::coroutine_handle<P> handle)
+    {
+        future.onComplete([handle]() { resumeOnExecutor(handle); });
+    }
+
+    T await_resume() { return future.get(); }
+};
+
+template <typename T>
+FutureAwaiter<T> operator co_await(Future<T> future)
+{
+    return FutureAwaiter<T>{future};
+}
+
+};
+};
+
+#endif
+
+#endif
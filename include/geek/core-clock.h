@@ -0,0 +1,52 @@
+#ifndef __GEEK_CORE_CLOCK_H_
+#define __GEEK_CORE_CLOCK_H_
+
+#include <chrono>
+#include <cstdint>
+
+#if defined(__linux__)
+#include <time.h>
+#endif
+
+namespace Geek
+{
+
+/**
+ * A monotonic, high resolution clock. Times are in nanoseconds since an
+ * arbitrary point, so they can only be compared with each other, but
+ * they never jump when the wall clock is adjusted.
+ */
+class Clock
+{
+ public:
+    static uint64_t getTime()
+    {
+#if defined(__linux__)
+        // The same clock CondVar and sleepUntil() use for deadlines
+        struct timespec ts;
+        clock_gettime(CLOCK_MONOTONIC, &ts);
+        return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+    }
+
+    static uint64_t getMicros() { return getTime() / 1000ull; }
+    static uint64_t getMillis() { return getTime() / 1000000ull; }
+
+    /**
+     * The smallest step the clock can take, in nanoseconds
+     */
+    static uint64_t getResolution();
+
+    static void sleep(uint64_t ns);
+
+    /**
+     * Sleeps until the given getTime()
+     */
+    static void sleepUntil(uint64_t time);
+};
+
+};
+
+#endif
@@ -15,6 +15,20 @@ enum DataCompression
     DEFLATE = 3
 };
 
+/**
+ * How a mapped file is going to be read, so the kernel can read ahead
+ * (or not) to suit
+ */
+enum DataAccess
+{
+    ACCESS_NORMAL,
+    ACCESS_SEQUENTIAL,
+    ACCESS_RANDOM,
+
+    // Start reading it all in now
+    ACCESS_WILLNEED
+};
+
 enum Endian
 {
     NONE,
@@ -31,6 +45,7 @@ class Data : public Geek::Logger
     unsigned int m_length = 0;
     unsigned int m_bufferSize = 0;
     bool m_isSub = false;
+    bool m_mapped = false;
     Endian m_endian = Endian::NONE;
 
  public:
@@ -39,6 +54,16 @@ class Data : public Geek::Logger
     virtual ~Data();
 
     bool load(std::string filename);
+
+    /**
+     * Maps the file read only instead of reading it in. Pages are only read
+     * when they're touched, and are shared with anything else that has the
+     * file open. Don't write to getData(), appending makes a private copy.
+     * Files must be under 4GB.
+     */
+    bool loadMapped(std::string filename, DataAccess access = ACCESS_NORMAL);
+    bool isMapped() const { return m_mapped; }
+
     bool loadCompressed(std::string filename, DataCompression compression);
     bool loadCompressed(char* data, unsigned int length, DataCompression compression);
 
@@ -0,0 +1,194 @@
+#ifndef __LIBGEEK_CORE_EVENTLOOP_H_
+#define __LIBGEEK_CORE_EVENTLOOP_H_
+
+#if defined(__linux__)
+
+#include <atomic>
+#include <functional>
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+#include <geek/core-logger.h>
+#include <geek/core-sync.h>
+#include <geek/core-thread.h>
+#include <geek/core-timers.h>
+
+namespace Geek
+{
+namespace Core
+{
+
+enum EventLoopEvents
+{
+    EVENT_READ = 1,
+    EVENT_WRITE = 2,
+
+    // Only ever reported, these don't need to be asked for
+    EVENT_ERROR = 4,
+    EVENT_HANGUP = 8,
+
+    // Report readiness once per change rather than for as long as it lasts
+    EVENT_EDGE = 16,
+};
+
+// The most fd events handled for each epoll_wait()
+#define EVENT_LOOP_MAX_EVENTS 64
+
+/**
+ * Called with the fd and the EventLoopEvents it is ready for
+ */
+typedef std::function<void(int fd, unsigned int events)> EventCallback;
+
+/**
+ * Waits for fds to become ready, timers to expire and work posted from other
+ * threads, all on one thread with a single epoll_wait(). Timers use a
+ * timerfd, and posting uses an eventfd, so neither needs a thread of its own.
+ *
+ * Timers are added through TimerScheduler, as with TimerManager, and fire
+ * on the loop.
+ *
+ * Start it as a Thread, or call run() from an existing one. Callbacks run on
+ * the loop's thread (or a Timer's Strand), so they shouldn't block.
+ * Everything else may be called from any thread. If it was started, stop()
+ * and wait() for it before deleting it.
+ */
+class EventLoop : public Geek::Thread, public Geek::Logger, public TimerScheduler
+{
+ private:
+    struct Handler
+    {
+        int fd;
+        unsigned int events;
+        EventCallback callback;
+    };
+
+    int m_epollFd;
+    int m_timerFd;
+    int m_wakeFd;
+
+    std::atomic<bool> m_stopped;
+
+    FastMutex m_handlersMutex;
+    std::unordered_map<int, std::shared_ptr<Handler>> m_handlers;
+
+    // Whether the eventfd has been written since we last ran the posted
+    // functions, so posting in a burst only wakes us once
+    std::atomic<bool> m_wakePending;
+    FastMutex m_postedMutex;
+    std::vector<std::function<void()>> m_posted;
+
+    // What the timerfd is set to, 0 if disarmed. Protected by m_timersMutex
+    uint64_t m_timerArmed;
+
+    void closeFds();
+    bool control(int op, int fd, unsigned int events);
+    void armTimer();
+    void runTimers();
+    void runPosted();
+
+ protected:
+    virtual void timersChanged() { armTimer(); }
+
+ public:
+    EventLoop();
+    virtual ~EventLoop();
+
+    /**
+     * False if the loop's own fds couldn't be created, for example because
+     * we're out of fds. Nothing will work, and run() returns straight away
+     */
+    bool isValid() { return m_epollFd != -1; }
+
+    /**
+     * Calls callback whenever fd is ready for any of events. Returns false
+     * if the fd couldn't be added, for example if it's already in the loop.
+     */
+    bool addFd(int fd, unsigned int events, EventCallback callback);
+    bool modifyFd(int fd, unsigned int events);
+
+    /**
+     * Stops watching fd. Remove it before closing it
+     */
+    bool removeFd(int fd);
+
+    /**
+     * Runs func on the loop's thread
+     */
+    void post(std::function<void()> func);
+
+    /**
+     * Interrupts the loop's wait
+     */
+    void wake();
+
+    /**
+     * Makes run() return once the current iteration is done. If it isn't
+     * running, the next run() returns straight away. Either way, it can be
+     * run (or started) again afterwards
+     */
+    void stop();
+    bool isStopped() { return m_stopped; }
+
+    /**
+     * Whether we're being called from the loop's own thread
+     */
+    bool isInLoop() { return getCurrent() == this; }
+
+    /**
+     * The loop running on this thread, or NULL
+     */
+    static EventLoop* getCurrent();
+
+    /**
+     * Waits up to timeoutms (-1 for ever) and handles whatever is ready.
+     * Returns how many fd events were handled, or -1 if the loop isn't
+     * valid
+     */
+    int runOnce(int timeoutms = -1);
+
+    /**
+     * Runs until stop() is called
+     */
+    void run();
+
+    virtual bool main();
+};
+
+/**
+ * A set of EventLoops, by default one per CPU and pinned to it, for spreading
+ * connections across cores.
+ */
+class EventLoopGroup
+{
+ private:
+    std::vector<EventLoop*> m_loops;
+    std::atomic<unsigned int> m_next;
+    bool m_started;
+
+ public:
+    EventLoopGroup(int count = 0, bool pin = true);
+    ~EventLoopGroup();
+
+    void start();
+
+    /**
+     * Stops all the loops and waits for them to finish
+     */
+    void stop();
+
+    /**
+     * Each loop in turn
+     */
+    EventLoop* next();
+
+    EventLoop* getLoop(unsigned int i) { return m_loops.at(i); }
+    size_t size() { return m_loops.size(); }
+};
+
+};
+};
+
+#endif
+
+#endif
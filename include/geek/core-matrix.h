@@ -30,6 +30,10 @@
 
 namespace Geek
 {
+namespace Core
+{
+class TaskExecutor;
+}
 
 const float DEG2RAD = 3.141593f / 180.0f;
 const float RAD2DEG = 180.0f / 3.141593f;
@@ -78,6 +82,11 @@ struct CentredMatrix
         const double fun_arg2);
 
     void convolve_mat(const CentredMatrix* mata, const CentredMatrix* matb);
+
+    /**
+     * As convolve_mat, but spreads the rows over the executor's workers
+     */
+    void convolve_mat(const CentredMatrix* mata, const CentredMatrix* matb, Geek::Core::TaskExecutor* executor);
     void convolve_star_mat(const CentredMatrix* mata, const CentredMatrix* matb);
 
     Matrix* makeSCentredMatrix(int m, double noiseFactor);
@@ -0,0 +1,157 @@
+#ifndef __GEEK_CORE_MPMCQUEUE_H_
+#define __GEEK_CORE_MPMCQUEUE_H_
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+
+namespace Geek
+{
+namespace Core
+{
+
+/**
+ * A bounded, lock-free, multi-producer/multi-consumer FIFO queue.
+ *
+ * Each cell carries a sequence number that tells producers and consumers
+ * whose turn it is, so pushing or popping is a single compare and swap on
+ * the shared position plus a store to the cell.
+ */
+template <typename T>
+class MPMCQueue
+{
+ private:
+    struct Cell
+    {
+        std::atomic<size_t> sequence;
+        T data;
+    };
+
+    Cell* m_buffer;
+    size_t m_mask;
+
+    // Keep producers and consumers off each other's cache lines
+    alignas(64) std::atomic<size_t> m_enqueuePos;
+    alignas(64) std::atomic<size_t> m_dequeuePos;
+
+ public:
+    /**
+     * The capacity is rounded up to a power of two
+     */
+    MPMCQueue(size_t capacity)
+    {
+        size_t size = 2;
+        while (size < capacity)
+        {
+            size <<= 1;
+        }
+
+        m_buffer = new Cell[size];
+        m_mask = size - 1;
+
+        size_t i;
+        for (i = 0; i < size; i++)
+        {
+            m_buffer[i].sequence.store(i, std::memory_order_relaxed);
+        }
+        m_enqueuePos.store(0, std::memory_order_relaxed);
+        m_dequeuePos.store(0, std::memory_order_relaxed);
+    }
+
+    ~MPMCQueue()
+    {
+        delete[] m_buffer;
+    }
+
+    MPMCQueue(const MPMCQueue&) = delete;
+    MPMCQueue& operator=(const MPMCQueue&) = delete;
+
+    /**
+     * Returns false if the queue is full
+     */
+    bool push(const T& data)
+    {
+        Cell* cell;
+        size_t pos = m_enqueuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &m_buffer[pos & m_mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)pos;
+            if (diff == 0)
+            {
+                if (m_enqueuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_enqueuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        cell->data = data;
+        cell->sequence.store(pos + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Returns false if the queue is empty
+     */
+    bool pop(T& data)
+    {
+        Cell* cell;
+        size_t pos = m_dequeuePos.load(std::memory_order_relaxed);
+        while (true)
+        {
+            cell = &m_buffer[pos & m_mask];
+            size_t sequence = cell->sequence.load(std::memory_order_acquire);
+            intptr_t diff = (intptr_t)sequence - (intptr_t)(pos + 1);
+            if (diff == 0)
+            {
+                if (m_dequeuePos.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+                {
+                    break;
+                }
+            }
+            else if (diff < 0)
+            {
+                return false;
+            }
+            else
+            {
+                pos = m_dequeuePos.load(std::memory_order_relaxed);
+            }
+        }
+
+        data = cell->data;
+        cell->sequence.store(pos + m_mask + 1, std::memory_order_release);
+        return true;
+    }
+
+    /**
+     * Only a snapshot if other threads are using the queue
+     */
+    size_t size()
+    {
+        size_t enqueuePos = m_enqueuePos.load(std::memory_order_relaxed);
+        size_t dequeuePos = m_dequeuePos.load(std::memory_order_relaxed);
+        if (enqueuePos < dequeuePos)
+        {
+            return 0;
+        }
+        return enqueuePos - dequeuePos;
+    }
+
+    size_t capacity() { return m_mask + 1; }
+};
+
+};
+};
+
+#endif
@@ -0,0 +1,223 @@
+#ifndef __GEEK_CORE_PARALLEL_H_
+#define __GEEK_CORE_PARALLEL_H_
+
+#include <algorithm>
+#include <vector>
+
+#include <geek/core-tasks.h>
+
+namespace Geek
+{
+namespace Core
+{
+
+/**
+ * The state shared by everyone working on a parallelFor. Helper tasks
+ * hold a reference, so it is still valid if they only get to run after
+ * the caller has finished all of the work itself.
+ */
+class ParallelForState
+{
+ private:
+    int64_t m_begin;
+    int64_t m_end;
+    int64_t m_grain;
+    int64_t m_chunks;
+
+    std::atomic<int64_t> m_nextChunk;
+    Latch m_completed; // Counts down as each chunk finishes
+
+    FastMutex m_exceptionMutex;
+    std::exception_ptr m_exception;
+
+ public:
+    ParallelForState(int64_t begin, int64_t end, int64_t grain, int64_t chunks)
+        : m_completed(chunks)
+    {
+        m_begin = begin;
+        m_end = end;
+        m_grain = grain;
+        m_chunks = chunks;
+        m_nextChunk = 0;
+    }
+
+    /**
+     * Keep claiming and running chunks until there are none left. The
+     * function is only touched once a chunk has been claimed, as the
+     * caller may have returned by the time a late helper gets here.
+     */
+    template <typename F>
+    void runChunks(F* function)
+    {
+        while (true)
+        {
+            int64_t chunk = m_nextChunk++;
+            if (chunk >= m_chunks)
+            {
+                return;
+            }
+
+            int64_t chunkBegin = m_begin + (chunk * m_grain);
+            int64_t chunkEnd = std::min(chunkBegin + m_grain, m_end);
+            try
+            {
+                (*function)(chunk, chunkBegin, chunkEnd);
+            }
+            catch (...)
+            {
+                LockGuard<FastMutex> lock(m_exceptionMutex);
+                if (!m_exception)
+                {
+                    m_exception = std::current_exception();
+                }
+            }
+
+            m_completed.countDown();
+        }
+    }
+
+    /**
+     * Wait for all of the chunks to complete. If any of them threw an
+     * exception, the first one is rethrown here.
+     */
+    void wait()
+    {
+        m_completed.wait();
+        if (m_exception)
+        {
+            std::rethrow_exception(m_exception);
+        }
+    }
+};
+
+/**
+ * Pick a grain size that gives each worker (and the caller) a few chunks,
+ * so that uneven chunks still balance out.
+ */
+inline int64_t parallelGrain(TaskExecutor* executor, int64_t count, int64_t grain)
+{
+    if (grain > 0)
+    {
+        return grain;
+    }
+
+    int64_t threads = executor->getMaxWorkers() + 1;
+    return std::max((int64_t)1, count / (threads * 4));
+}
+
+/**
+ * Split [begin, end) in to chunks of grain indices and call
+ * function(chunk, chunkBegin, chunkEnd) for each of them, using the
+ * executor's workers and the calling thread. Returns once every chunk is
+ * complete.
+ */
+template <typename F>
+void parallelForChunks(TaskExecutor* executor, int64_t begin, int64_t end, int64_t grain, F function)
+{
+    if (end <= begin)
+    {
+        return;
+    }
+
+    grain = parallelGrain(executor, end - begin, grain);
+    int64_t chunks = ((end - begin) + grain - 1) / grain;
+    if (chunks == 1)
+    {
+        // Not worth waking anyone up for
+        function(0, begin, end);
+        return;
+    }
+
+    auto state = std::make_shared<ParallelForState>(begin, end, grain, chunks);
+    F* functionPtr = &function;
+
+    int64_t helpers = std::min(chunks - 1, (int64_t)executor->getMaxWorkers());
+    int64_t i;
+    for (i = 0; i < helpers; i++)
+    {
+        InlineTask* helper = InlineTask::create([state, functionPtr]()
+        {
+            state->runChunks(functionPtr);
+        });
+        if (!executor->tryAddTask(helper))
+        {
+            // The executor is full, so we'll just do more ourselves
+            helper->release();
+            break;
+        }
+    }
+
+    // Help out rather than just waiting
+    state->runChunks(functionPtr);
+    state->wait();
+}
+
+/**
+ * Call function(i) for every i in [begin, end), in parallel. A grain of 0
+ * picks a chunk size automatically.
+ */
+template <typename F>
+void parallelFor(TaskExecutor* executor, int64_t begin, int64_t end, int64_t grain, F function)
+{
+    parallelForChunks(executor, begin, end, grain, [&function](int64_t, int64_t chunkBegin, int64_t chunkEnd)
+    {
+        int64_t i;
+        for (i = chunkBegin; i < chunkEnd; i++)
+        {
+            function(i);
+        }
+    });
+}
+
+template <typename F>
+void parallelFor(int64_t begin, int64_t end, int64_t grain, F function)
+{
+    parallelFor(TaskExecutor::getSharedExecutor(), begin, end, grain, function);
+}
+
+/**
+ * Combine map(i) for every i in [begin, end) using reduce, in parallel.
+ * Each chunk is reduced starting from identity and the chunk results are
+ * then combined in order, so the result doesn't depend on timing.
+ */
+template <typename T, typename M, typename R>
+T parallelReduce(TaskExecutor* executor, int64_t begin, int64_t end, int64_t grain, T identity, M map, R reduce)
+{
+    if (end <= begin)
+    {
+        return identity;
+    }
+
+    grain = parallelGrain(executor, end - begin, grain);
+    int64_t chunks = ((end - begin) + grain - 1) / grain;
+
+    std::vector<std::optional<T>> partials(chunks);
+    parallelForChunks(executor, begin, end, grain, [&](int64_t chunk, int64_t chunkBegin, int64_t chunkEnd)
+    {
+        T result = identity;
+        int64_t i;
+        for (i = chunkBegin; i < chunkEnd; i++)
+        {
+            result = reduce(result, map(i));
+        }
+        partials[chunk] = result;
+    });
+
+    T result = identity;
+    for (std::optional<T>& partial : partials)
+    {
+        result = reduce(result, *partial);
+    }
+    return result;
+}
+
+template <typename T, typename M, typename R>
+T parallelReduce(int64_t begin, int64_t end, int64_t grain, T identity, M map, R reduce)
+{
+    return parallelReduce(TaskExecutor::getSharedExecutor(), begin, end, grain, identity, map, reduce);
+}
+
+};
+};
+
+#endif
@@ -0,0 +1,489 @@
+#ifndef __GEEK_CORE_SYNC_H_
+#define __GEEK_CORE_SYNC_H_
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <shared_mutex>
+#include <thread>
+
+namespace Geek
+{
+
+/*
+ * Lightweight synchronisation primitives. Unlike Mutex and CondVar, these
+ * aren't virtual and can live on the stack or inside other objects, and
+ * the uncontended paths are inline. Everything that blocks is built on
+ * FastMutex and FastCondVar, so they're futexes on Linux.
+ */
+
+#define SPIN_LOCK_SPINS 64
+#define FAST_MUTEX_SPINS 100
+
+/**
+ * Tell the CPU we're spinning
+ */
+inline void cpuRelax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__) || defined(__arm__)
+    asm volatile("yield");
+#endif
+}
+
+/**
+ * For very short critical sections. Spins for a while, then yields the
+ * CPU, so a preempted holder can't keep everyone else spinning.
+ */
+class SpinLock
+{
+ private:
+    std::atomic<bool> m_locked;
+
+ public:
+    SpinLock() : m_locked(false) {}
+
+    SpinLock(const SpinLock&) = delete;
+    SpinLock& operator=(const SpinLock&) = delete;
+
+    bool tryLock()
+    {
+        return !m_locked.load(std::memory_order_relaxed) && !m_locked.exchange(true, std::memory_order_acquire);
+    }
+
+    void lock()
+    {
+        int spins = 0;
+        while (!tryLock())
+        {
+            // Wait for it to look free before trying again, so we're not
+            // bouncing the cache line between cores
+            while (m_locked.load(std::memory_order_relaxed))
+            {
+                if (++spins < SPIN_LOCK_SPINS)
+                {
+                    cpuRelax();
+                }
+                else
+                {
+                    std::this_thread::yield();
+                }
+            }
+        }
+    }
+
+    void unlock()
+    {
+        m_locked.store(false, std::memory_order_release);
+    }
+};
+
+/**
+ * A mutex that only enters the kernel when there is contention. On Linux
+ * this is built directly on a futex, elsewhere it falls back to
+ * std::mutex.
+ */
+class FastMutex
+{
+ private:
+#if defined(__linux__)
+    // 0 is unlocked, 1 is locked, 2 is locked with (possible) waiters
+    std::atomic<int> m_state;
+
+    void lockSlow();
+    void unlockSlow();
+#else
+    std::mutex m_mutex;
+#endif
+
+ public:
+#if defined(__linux__)
+    FastMutex() : m_state(0) {}
+#else
+    FastMutex() {}
+#endif
+
+    FastMutex(const FastMutex&) = delete;
+    FastMutex& operator=(const FastMutex&) = delete;
+
+#if defined(__linux__)
+    bool tryLock()
+    {
+        int expected = 0;
+        return m_state.compare_exchange_strong(expected, 1, std::memory_order_acquire);
+    }
+
+    void lock()
+    {
+        if (!tryLock())
+        {
+            lockSlow();
+        }
+    }
+
+    void unlock()
+    {
+        if (m_state.exchange(0, std::memory_order_release) == 2)
+        {
+            unlockSlow();
+        }
+    }
+#else
+    bool tryLock() { return m_mutex.try_lock(); }
+    void lock() { m_mutex.lock(); }
+    void unlock() { m_mutex.unlock(); }
+#endif
+};
+
+/**
+ * Holds a lock for the lifetime of the guard. Works with anything that has
+ * lock() and unlock(), including Mutex.
+ */
+template <typename L>
+class LockGuard
+{
+ private:
+    L& m_lock;
+
+ public:
+    explicit LockGuard(L& lock) : m_lock(lock) { m_lock.lock(); }
+    ~LockGuard() { m_lock.unlock(); }
+
+    LockGuard(const LockGuard&) = delete;
+    LockGuard& operator=(const LockGuard&) = delete;
+};
+
+/**
+ * Many readers or one writer, for read mostly data
+ */
+class RWLock
+{
+ private:
+    std::shared_mutex m_mutex;
+
+ public:
+    RWLock() {}
+
+    RWLock(const RWLock&) = delete;
+    RWLock& operator=(const RWLock&) = delete;
+
+    void lockRead() { m_mutex.lock_shared(); }
+    bool tryLockRead() { return m_mutex.try_lock_shared(); }
+    void unlockRead() { m_mutex.unlock_shared(); }
+
+    void lockWrite() { m_mutex.lock(); }
+    bool tryLockWrite() { return m_mutex.try_lock(); }
+    void unlockWrite() { m_mutex.unlock(); }
+};
+
+/**
+ * A condition variable for FastMutex, or anything else with lock() and
+ * unlock(). The caller must hold the lock, and should change whatever is
+ * being waited for while holding it, so a signal can't be missed. On Linux
+ * this is a futex sequence number, and signalling only enters the kernel
+ * when someone is waiting. Elsewhere it falls back to
+ * std::condition_variable_any.
+ */
+class FastCondVar
+{
+ private:
+#if defined(__linux__)
+    // Bumped by every signal, so a wait that started before it returns
+    std::atomic<int> m_sequence;
+    std::atomic<int> m_waiters;
+
+    // Returns false if it timed out. A negative timeout waits for ever
+    bool waitSlow(int sequence, int64_t timeoutms);
+    void wake(int count);
+
+    template <typename L>
+    bool waitFor(L& lock, int64_t timeoutms)
+    {
+        m_waiters.fetch_add(1);
+        int sequence = m_sequence.load();
+        lock.unlock();
+        bool res = waitSlow(sequence, timeoutms);
+        lock.lock();
+        m_waiters.fetch_sub(1, std::memory_order_relaxed);
+        return res;
+    }
+#else
+    std::condition_variable_any m_cond;
+#endif
+
+ public:
+#if defined(__linux__)
+    FastCondVar() : m_sequence(0), m_waiters(0) {}
+#else
+    FastCondVar() {}
+#endif
+
+    FastCondVar(const FastCondVar&) = delete;
+    FastCondVar& operator=(const FastCondVar&) = delete;
+
+#if defined(__linux__)
+    /**
+     * May return spuriously, prefer waitUntil()
+     */
+    template <typename L>
+    void wait(L& lock) { waitFor(lock, -1); }
+
+    /**
+     * Returns false if the timeout expired
+     */
+    template <typename L>
+    bool wait(L& lock, uint64_t timeoutms) { return waitFor(lock, (int64_t)timeoutms); }
+
+    void signal()
+    {
+        m_sequence.fetch_add(1);
+        if (m_waiters.load() > 0)
+        {
+            wake(1);
+        }
+    }
+
+    void broadcast()
+    {
+        m_sequence.fetch_add(1);
+        if (m_waiters.load() > 0)
+        {
+            wake(INT32_MAX);
+        }
+    }
+#else
+    template <typename L>
+    void wait(L& lock) { m_cond.wait(lock); }
+
+    template <typename L>
+    bool wait(L& lock, uint64_t timeoutms)
+    {
+        return m_cond.wait_for(lock, std::chrono::milliseconds(timeoutms)) == std::cv_status::no_timeout;
+    }
+
+    void signal() { m_cond.notify_one(); }
+    void broadcast() { m_cond.notify_all(); }
+#endif
+
+    /**
+     * Waits until the predicate is true. It is only ever checked with the
+     * lock held
+     */
+    template <typename L, typename P>
+    void waitUntil(L& lock, P predicate)
+    {
+        while (!predicate())
+        {
+            wait(lock);
+        }
+    }
+
+    /**
+     * Returns the final result of the predicate, which will be false if the
+     * timeout expired first
+     */
+    template <typename L, typename P>
+    bool waitUntil(L& lock, P predicate, uint64_t timeoutms)
+    {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutms);
+        while (!predicate())
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+            {
+                return false;
+            }
+
+            // Round up, so we don't spin for the last fraction of a ms
+            uint64_t remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now + std::chrono::microseconds(999)).count();
+            wait(lock, remaining);
+        }
+        return true;
+    }
+};
+
+/**
+ * A counting semaphore. Acquiring and releasing only take the lock when
+ * someone has to wait.
+ */
+class Semaphore
+{
+ private:
+    // Negative when there are waiters
+    std::atomic<int64_t> m_count;
+
+    FastMutex m_mutex;
+    FastCondVar m_cond;
+    int64_t m_wakeups;
+
+ public:
+    Semaphore(int64_t count = 0) : m_count(count), m_wakeups(0) {}
+
+    Semaphore(const Semaphore&) = delete;
+    Semaphore& operator=(const Semaphore&) = delete;
+
+    void acquire()
+    {
+        if (m_count.fetch_sub(1, std::memory_order_acquire) > 0)
+        {
+            return;
+        }
+
+        LockGuard<FastMutex> guard(m_mutex);
+        m_cond.waitUntil(m_mutex, [this] { return m_wakeups > 0; });
+        m_wakeups--;
+    }
+
+    bool tryAcquire()
+    {
+        int64_t count = m_count.load(std::memory_order_relaxed);
+        while (count > 0)
+        {
+            if (m_count.compare_exchange_weak(count, count - 1, std::memory_order_acquire))
+            {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void release(int64_t count = 1)
+    {
+        int64_t previous = m_count.fetch_add(count, std::memory_order_release);
+        if (previous >= 0)
+        {
+            return;
+        }
+
+        // Signal with the lock held, so a waiter can't return and destroy
+        // us before we're done with it
+        int64_t waiting = -previous;
+        int64_t wake = count < waiting ? count : waiting;
+        LockGuard<FastMutex> guard(m_mutex);
+        m_wakeups += wake;
+        if (wake == 1)
+        {
+            m_cond.signal();
+        }
+        else
+        {
+            m_cond.broadcast();
+        }
+    }
+
+    int64_t getCount() { return m_count.load(std::memory_order_relaxed); }
+};
+
+/**
+ * Lets a fixed number of threads wait for each other. Can be reused once
+ * they have all arrived.
+ */
+class Barrier
+{
+ private:
+    FastMutex m_mutex;
+    FastCondVar m_cond;
+    unsigned int m_count;
+    unsigned int m_waiting;
+    uint64_t m_generation;
+
+ public:
+    Barrier(unsigned int count) : m_count(count), m_waiting(0), m_generation(0) {}
+
+    Barrier(const Barrier&) = delete;
+    Barrier& operator=(const Barrier&) = delete;
+
+    /**
+     * Returns true for one of the threads each time the barrier opens
+     */
+    bool wait()
+    {
+        LockGuard<FastMutex> guard(m_mutex);
+        uint64_t generation = m_generation;
+        if (++m_waiting == m_count)
+        {
+            m_waiting = 0;
+            m_generation++;
+            m_cond.broadcast();
+            return true;
+        }
+
+        m_cond.waitUntil(m_mutex, [this, generation] { return m_generation != generation; });
+        return false;
+    }
+};
+
+/**
+ * Opens once it has been counted down to zero, and stays open. Everything
+ * goes through the lock, so once wait() or tryWait() has seen it open the
+ * Latch can be destroyed, even if countDown() has only just opened it.
+ */
+class Latch
+{
+ private:
+    FastMutex m_mutex;
+    FastCondVar m_cond;
+    int64_t m_count;
+
+ public:
+    Latch(int64_t count) : m_count(count) {}
+
+    Latch(const Latch&) = delete;
+    Latch& operator=(const Latch&) = delete;
+
+    void countDown(int64_t count = 1)
+    {
+        LockGuard<FastMutex> guard(m_mutex);
+        int64_t previous = m_count;
+        m_count -= count;
+        if (previous > 0 && previous <= count)
+        {
+            m_cond.broadcast();
+        }
+    }
+
+    bool tryWait()
+    {
+        LockGuard<FastMutex> guard(m_mutex);
+        return m_count <= 0;
+    }
+
+    void wait()
+    {
+        LockGuard<FastMutex> guard(m_mutex);
+        m_cond.waitUntil(m_mutex, [this] { return m_count <= 0; });
+    }
+};
+
+class ReadGuard
+{
+ private:
+    RWLock& m_lock;
+
+ public:
+    explicit ReadGuard(RWLock& lock) : m_lock(lock) { m_lock.lockRead(); }
+    ~ReadGuard() { m_lock.unlockRead(); }
+
+    ReadGuard(const ReadGuard&) = delete;
+    ReadGuard& operator=(const ReadGuard&) = delete;
+};
+
+class WriteGuard
+{
+ private:
+    RWLock& m_lock;
+
+ public:
+    explicit WriteGuard(RWLock& lock) : m_lock(lock) { m_lock.lockWrite(); }
+    ~WriteGuard() { m_lock.unlockWrite(); }
+
+    WriteGuard(const WriteGuard&) = delete;
+    WriteGuard& operator=(const WriteGuard&) = delete;
+};
+
+};
+
+#endif
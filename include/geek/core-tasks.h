@@ -1,10 +1,24 @@
 #ifndef __GEEK_CORE_TASKS_H_
 #define __GEEK_CORE_TASKS_H_
 
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
 #include <deque>
+#include <exception>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <new>
+#include <optional>
+#include <stdexcept>
 #include <string>
+#include <type_traits>
 
+#include <geek/core-sync.h>
 #include <geek/core-thread.h>
+#include <geek/core-mpmcqueue.h>
 
 #include <sigc++/sigc++.h>
 
@@ -14,12 +28,108 @@ namespace Core
 {
 
 class TaskExecutor;
+struct TaskWorkerStats;
 
 enum TaskState
 {
     TASK_CREATED,
+    TASK_WAITING,
     TASK_QUEUED,
     TASK_RUNNING,
+
+    /**
+     * Cancelled or past its deadline before it could start, so it was
+     * dropped without running
+     */
+    TASK_CANCELLED,
+};
+
+enum TaskPriority
+{
+    TASK_PRIORITY_LOW,
+    TASK_PRIORITY_NORMAL,
+    TASK_PRIORITY_HIGH,
+};
+
+#define TASK_PRIORITY_COUNT 3
+
+enum TaskExecutorMode
+{
+    /**
+     * Start a new worker thread for every task, up to the maximum number of
+     * workers. Workers exit as soon as their task is complete.
+     */
+    TASK_EXECUTOR_TRANSIENT,
+
+    /**
+     * Start the maximum number of workers once. The workers stay alive and
+     * pull tasks from the queue until the executor is destroyed.
+     */
+    TASK_EXECUTOR_POOL,
+
+    /**
+     * Like TASK_EXECUTOR_POOL, but each worker has its own queue. Tasks
+     * added from a worker go on to that worker's queue, and idle workers
+     * steal tasks from the others.
+     */
+    TASK_EXECUTOR_WORK_STEALING,
+
+    /**
+     * Like TASK_EXECUTOR_WORK_STEALING, but workers are spread across the
+     * machine's NUMA nodes and pinned to their node's CPUs. Idle workers
+     * steal from others on the same node before trying further away.
+     */
+    TASK_EXECUTOR_NUMA,
+};
+
+/**
+ * What addTask() does when the executor's queue is full
+ */
+enum TaskQueuePolicy
+{
+    /**
+     * Wait for space
+     */
+    TASK_QUEUE_BLOCK,
+
+    /**
+     * Return false straight away. The caller keeps ownership of the Task
+     */
+    TASK_QUEUE_REJECT,
+};
+
+/**
+ * Lets Tasks know that they're no longer wanted. Copies share the same
+ * state, and a default constructed token can never be cancelled.
+ */
+class CancellationToken
+{
+ private:
+    std::shared_ptr<std::atomic<bool>> m_cancelled;
+
+ public:
+    CancellationToken() {}
+    CancellationToken(std::shared_ptr<std::atomic<bool>> cancelled) { m_cancelled = cancelled; }
+
+    bool isCancelled() { return m_cancelled != nullptr && m_cancelled->load(std::memory_order_relaxed); }
+    bool canBeCancelled() { return m_cancelled != nullptr; }
+};
+
+/**
+ * Hands out tokens and cancels them all at once
+ */
+class CancellationSource
+{
+ private:
+    std::shared_ptr<std::atomic<bool>> m_cancelled;
+
+ public:
+    CancellationSource() { m_cancelled = std::make_shared<std::atomic<bool>>(false); }
+
+    CancellationToken getToken() { return CancellationToken(m_cancelled); }
+
+    void cancel() { m_cancelled->store(true, std::memory_order_relaxed); }
+    bool isCancelled() { return m_cancelled->load(std::memory_order_relaxed); }
 };
 
 class Process
@@ -34,37 +144,314 @@ class Process
 class Task
 {
  protected:
-    std::wstring m_title;
-    TaskState m_state;
+    // Only allocated if the task has a title or someone connects to a
+    // signal, as most tasks never use them
+    std::wstring* m_title;
+    std::atomic<TaskState> m_state;
+    TaskPriority m_priority;
 
-    sigc::signal<void, Task*> m_startedSignal;
-    sigc::signal<void, Task*> m_completeSignal;
+    sigc::signal<void, Task*>* m_startedSignal;
+    sigc::signal<void, Task*>* m_completeSignal;
 
-    void setTitle(std::wstring title) { m_title = title; }
+    // Tasks that can't run until we're complete
+    std::vector<Task*> m_dependents;
+    std::atomic<int> m_pendingDependencies;
+
+    // Nanoseconds, only recorded if the executor has stats enabled
+    uint64_t m_queuedTime;
+    uint64_t m_startTime;
+    uint64_t m_finishTime;
+
+    CancellationToken m_cancellationToken;
+    uint64_t m_deadline;
+
+    void setTitle(std::wstring title)
+    {
+        delete m_title;
+        m_title = title.empty() ? NULL : new std::wstring(title);
+    }
+
+    /**
+     * Free the title and signals, and forget any dependencies
+     */
+    void reset()
+    {
+        delete m_title;
+        delete m_startedSignal;
+        delete m_completeSignal;
+        m_title = NULL;
+        m_startedSignal = NULL;
+        m_completeSignal = NULL;
+        m_state = TASK_CREATED;
+        m_priority = TASK_PRIORITY_NORMAL;
+        m_dependents.clear();
+        m_pendingDependencies = 0;
+        m_queuedTime = 0;
+        m_startTime = 0;
+        m_finishTime = 0;
+        m_cancellationToken = CancellationToken();
+        m_deadline = 0;
+    }
 
  public:
     Task()
     {
-        m_title = L"";
+        m_title = NULL;
         m_state = TASK_CREATED;
+        m_priority = TASK_PRIORITY_NORMAL;
+        m_startedSignal = NULL;
+        m_completeSignal = NULL;
+        m_pendingDependencies = 0;
+        m_queuedTime = 0;
+        m_startTime = 0;
+        m_finishTime = 0;
+        m_deadline = 0;
     }
 
-    Task(std::wstring title)
+    Task(std::wstring title) : Task()
     {
-        m_title = title;
-        m_state = TASK_CREATED;
+        setTitle(title);
     }
 
-    virtual ~Task() {}
+    virtual ~Task()
+    {
+        delete m_title;
+        delete m_startedSignal;
+        delete m_completeSignal;
+    }
 
     virtual void run() {}
 
-    std::wstring getTitle() { return m_title; }
+    /**
+     * Called instead of run() if the task is cancelled or misses its
+     * deadline before it starts
+     */
+    virtual void dropped() {}
+
+    /**
+     * Called by the executor once the task is complete. Tasks that are
+     * recycled can override this to return themselves to a pool.
+     */
+    virtual void release() { delete this; }
+
+    std::wstring getTitle() { return m_title != NULL ? *m_title : std::wstring(); }
     TaskState getState() { return m_state; }
     void setState(TaskState state) { m_state = state; }
+    TaskPriority getPriority() { return m_priority; }
+    void setPriority(TaskPriority priority) { m_priority = priority; }
 
-    sigc::signal<void, Task*> startedSignal() { return m_startedSignal; }
-    sigc::signal<void, Task*> completeSignal() { return m_completeSignal; }
+    /**
+     * Long running tasks should check isCancelled() regularly and return
+     * early. If cancelled before it starts, the task won't be run at all.
+     */
+    void setCancellationToken(CancellationToken token) { m_cancellationToken = token; }
+    CancellationToken getCancellationToken() { return m_cancellationToken; }
+    bool isCancelled() { return m_cancellationToken.isCancelled(); }
+
+    /**
+     * Don't start the task after the given time, from getTime(). 0 for
+     * no deadline.
+     */
+    void setDeadline(uint64_t deadline) { m_deadline = deadline; }
+    uint64_t getDeadline() { return m_deadline; }
+    void setTimeout(uint64_t timeoutms) { m_deadline = getTime() + timeoutms * 1000000ull; }
+    bool isExpired(uint64_t now) { return m_deadline != 0 && now > m_deadline; }
+
+    /**
+     * Monotonic time in nanoseconds, used for deadlines and stats. The same
+     * as Clock::getTime()
+     */
+    static uint64_t getTime();
+
+    uint64_t getQueuedTime() { return m_queuedTime; }
+    void setQueuedTime(uint64_t time) { m_queuedTime = time; }
+    uint64_t getStartTime() { return m_startTime; }
+    void setStartTime(uint64_t time) { m_startTime = time; }
+    uint64_t getFinishTime() { return m_finishTime; }
+    void setFinishTime(uint64_t time) { m_finishTime = time; }
+
+    /**
+     * Connect to these before the task is added to an executor
+     */
+    sigc::signal<void, Task*> startedSignal()
+    {
+        if (m_startedSignal == NULL)
+        {
+            m_startedSignal = new sigc::signal<void, Task*>();
+        }
+        return *m_startedSignal;
+    }
+
+    sigc::signal<void, Task*> completeSignal()
+    {
+        if (m_completeSignal == NULL)
+        {
+            m_completeSignal = new sigc::signal<void, Task*>();
+        }
+        return *m_completeSignal;
+    }
+
+    void emitStarted()
+    {
+        if (m_startedSignal != NULL)
+        {
+            m_startedSignal->emit(this);
+        }
+    }
+
+    void emitComplete()
+    {
+        if (m_completeSignal != NULL)
+        {
+            m_completeSignal->emit(this);
+        }
+    }
+
+    /**
+     * Don't run this task until the given task has completed. Dependencies
+     * must be declared before either task is given to an executor.
+     */
+    void addDependency(Task* task)
+    {
+        task->m_dependents.push_back(this);
+        m_pendingDependencies++;
+    }
+
+    const std::vector<Task*>& getDependents() { return m_dependents; }
+    int getPendingDependencies() { return m_pendingDependencies; }
+
+    /**
+     * Called when one of our dependencies has completed. Returns true if
+     * this was the last one and we are ready to run.
+     */
+    bool dependencyComplete() { return --m_pendingDependencies == 0; }
+};
+
+/**
+ * A set of Tasks and the dependencies between them. Once added to a
+ * TaskExecutor, each Task is queued as soon as all of the Tasks it
+ * depends on have completed, so independent branches run in parallel.
+ */
+class TaskGraph
+{
+ private:
+    std::vector<Task*> m_tasks;
+
+ public:
+    TaskGraph();
+    ~TaskGraph();
+
+    void addTask(Task* task);
+    void addTask(Task* task, std::initializer_list<Task*> dependencies);
+    void addDependency(Task* task, Task* dependsOn);
+
+    /**
+     * Returns false if any Task depends on something outside of the graph
+     * or if there is a cycle, either of which would mean it never runs.
+     */
+    bool isValid();
+
+    bool empty() { return m_tasks.empty(); }
+    size_t size() { return m_tasks.size(); }
+
+    /**
+     * Hand over ownership of all Tasks, leaving the graph empty.
+     */
+    std::vector<Task*> release();
+};
+
+/**
+ * A Task that just calls a function
+ */
+class FunctionTask : public Task
+{
+ private:
+    std::function<void()> m_function;
+
+ public:
+    FunctionTask(std::function<void()> function)
+    {
+        m_function = function;
+    }
+
+    FunctionTask(std::wstring title, std::function<void()> function) : Task(title)
+    {
+        m_function = function;
+    }
+
+    virtual ~FunctionTask() {}
+
+    virtual void run() { m_function(); }
+};
+
+#define INLINE_TASK_SIZE 64
+#define INLINE_TASK_POOL_SIZE 1024
+
+template <typename F, typename = void>
+struct InlineTaskHasDropped : std::false_type {};
+
+template <typename F>
+struct InlineTaskHasDropped<F, std::void_t<decltype(std::declval<F&>().dropped())>> : std::true_type {};
+
+/**
+ * A Task that calls a function, for when there's a lot of small tasks.
+ * Functions that fit in INLINE_TASK_SIZE bytes are stored in the task
+ * itself rather than on the heap, and completed tasks are kept in a pool
+ * to be reused, so most of the time adding one doesn't allocate at all.
+ *
+ * If the function object has a dropped() method, it is called instead of
+ * the function when the task is dropped.
+ */
+class InlineTask : public Task
+{
+ private:
+    alignas(std::max_align_t) unsigned char m_storage[INLINE_TASK_SIZE];
+    void (*m_invoke)(void* storage);
+    void (*m_destroy)(void* storage);
+    void (*m_drop)(void* storage); // NULL if there's nothing to call
+
+    InlineTask();
+
+    static InlineTask* acquire();
+
+    template <typename F>
+    static void invokeInline(void* storage) { (*(F*)storage)(); }
+
+    template <typename F>
+    static void destroyInline(void* storage) { ((F*)storage)->~F(); }
+
+    template <typename F>
+    static void invokeHeap(void* storage) { (**(F**)storage)(); }
+
+    template <typename F>
+    static void destroyHeap(void* storage) { delete *(F**)storage; }
+
+    template <typename F>
+    static void dropInline(void* storage) { ((F*)storage)->dropped(); }
+
+    template <typename F>
+    static void dropHeap(void* storage) { (*(F**)storage)->dropped(); }
+
+ public:
+    virtual ~InlineTask();
+
+    template <typename F>
+    static InlineTask* create(F&& function);
+
+    virtual void run() { m_invoke(m_storage); }
+
+    virtual void dropped()
+    {
+        if (m_drop != NULL)
+        {
+            m_drop(m_storage);
+        }
+    }
+
+    /**
+     * Destroys the function and returns the task to the pool
+     */
+    virtual void release();
 };
 
 class TaskWorker : public Thread
@@ -72,12 +459,62 @@ class TaskWorker : public Thread
  private:
     TaskExecutor* m_executor;
     Task* m_task;
+    unsigned int m_index;
+    unsigned int m_node;
+
+    // Only used by persistent workers
+    Mutex* m_wakeMutex;
+    CondVar* m_wakeCondVar;
+    bool m_woken; // Protected by m_wakeMutex
+
+    // Only used by work-stealing workers
+    FastMutex m_localMutex;
+    std::deque<Task*> m_localQueue;
+    std::vector<TaskWorker*> m_victims;
+
+    // Only recorded if the executor has stats enabled
+    std::atomic<uint64_t> m_busyTime;
+    std::atomic<uint64_t> m_idleTime;
+    std::atomic<uint64_t> m_tasksRun;
+
+    void runTask(Task* task);
 
  public:
     TaskWorker(TaskExecutor* executor, Task* task);
+    TaskWorker(TaskExecutor* executor, unsigned int index);
     ~TaskWorker();
 
+    TaskExecutor* getExecutor() { return m_executor; }
     Task* getTask() { return m_task; }
+    unsigned int getIndex() { return m_index; }
+    unsigned int getNode() { return m_node; }
+    void setNode(unsigned int node) { m_node = node; }
+
+    /**
+     * The workers to steal from, in order of preference
+     */
+    const std::vector<TaskWorker*>& getVictims() { return m_victims; }
+    void setVictims(std::vector<TaskWorker*> victims) { m_victims = victims; }
+
+    /**
+     * Sleeps until wake() is called. A wake() that arrives first isn't lost
+     */
+    void sleep();
+    void wake();
+
+    void pushLocal(Task* task);
+    Task* popLocal();
+    Task* steal();
+    std::deque<Task*> drainLocal();
+
+    TaskWorkerStats getStats();
+    void resetStats();
+
+    /**
+     * Returns the worker that is running on the current thread, or NULL
+     * if this isn't a persistent worker thread.
+     */
+    static TaskWorker* getCurrentWorker();
 
     virtual bool main();
 };
@@ -86,42 +523,554 @@ struct TaskInfo
 {
     std::wstring title;
     TaskState state;
+    TaskPriority priority;
+};
+
+#define TASK_HISTOGRAM_BUCKETS 64
+
+/**
+ * A snapshot of a TaskHistogram. Bucket 0 counts zero, and bucket i counts
+ * values from 2^(i-1) up to 2^i - 1.
+ */
+struct TaskHistogramSnapshot
+{
+    uint64_t count;
+    uint64_t total;
+    uint64_t max;
+    uint64_t buckets[TASK_HISTOGRAM_BUCKETS];
+
+    uint64_t getMean() { return count > 0 ? total / count : 0; }
+
+    /**
+     * Returns the upper bound of the bucket containing the given
+     * percentile, so is accurate to within a factor of two
+     */
+    uint64_t getPercentile(double percentile);
+};
+
+/**
+ * A histogram of durations in nanoseconds, with power of two buckets. Any
+ * number of threads can record to it at once without locking.
+ */
+class TaskHistogram
+{
+ private:
+    std::atomic<uint64_t> m_count;
+    std::atomic<uint64_t> m_total;
+    std::atomic<uint64_t> m_max;
+    std::atomic<uint64_t> m_buckets[TASK_HISTOGRAM_BUCKETS];
+
+ public:
+    TaskHistogram();
+
+    void record(uint64_t value);
+    void reset();
+
+    TaskHistogramSnapshot snapshot();
+};
+
+struct TaskWorkerStats
+{
+    unsigned int index;
+    uint64_t tasksRun;
+    uint64_t busyTime;
+    uint64_t idleTime;
+
+    /**
+     * The fraction of time spent running tasks, from 0 to 1
+     */
+    double getUtilisation()
+    {
+        uint64_t total = busyTime + idleTime;
+        return total > 0 ? (double)busyTime / (double)total : 0.0;
+    }
+};
+
+struct TaskExecutorStats
+{
+    unsigned int maxWorkers;
+    uint64_t tasksQueued;
+    uint64_t tasksCompleted;
+
+    // Dropped without running
+    uint64_t tasksCancelled;
+    uint64_t tasksExpired;
+
+    // How long tasks waited to start, and how long they ran for
+    TaskHistogramSnapshot queueWait;
+    TaskHistogramSnapshot runTime;
+
+    // Only persistent workers, transient workers come and go too quickly
+    std::vector<TaskWorkerStats> workers;
+
+    double getUtilisation();
+};
+
+/**
+ * Queued tasks, with a separate queue for each priority. Higher priorities
+ * are always served first, unless a lower priority queue has been passed
+ * over too many times, in which case it gets a turn so that it can't be
+ * starved.
+ *
+ * Each priority is a lock-free ring, so pushing and popping are just a
+ * few atomic operations. If a ring fills up, tasks spill over in to a
+ * locked queue until it has drained.
+ */
+class TaskPriorityQueue
+{
+ private:
+    MPMCQueue<Task*>* m_rings[TASK_PRIORITY_COUNT];
+
+    FastMutex m_overflowMutex;
+    std::deque<Task*> m_overflow[TASK_PRIORITY_COUNT];
+    std::atomic<size_t> m_overflowSize[TASK_PRIORITY_COUNT];
+
+    std::atomic<size_t> m_size[TASK_PRIORITY_COUNT];
+    std::atomic<unsigned int> m_skipped[TASK_PRIORITY_COUNT];
+    std::atomic<unsigned int> m_starvationLimit;
+
+    bool pop(int priority, Task*& task);
+
+ public:
+    TaskPriorityQueue();
+    ~TaskPriorityQueue();
+
+    void push(Task* task);
+    Task* pop();
+
+    bool empty() { return size() == 0; }
+    size_t size();
+    size_t size(TaskPriority priority) { return m_size[priority]; }
+
+    /**
+     * How many times a queue may be passed over for a higher priority
+     * before it is served anyway
+     */
+    void setStarvationLimit(unsigned int limit) { m_starvationLimit = limit; }
+
+    std::deque<Task*> drain();
+};
+
+/**
+ * The state shared between a Future and the Task that produces its result.
+ * The result is either a value (nothing for void) or an exception.
+ */
+template <typename T>
+class FutureState
+{
+ private:
+    typedef typename std::conditional<std::is_void<T>::value, char, T>::type ValueType;
+
+    FastMutex m_mutex;
+    FastCondVar m_cond;
+    bool m_ready = false;
+    std::optional<ValueType> m_value;
+    std::exception_ptr m_exception;
+    std::vector<std::function<void()>> m_continuations;
+
+ public:
+    FutureState() {}
+
+    FutureState(const FutureState&) = delete;
+    FutureState& operator=(const FutureState&) = delete;
+
+    template <typename F>
+    void run(F& function)
+    {
+        std::exception_ptr exception;
+        try
+        {
+            if constexpr (std::is_void<T>::value)
+            {
+                function();
+            }
+            else
+            {
+                m_value.emplace(function());
+            }
+        }
+        catch (...)
+        {
+            exception = std::current_exception();
+        }
+        complete(exception);
+    }
+
+    void complete(std::exception_ptr exception)
+    {
+        std::vector<std::function<void()>> continuations;
+        {
+            LockGuard<FastMutex> lock(m_mutex);
+            m_exception = exception;
+            m_ready = true;
+            continuations.swap(m_continuations);
+            m_cond.broadcast();
+        }
+
+        for (auto& continuation : continuations)
+        {
+            continuation();
+        }
+    }
+
+    /**
+     * Call the given function once a result is available. If there is
+     * already a result, it is called straight away.
+     */
+    void onComplete(std::function<void()> continuation)
+    {
+        {
+            LockGuard<FastMutex> lock(m_mutex);
+            if (!m_ready)
+            {
+                m_continuations.push_back(continuation);
+                return;
+            }
+        }
+        continuation();
+    }
+
+    bool isReady()
+    {
+        LockGuard<FastMutex> lock(m_mutex);
+        return m_ready;
+    }
+
+    void wait()
+    {
+        LockGuard<FastMutex> lock(m_mutex);
+        m_cond.waitUntil(m_mutex, [this] { return m_ready; });
+    }
+
+    bool wait(uint64_t timeoutms)
+    {
+        LockGuard<FastMutex> lock(m_mutex);
+        return m_cond.waitUntil(m_mutex, [this] { return m_ready; }, timeoutms);
+    }
+
+    // Only valid once the result is ready
+    std::exception_ptr getException() { return m_exception; }
+    ValueType& getValue() { return *m_value; }
+
+    T get()
+    {
+        wait();
+        if (m_exception)
+        {
+            std::rethrow_exception(m_exception);
+        }
+
+        if constexpr (std::is_void<T>::value)
+        {
+            return;
+        }
+        else
+        {
+            return *m_value;
+        }
+    }
+};
+
+/**
+ * Runs a function on an InlineTask and completes its FutureState. If the
+ * task is dropped instead, the Future gets an exception rather than never
+ * completing.
+ */
+template <typename T, typename F>
+struct FutureFunction
+{
+    std::shared_ptr<FutureState<T>> state;
+    F function;
+
+    void operator()() { state->run(function); }
+
+    void dropped()
+    {
+        state->complete(std::make_exception_ptr(std::runtime_error("Task was dropped before it ran")));
+    }
+};
+
+template <typename F, typename T>
+struct FutureContinuationResult
+{
+    typedef typename std::invoke_result<F, T>::type type;
+};
+
+template <typename F>
+struct FutureContinuationResult<F, void>
+{
+    typedef typename std::invoke_result<F>::type type;
+};
+
+/**
+ * The result of a function submitted to a TaskExecutor. Waiting on a
+ * Future only waits for that one result, not for the whole executor.
+ */
+template <typename T>
+class Future
+{
+ private:
+    std::shared_ptr<FutureState<T>> m_state;
+    TaskExecutor* m_executor;
+
+ public:
+    Future()
+    {
+        m_executor = NULL;
+    }
+
+    Future(std::shared_ptr<FutureState<T>> state, TaskExecutor* executor)
+    {
+        m_state = state;
+        m_executor = executor;
+    }
+
+    bool isValid() { return m_state != nullptr; }
+    bool isReady() { return m_state->isReady(); }
+
+    void wait() { m_state->wait(); }
+
+    /**
+     * Returns false if the result wasn't ready within the timeout
+     */
+    bool wait(uint64_t timeoutms) { return m_state->wait(timeoutms); }
+
+    /**
+     * Wait for the result and return it. If the function threw an
+     * exception, it is rethrown here.
+     */
+    T get() { return m_state->get(); }
+
+    /**
+     * Call the given function, on whichever thread completes the Future,
+     * once the result is ready
+     */
+    void onComplete(std::function<void()> function) { m_state->onComplete(function); }
+
+    /**
+     * Run the given function on the executor once the result is ready,
+     * passing it the result. If this Future has an exception, the function
+     * isn't called and the exception is passed on to the returned Future.
+     */
+    template <typename F>
+    Future<typename FutureContinuationResult<F, T>::type> then(F function);
 };
 
 class TaskExecutor
 {
  private:
+    // Only used if task tracking is enabled
+    bool m_trackTasks;
     Mutex* m_tasksMutex;
     std::vector<Task*> m_tasks;
+    std::atomic<unsigned int> m_taskCount;
 
     Mutex* m_queueMutex;
-    std::deque<Task*> m_queue;
+    TaskPriorityQueue m_queue;
     CondVar* m_queueEmpty;
+    CondVar* m_queueSpace; // Waited on with m_queueMutex when we're full
 
     Mutex* m_workersMutex;
     std::vector<TaskWorker*> m_workers;
 
     unsigned int m_maxWorkers;
+    TaskExecutorMode m_mode;
+
+    // Persistent worker state
+    std::atomic<bool> m_shutdown;
+    std::atomic<unsigned int> m_pendingTasks;
+    std::atomic<unsigned int> m_idleCount;
+    std::atomic<unsigned int> m_queueing;
+    FastMutex m_queueingMutex;
+    FastCondVar m_queueingDone; // Signalled when m_queueing drops to 0 during shutdown
+
+    // Tasks that have been added but not started, only counted if there
+    // is a capacity
+    size_t m_queueCapacity;
+    TaskQueuePolicy m_queuePolicy;
+    std::atomic<size_t> m_queued;
+    std::atomic<unsigned int> m_capacityWaiters;
+    std::vector<TaskWorker*> m_idleWorkers; // Protected by m_queueMutex
+
+    std::atomic<bool> m_statsEnabled;
+    std::atomic<uint64_t> m_tasksQueued;
+    std::atomic<uint64_t> m_tasksCompleted;
+    std::atomic<uint64_t> m_tasksCancelled;
+    std::atomic<uint64_t> m_tasksExpired;
+    TaskHistogram m_queueWaitHistogram;
+    TaskHistogram m_runTimeHistogram;
 
     sigc::signal<void, Task*> m_queuedSignal;
     sigc::signal<void, Task*> m_startedSignal;
     sigc::signal<void, Task*> m_completeSignal;
 
-    void init(int maxWorkers);
+    void init(int maxWorkers, TaskExecutorMode mode);
+    bool reserveCapacity(size_t count, bool block);
+    void acceptTasks(Task** tasks, size_t count);
+    void queueTask(Task* task);
+    void queueTasks(Task** tasks, size_t count);
+    void startOrQueueTask(Task* task);
     void startTask(Task* task);
+    Task* findTask(TaskWorker* worker);
+    void wakeIdleWorkers(size_t count);
+    bool isPersistent() { return m_mode != TASK_EXECUTOR_TRANSIENT; }
+    bool isWorkStealing() { return m_mode == TASK_EXECUTOR_WORK_STEALING || m_mode == TASK_EXECUTOR_NUMA; }
 
  public:
     TaskExecutor();
     TaskExecutor(int maxWorkers);
+    TaskExecutor(int maxWorkers, TaskExecutorMode mode);
+
+    /**
+     * Persistent executors finish the Tasks that are running, then drop
+     * whatever is left: dropped() is called instead of run(), and they
+     * complete as if they had been cancelled. Futures get an exception.
+     * Call wait() first to run everything. Transient executors don't wait
+     * for anything, so they must be idle.
+     */
     ~TaskExecutor();
 
+    /**
+     * Returns false if the queue is full and the policy is
+     * TASK_QUEUE_REJECT, in which case the caller still owns the Task
+     */
     bool addTask(Task* task);
+    bool addTask(Task* task, TaskPriority priority);
+
+    /**
+     * Like addTask(), but never waits for space
+     */
+    bool tryAddTask(Task* task);
+
+    /**
+     * Add a Task regardless of the queue capacity. This is for work that
+     * has already been accepted, like continuations and resumed
+     * coroutines, which can't be refused part way through.
+     */
+    bool forceAddTask(Task* task);
+
+    /**
+     * Add several Tasks at once, taking each lock once and waking as many
+     * workers as there are Tasks. Either all are added or none are.
+     */
+    bool addTasks(const std::vector<Task*>& tasks);
+
+    /**
+     * Add all of the Tasks in the graph. Tasks without dependencies are
+     * queued straight away, the rest wait for their dependencies. The
+     * executor takes ownership of the Tasks and the graph is left empty.
+     */
+    bool addGraph(TaskGraph* graph);
+
+    /**
+     * Run a function on the executor and return a Future for its result
+     */
+    template <typename F>
+    Future<typename std::invoke_result<F>::type> submit(F function);
 
+    /**
+     * Run a function on the executor, without a Future. Small functions
+     * are added without allocating anything, see InlineTask.
+     */
+    template <typename F>
+    bool post(F&& function, TaskPriority priority = TASK_PRIORITY_NORMAL)
+    {
+        return post(std::forward<F>(function), CancellationToken(), priority);
+    }
+
+    /**
+     * Run a function on the executor, unless the token is cancelled first
+     */
+    template <typename F>
+    bool post(F&& function, CancellationToken token, TaskPriority priority = TASK_PRIORITY_NORMAL)
+    {
+        InlineTask* task = InlineTask::create(std::forward<F>(function));
+        task->setCancellationToken(token);
+        if (!addTask(task, priority))
+        {
+            task->release();
+            return false;
+        }
+        return true;
+    }
+
+    void releaseDependents(Task* task);
+    void removeTask(Task* task);
     void taskComplete(TaskWorker* worker);
 
+    /**
+     * Used by persistent workers to fetch their next task. Blocks until a
+     * task is available, returns NULL when the executor is shutting down.
+     */
+    Task* nextTask(TaskWorker* worker);
+
+    TaskExecutorMode getMode() { return m_mode; }
+    unsigned int getMaxWorkers() { return m_maxWorkers; }
+
+    void setStarvationLimit(unsigned int limit);
+
+    /**
+     * Limit how many Tasks may be waiting to run. Tasks added by our own
+     * workers are always accepted, as they can't wait for themselves. Must
+     * be set before any Tasks are added. 0, the default, is unlimited.
+     */
+    void setQueueCapacity(size_t capacity, TaskQueuePolicy policy = TASK_QUEUE_BLOCK);
+    size_t getQueueCapacity() { return m_queueCapacity; }
+    TaskQueuePolicy getQueuePolicy() { return m_queuePolicy; }
+
+    /**
+     * Used by workers when they take a Task to run
+     */
+    void taskDequeued();
+
+    /**
+     * Keep a list of every Task that has been added, for getTaskInfo().
+     * This is enabled by default, but costs a lock for every Task added
+     * and completed. Must be set before any Tasks are added.
+     */
+    void setTaskTracking(bool trackTasks) { m_trackTasks = trackTasks; }
+    bool getTaskTracking() { return m_trackTasks; }
+
+    /**
+     * Record when each Task is queued, started and finished, and how long
+     * workers spend busy and idle, for getStats(). This is disabled by
+     * default, as it reads the clock a few times for every Task.
+     */
+    void setStatsEnabled(bool statsEnabled) { m_statsEnabled = statsEnabled; }
+    bool getStatsEnabled() { return m_statsEnabled; }
+
+    TaskExecutorStats getStats();
+    void resetStats();
+
+    /**
+     * Used by workers to record a Task that has finished
+     */
+    void recordStats(Task* task);
+
+    /**
+     * Returns true if the Task has been cancelled, has missed its deadline
+     * or the executor is being destroyed, in which case it has been marked
+     * as dropped and should be completed without running
+     */
+    bool dropTask(Task* task);
+
+    /**
+     * Completes a Task that dropTask() dropped, so that anything waiting on
+     * it, or depending on it, isn't left hanging
+     */
+    void completeDropped(Task* task);
+
+    /**
+     * A work-stealing executor shared by the whole process, for things
+     * like parallelFor. It has one fewer worker than there are cores, as
+     * callers are expected to help with the work.
+     */
+    static TaskExecutor* getSharedExecutor();
+
     void wait();
 
     unsigned int getTaskCount();
+    unsigned int getQueuedCount(TaskPriority priority);
     std::vector<TaskInfo> getTaskInfo();
 
     sigc::signal<void, Task*> queuedSignal() { return m_queuedSignal; }
@@ -129,6 +1078,222 @@ class TaskExecutor
     sigc::signal<void, Task*> completeSignal() { return m_completeSignal; }
 };
 
+/**
+ * The members of a TaskGroup that haven't started yet. This is shared with
+ * the executor tasks that run them, which may outlive the group itself.
+ */
+class TaskGroupState
+{
+ private:
+    TaskExecutor* m_executor;
+    Geek::Mutex* m_mutex;
+    Geek::CondVar* m_cond; // Members finishing, or queued for the waiter
+    std::deque<Task*> m_queue;
+    std::atomic<unsigned int> m_pending;
+
+ public:
+    TaskGroupState(TaskExecutor* executor);
+    ~TaskGroupState();
+
+    void push(Task* task);
+    Task* pop();
+    void run(Task* task);
+
+    void wait();
+    unsigned int getPendingCount() { return m_pending; }
+};
+
+/**
+ * A set of Tasks that can be waited for on their own, regardless of what
+ * else the executor is doing. While waiting, the caller runs any members
+ * that haven't started yet rather than sleeping.
+ *
+ * Members are run by the group, so they don't appear in the executor's
+ * task list or signals, and can't be part of a TaskGraph.
+ */
+class TaskGroup
+{
+ private:
+    TaskExecutor* m_executor;
+    std::shared_ptr<TaskGroupState> m_state;
+
+ public:
+    TaskGroup(TaskExecutor* executor);
+
+    /**
+     * Waits for any members that are still outstanding
+     */
+    ~TaskGroup();
+
+    void addTask(Task* task);
+
+    template <typename F>
+    void run(F function)
+    {
+        addTask(InlineTask::create(function));
+    }
+
+    /**
+     * Wait for every member of the group to complete
+     */
+    void wait();
+
+    unsigned int getPendingCount() { return m_state->getPendingCount(); }
+};
+
+#define STRAND_BATCH_SIZE 32
+
+/**
+ * The queue behind a Strand, shared with the executor task that drains
+ * it, which may outlive the Strand itself.
+ */
+class StrandState : public std::enable_shared_from_this<StrandState>
+{
+ private:
+    TaskExecutor* m_executor;
+    TaskPriority m_priority;
+    FastMutex m_mutex;
+    std::deque<Task*> m_queue;
+
+    // Queued plus running. Whoever takes this from 0 schedules a runner
+    std::atomic<size_t> m_count;
+
+    void schedule();
+
+ public:
+    StrandState(TaskExecutor* executor);
+    ~StrandState();
+
+    void push(Task* task);
+
+    /**
+     * Used by the runner on the executor. drain() runs everything left,
+     * for when the runner has been dropped
+     */
+    void runBatch();
+    void drain();
+
+    void setPriority(TaskPriority priority) { m_priority = priority; }
+    size_t size() { return m_count; }
+};
+
+/**
+ * Runs Tasks one at a time, in the order they were added, on an executor's
+ * workers. Nothing is held while the strand is empty, and a busy strand
+ * only ever occupies one worker, so any number of strands can share an
+ * executor. This is useful for things that would otherwise need a lock,
+ * like writing to a Database.
+ *
+ * Tasks still queued when the Strand is destroyed will be run.
+ */
+class Strand
+{
+ private:
+    std::shared_ptr<StrandState> m_state;
+
+ public:
+    Strand(TaskExecutor* executor);
+    ~Strand();
+
+    void addTask(Task* task);
+
+    template <typename F>
+    void post(F&& function)
+    {
+        addTask(InlineTask::create(std::forward<F>(function)));
+    }
+
+    /**
+     * The priority the strand runs at on the executor
+     */
+    void setPriority(TaskPriority priority) { m_state->setPriority(priority); }
+
+    size_t size() { return m_state->size(); }
+};
+
+template <typename F>
+InlineTask* InlineTask::create(F&& function)
+{
+    typedef typename std::decay<F>::type Function;
+
+    InlineTask* task = acquire();
+    if constexpr (sizeof(Function) <= INLINE_TASK_SIZE &&
+        alignof(Function) <= alignof(std::max_align_t) &&
+        std::is_nothrow_move_constructible<Function>::value)
+    {
+        new (task->m_storage) Function(std::forward<F>(function));
+        task->m_invoke = invokeInline<Function>;
+        task->m_destroy = destroyInline<Function>;
+        if constexpr (InlineTaskHasDropped<Function>::value)
+        {
+            task->m_drop = dropInline<Function>;
+        }
+    }
+    else
+    {
+        *(Function**)task->m_storage = new Function(std::forward<F>(function));
+        task->m_invoke = invokeHeap<Function>;
+        task->m_destroy = destroyHeap<Function>;
+        if constexpr (InlineTaskHasDropped<Function>::value)
+        {
+            task->m_drop = dropHeap<Function>;
+        }
+    }
+    return task;
+}
+
+template <typename F>
+Future<typename std::invoke_result<F>::type> TaskExecutor::submit(F function)
+{
+    typedef typename std::invoke_result<F>::type T;
+
+    auto state = std::make_shared<FutureState<T>>();
+    InlineTask* task = InlineTask::create(FutureFunction<T, F>{state, function});
+    if (!addTask(task))
+    {
+        task->release();
+        state->complete(std::make_exception_ptr(std::runtime_error("TaskExecutor queue is full")));
+    }
+
+    return Future<T>(state, this);
+}
+
+template <typename T>
+template <typename F>
+Future<typename FutureContinuationResult<F, T>::type> Future<T>::then(F function)
+{
+    typedef typename FutureContinuationResult<F, T>::type R;
+
+    auto state = m_state;
+    auto next = std::make_shared<FutureState<R>>();
+    TaskExecutor* executor = m_executor;
+
+    // An exception is passed on by rethrowing it for next to catch
+    auto bound = [state, function]() mutable -> R
+    {
+        if (state->getException())
+        {
+            std::rethrow_exception(state->getException());
+        }
+
+        if constexpr (std::is_void<T>::value)
+        {
+            return function();
+        }
+        else
+        {
+            return function(state->getValue());
+        }
+    };
+
+    state->onComplete([executor, next, bound]()
+    {
+        executor->forceAddTask(InlineTask::create(FutureFunction<R, decltype(bound)>{next, bound}));
+    });
+
+    return Future<R>(next, executor);
+}
+
 };
 };
 
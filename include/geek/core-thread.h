@@ -1,9 +1,15 @@
 #ifndef __LIBGEEK_THREAD_H_
 #define __LIBGEEK_THREAD_H_
 
+#include <chrono>
+#include <functional>
+#include <string>
 #include <vector>
+#include <stddef.h>
 #include <stdint.h>
 
+#include <geek/core-arena.h>
+
 namespace Geek {
 
 enum thread_state_t
@@ -13,6 +19,31 @@ enum thread_state_t
     THREAD_COMPLETE
 };
 
+enum ThreadPriority
+{
+    THREAD_PRIORITY_LOW,
+    THREAD_PRIORITY_NORMAL,
+    THREAD_PRIORITY_HIGH,
+};
+
+/**
+ * How a thread should be created. These are hints: anything the platform
+ * doesn't support (or we don't have permission for) is ignored.
+ */
+struct ThreadAttributes
+{
+    // Shown in debuggers and top. Linux truncates names to 15 characters
+    std::string name;
+
+    // In bytes, 0 for the default
+    size_t stackSize = 0;
+
+    // The CPUs the thread may run on, empty for any. Only supported on Linux
+    std::vector<int> affinity;
+
+    ThreadPriority priority = THREAD_PRIORITY_NORMAL;
+};
+
 class Mutex
 {
  protected:
@@ -25,6 +56,17 @@ class Mutex
     virtual void unlock() = 0;
 };
 
+/**
+ * Waits are always paired with a Mutex, which the caller must hold. It is
+ * released while waiting and held again on return, so a signal sent by
+ * someone holding the same Mutex can never be missed.
+ *
+ * Older code called wait() and wait(timeoutms) without a Mutex. These
+ * still work, but can miss a signal sent just before the wait starts, so
+ * callers had to poll. To migrate, guard the condition with a Mutex, hold
+ * it while changing the condition and signalling, and replace the loop
+ * with waitUntil(mutex, predicate).
+ */
 class CondVar
 {
  protected:
@@ -32,9 +74,177 @@ class CondVar
  public:
     virtual ~CondVar();
 
-    virtual bool wait();
-    virtual bool wait(uint64_t timeoutms);
-    virtual bool signal();
+    /**
+     * May return spuriously, prefer waitUntil()
+     */
+    virtual bool wait(Mutex* mutex) = 0;
+
+    /**
+     * Returns false if the timeout expired
+     */
+    virtual bool wait(Mutex* mutex, uint64_t timeoutms) = 0;
+
+    /**
+     * Waits until at most the given Clock::getTime(), for when a ms
+     * timeout isn't precise enough. Returns false if it passed
+     */
+    virtual bool waitUntilTime(Mutex* mutex, uint64_t time) = 0;
+
+    /**
+     * Wakes one waiter
+     */
+    virtual bool signal() = 0;
+
+    /**
+     * Wakes every waiter
+     */
+    virtual bool broadcast() = 0;
+
+    /**
+     * Wait without a Mutex, as before waits took one. A signal sent before
+     * the wait starts is lost. A timeout of 0 waits for ever
+     */
+    [[deprecated("Pass the Mutex that guards the condition, or use waitUntil()")]]
+    virtual bool wait() = 0;
+
+    [[deprecated("Pass the Mutex that guards the condition, or use waitUntil()")]]
+    virtual bool wait(uint64_t timeoutms) = 0;
+
+    /**
+     * Waits until the predicate is true. It is only ever checked with the
+     * Mutex held
+     */
+    template <typename P>
+    void waitUntil(Mutex* mutex, P predicate)
+    {
+        while (!predicate())
+        {
+            wait(mutex);
+        }
+    }
+
+    /**
+     * Returns the final result of the predicate, which will be false if the
+     * timeout expired first
+     */
+    template <typename P>
+    bool waitUntil(Mutex* mutex, P predicate, uint64_t timeoutms)
+    {
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutms);
+        while (!predicate())
+        {
+            std::chrono::steady_clock::time_point now = std::chrono::steady_clock::now();
+            if (now >= deadline)
+            {
+                return false;
+            }
+
+            // Round up, so we don't spin for the last fraction of a ms
+            uint64_t remaining = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - now + std::chrono::microseconds(999)).count();
+            wait(mutex, remaining);
+        }
+        return true;
+    }
+};
+
+/**
+ * Per-thread state. Created the first time a thread asks for it, and
+ * destroyed when the thread exits.
+ */
+class ThreadContext
+{
+ private:
+    Arena m_arena;
+    std::vector<void*> m_values;
+    std::vector<void(*)(void*)> m_destructors;
+
+ public:
+    ThreadContext();
+    ~ThreadContext();
+
+    ThreadContext(const ThreadContext&) = delete;
+    ThreadContext& operator=(const ThreadContext&) = delete;
+
+    /**
+     * The calling thread's context
+     */
+    static ThreadContext* getCurrent();
+
+    Arena& getArena() { return m_arena; }
+
+    /**
+     * Keys are never reused, so a value can't be found by a ThreadLocal
+     * other than the one that created it
+     */
+    static unsigned int createKey();
+
+    void* getValue(unsigned int key)
+    {
+        if (key < m_values.size())
+        {
+            return m_values[key];
+        }
+        return NULL;
+    }
+
+    /**
+     * The destructor is called for the value when the thread exits
+     */
+    void setValue(unsigned int key, void* value, void (*destructor)(void*));
+};
+
+/**
+ * A separate T for each thread that uses it, created on first use. Values
+ * live until their thread exits, even if the ThreadLocal is destroyed
+ * first.
+ */
+template <typename T>
+class ThreadLocal
+{
+ private:
+    unsigned int m_key;
+    std::function<T*()> m_factory;
+
+    static void destroy(void* value)
+    {
+        delete (T*)value;
+    }
+
+ public:
+    ThreadLocal() : m_key(ThreadContext::createKey()) {}
+
+    /**
+     * The factory is called on each thread to create its value
+     */
+    explicit ThreadLocal(std::function<T*()> factory)
+        : m_key(ThreadContext::createKey()), m_factory(factory)
+    {
+    }
+
+    ThreadLocal(const ThreadLocal&) = delete;
+    ThreadLocal& operator=(const ThreadLocal&) = delete;
+
+    T& get()
+    {
+        ThreadContext* context = ThreadContext::getCurrent();
+        T* value = (T*)context->getValue(m_key);
+        if (value == NULL)
+        {
+            if (m_factory)
+            {
+                value = m_factory();
+            }
+            else
+            {
+                value = new T();
+            }
+            context->setValue(m_key, value, destroy);
+        }
+        return *value;
+    }
+
+    T& operator*() { return get(); }
+    T* operator->() { return &get(); }
 };
 
 class Thread;
@@ -49,9 +259,14 @@ class ThreadImpl
     ThreadImpl() {}
     virtual ~ThreadImpl() {}
 
-    virtual void start() = 0;
+    virtual bool start() = 0;
     virtual void wait() = 0;
 
+    /**
+     * Called on the new thread, before main()
+     */
+    virtual void applyAttributes() {}
+
     virtual Mutex* createMutex() = 0;
     virtual CondVar* createCondVar() = 0;
 };
@@ -63,6 +278,7 @@ class Thread
 
     ThreadImpl* m_impl;
     thread_state_t m_state;
+    ThreadAttributes m_attributes;
 
     //std::vector<Object*> m_listeners;
 
@@ -70,7 +286,10 @@ class Thread
     Thread();
     virtual ~Thread();
 
-    void start();
+    /**
+     * Returns false if the thread couldn't be created
+     */
+    bool start();
     void wait();
 
     bool entry();
@@ -81,6 +300,32 @@ class Thread
     thread_state_t getState() {return m_state;}
     bool isComplete() {return m_state == THREAD_COMPLETE;}
 
+    /**
+     * Attributes must be set before the thread is started
+     */
+    void setAttributes(const ThreadAttributes& attributes) { m_attributes = attributes; }
+    const ThreadAttributes& getAttributes() { return m_attributes; }
+
+    void setName(std::string name) { m_attributes.name = name; }
+    void setStackSize(size_t stackSize) { m_attributes.stackSize = stackSize; }
+    void setAffinity(std::vector<int> cpus) { m_attributes.affinity = cpus; }
+    void setPriority(ThreadPriority priority) { m_attributes.priority = priority; }
+
+    static int getCPUCount();
+
+    /**
+     * The CPUs in each NUMA node. Machines without NUMA (or platforms where
+     * we can't tell) have a single node with every CPU.
+     */
+    static std::vector<std::vector<int>> getNumaNodes();
+
+    /**
+     * The calling thread's scratch arena. TaskExecutor workers reset it
+     * after each task, so anything allocated by a task is only valid
+     * until it finishes. Elsewhere, use an ArenaScope.
+     */
+    static Arena& getArena() { return ThreadContext::getCurrent()->getArena(); }
+
     static Mutex* createMutex();// { return m_impl->createMutex(); }
     static CondVar* createCondVar();// { return m_impl->createCondVar(); }
 };
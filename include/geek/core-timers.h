@@ -1,8 +1,12 @@
 #ifndef __LIBGEEK_CORE_TIMERS_H_
 #define __LIBGEEK_CORE_TIMERS_H_
 
+#include <atomic>
 #include <string>
+#include <unordered_map>
 
+#include <geek/core-clock.h>
+#include <geek/core-tasks.h>
 #include <geek/core-thread.h>
 
 #include <sigc++/sigc++.h>
@@ -15,7 +19,92 @@ namespace Core
 enum TimerType
 {
     TIMER_ONE_SHOT,
+
+    // The next run is a period after the last one actually ran, so any
+    // delay pushes back every run after it
     TIMER_PERIODIC,
+
+    // Runs on a fixed timeline of whole periods from when it was added, so
+    // delays don't accumulate. For things like frame rates
+    TIMER_FIXED_RATE,
+};
+
+/**
+ * What a TIMER_FIXED_RATE timer does about ticks it has already missed
+ */
+enum TimerCatchUp
+{
+    // Drop them, and wait for the next tick on the timeline
+    TIMER_SKIP,
+
+    // Run them back to back, up to TIMER_MAX_CATCH_UP of them
+    TIMER_CATCH_UP,
+};
+
+#define TIMER_MAX_CATCH_UP 8
+
+// How many recent frames TIMER_FIXED_RATE timers keep times for
+#define TIMER_FRAME_WINDOW 256
+
+// The wheel has levels of 64 slots (one uint64_t bitmap per level), each
+// level's slots covering 64 times as long as the one below. Level 0 has a
+// slot per tick, and 7 levels of us ticks reach about 51 days.
+#define TIMER_WHEEL_BITS 6
+#define TIMER_WHEEL_SLOTS (1 << TIMER_WHEEL_BITS)
+#define TIMER_WHEEL_MASK (TIMER_WHEEL_SLOTS - 1)
+#define TIMER_WHEEL_LEVELS 7
+#define TIMER_WHEEL_TICK_NS 1000ull
+
+class TimerManager;
+
+/**
+ * Lateness is how long after a timer was due its callback started, in ns
+ */
+struct TimerStats
+{
+    uint64_t fired;
+    uint64_t lastLateness;
+    uint64_t maxLateness;
+    uint64_t totalLateness;
+
+    uint64_t getMeanLateness() { return fired > 0 ? totalLateness / fired : 0; }
+};
+
+/**
+ * For TIMER_FIXED_RATE timers. Frame times are the intervals between
+ * their callbacks starting, in ns, over the last TIMER_FRAME_WINDOW frames
+ */
+struct TimerFrameStats
+{
+    uint64_t frames;
+    uint64_t skipped;
+
+    uint64_t minFrameTime;
+    uint64_t maxFrameTime;
+    uint64_t meanFrameTime;
+    uint64_t p99FrameTime;
+};
+
+struct TimerFrames
+{
+    Geek::FastMutex mutex;
+    uint64_t times[TIMER_FRAME_WINDOW];
+    size_t count;
+    size_t pos;
+    uint64_t lastStart;
+    uint64_t frames;
+    uint64_t skipped;
+};
+
+struct TimerManagerStats
+{
+    // Times the timer thread woke up and found timers to fire
+    uint64_t wakeups;
+    uint64_t timersFired;
+
+    // How many more wakeups firing every timer exactly when it was due
+    // would have taken
+    uint64_t wakeupsSaved;
 };
 
 class Timer
@@ -23,12 +112,52 @@ class Timer
  private:
     std::string m_id;
     TimerType m_type;
-    uint64_t m_period;
+    uint64_t m_periodMicros;
+    uint64_t m_slackMicros;
     sigc::signal<void, Timer*> m_signal;
     void* m_data;
 
     bool m_active;
     uint64_t m_nextRun;
+    Strand* m_strand;
+    TimerCatchUp m_catchUp;
+    TimerFrames* m_frames; // Only for TIMER_FIXED_RATE
+
+    std::atomic<uint64_t> m_fired;
+    std::atomic<uint64_t> m_lastLateness;
+    std::atomic<uint64_t> m_maxLateness;
+    std::atomic<uint64_t> m_totalLateness;
+
+    // Our place in the TimerWheel
+    friend class TimerWheel;
+    bool m_scheduled;
+    unsigned int m_wheelLevel;
+    unsigned int m_wheelSlot;
+    Timer* m_wheelPrev;
+    Timer* m_wheelNext;
+    uint64_t m_wheelExpires; // In ticks, after slack
+
+    void init()
+    {
+        m_catchUp = TIMER_SKIP;
+        m_frames = NULL;
+        if (m_type == TIMER_FIXED_RATE)
+        {
+            m_frames = new TimerFrames();
+            resetFrameStats();
+        }
+
+        m_slackMicros = 0;
+        m_wheelExpires = 0;
+        m_nextRun = 0;
+        m_strand = NULL;
+        resetStats();
+        m_scheduled = false;
+        m_wheelLevel = 0;
+        m_wheelSlot = 0;
+        m_wheelPrev = NULL;
+        m_wheelNext = NULL;
+    }
 
  public:
 
@@ -36,55 +165,237 @@ class Timer
     {
         m_id = id;
         m_type = type;
-        m_period = period;
+        m_periodMicros = period * 1000ull;
         m_data = NULL;
         m_active = false;
+        init();
     }
 
     Timer(TimerType type, uint64_t period)
     {
         m_id = "";
         m_type = type;
-        m_period = period;
+        m_periodMicros = period * 1000ull;
         m_data = NULL;
         m_active = false;
+        init();
     }
 
+    ~Timer()
+    {
+        delete m_frames;
+    }
+
+    Timer(const Timer&) = delete;
+    Timer& operator=(const Timer&) = delete;
+
     std::string getId() { return m_id; }
     TimerType getType() { return m_type; }
-    uint64_t getPeriod() { return m_period; }
-    void setPeriod(uint64_t period) { m_period = period; }
+
+    /**
+     * In ms
+     */
+    uint64_t getPeriod() { return m_periodMicros / 1000ull; }
+    void setPeriod(uint64_t period) { m_periodMicros = period * 1000ull; }
+
+    /**
+     * For periods that aren't a whole number of ms, such as frame rates
+     */
+    uint64_t getPeriodMicros() { return m_periodMicros; }
+    void setPeriodMicros(uint64_t period) { m_periodMicros = period; }
+
+    /**
+     * How late the timer may fire, in ms. Timers that can fire at the same
+     * time are batched into one wakeup
+     */
+    uint64_t getSlack() { return m_slackMicros / 1000ull; }
+    void setSlack(uint64_t slack) { m_slackMicros = slack * 1000ull; }
+    uint64_t getSlackMicros() { return m_slackMicros; }
+    void setSlackMicros(uint64_t slack) { m_slackMicros = slack; }
+
     sigc::signal<void, Timer*> signal() { return m_signal; }
 
     void setData(void* data) { m_data = data; }
     void* getData() { return m_data; }
 
-    void setNextRun(uint64_t next) { m_nextRun = next; } 
+    /**
+     * When the timer is next due, from Clock::getTime()
+     */
+    void setNextRun(uint64_t next) { m_nextRun = next; }
     uint64_t getNextRun() { return m_nextRun; }
 
     void setActive(bool active) { m_active = active; }
     bool isActive() { return m_active; }
+
+    /**
+     * Run this timer's callbacks on a strand, so they never overlap even if
+     * one takes longer than the period. Takes precedence over the
+     * TimerManager's executor
+     */
+    void setStrand(Strand* strand) { m_strand = strand; }
+    Strand* getStrand() { return m_strand; }
+
+    void setCatchUp(TimerCatchUp catchUp) { m_catchUp = catchUp; }
+    TimerCatchUp getCatchUp() { return m_catchUp; }
+
+    void recordLateness(uint64_t lateness);
+    TimerStats getStats();
+    void resetStats();
+
+    void recordFrame(uint64_t start);
+    void recordSkipped(uint64_t skipped);
+    TimerFrameStats getFrameStats();
+    void resetFrameStats();
 };
 
-class TimerManager : public Geek::Thread
+/**
+ * Schedules Timers, for TimerManager and EventLoop. It isn't thread safe,
+ * so the owner must lock around everything but fire().
+ */
+class TimerWheel
 {
  private:
-    Geek::CondVar* m_condVar;
+    Timer* m_slots[TIMER_WHEEL_LEVELS][TIMER_WHEEL_SLOTS];
+    uint64_t m_occupied[TIMER_WHEEL_LEVELS];
+    uint64_t m_time; // The last tick that has been processed
+    size_t m_timerCount;
+
+    // Only timers with an id
+    std::unordered_multimap<std::string, Timer*> m_timersById;
+
+    TaskHistogram m_lateness;
+    TimerManagerStats m_stats;
+
+    void schedule(Timer* timer);
+    void unschedule(Timer* timer);
+    void index(Timer* timer);
+    void unindex(Timer* timer);
+
+    /**
+     * When something next needs to happen, either a timer firing or a slot
+     * cascading down to a lower level. 0 if there are no timers
+     */
+    uint64_t getNextTick();
+
+    /**
+     * Runs the wheel up to now, collecting the timers that are due
+     */
+    void advance(uint64_t now, std::vector<Timer*>& due);
+
+ public:
+    TimerWheel();
+
+    void add(Timer* timer, uint64_t now);
+
+    /**
+     * Add the timer to first run at the given time, rather than a period
+     * from now
+     */
+    void addAt(Timer* timer, uint64_t time);
+    void reset(Timer* timer, uint64_t now);
+    void cancel(Timer* timer);
+    bool isScheduled(Timer* timer) { return timer->m_scheduled; }
+    Timer* find(std::string id);
+    size_t getTimerCount() { return m_timerCount; }
+
+    /**
+     * When we next need to expire(), from Clock::getTime(). 0 if never
+     */
+    uint64_t getNextEvent();
+
+    /**
+     * Collects the timers due by now, with when each one was due, and
+     * schedules the next run of repeating timers
+     */
+    void expire(uint64_t now, std::vector<Timer*>& due, std::vector<uint64_t>& dueTimes);
+
+    /**
+     * Runs a timer's callbacks and records how late they were. This may be
+     * called from any thread
+     */
+    void fire(Timer* timer, uint64_t due);
+
+    TaskHistogramSnapshot getLateness() { return m_lateness.snapshot(); }
+    void resetLateness() { m_lateness.reset(); }
+
+    TimerManagerStats getStats() { return m_stats; }
+    void resetStats();
+};
+
+/**
+ * The timer API shared by TimerManager and EventLoop: a TimerWheel behind a
+ * lock. Subclasses decide when the wheel is expired and where timers fire,
+ * and are told whenever the next event may have changed.
+ */
+class TimerScheduler
+{
+ protected:
     Geek::Mutex* m_timersMutex;
-    std::vector<Timer*> m_timers;
+    TimerWheel m_wheel; // Protected by m_timersMutex, apart from fire()
+
+    /**
+     * Called with m_timersMutex held, after any change to the timers
+     */
+    virtual void timersChanged() = 0;
 
  public:
-    TimerManager();
-    virtual ~TimerManager();
+    TimerScheduler();
+    virtual ~TimerScheduler();
 
     /**
      * Add a timer to be scheduled.
      */
     void addTimer(Timer* timer);
+
+    /**
+     * Add a timer to first run at the given Clock::getTime(), without
+     * touching its period. Use this rather than changing the period of a
+     * timer that may still be scheduled
+     */
+    void addTimerAt(Timer* timer, uint64_t time);
     void resetTimer(Timer* timer);
     void cancelTimer(Timer* timer);
     bool isScheduled(Timer* timer);
     Timer* findTimer(std::string id);
+    size_t getTimerCount();
+
+    /**
+     * The lateness of every timer fired, in ns
+     */
+    TaskHistogramSnapshot getLateness() { return m_wheel.getLateness(); }
+    void resetLateness() { m_wheel.resetLateness(); }
+
+    TimerManagerStats getStats();
+    void resetStats();
+};
+
+class TimerManager : public Geek::Thread, public TimerScheduler
+{
+ private:
+    Geek::CondVar* m_condVar;
+    bool m_timersChanged; // Protected by m_timersMutex
+
+    // Also protected by m_timersMutex
+    TaskExecutor* m_executor;
+    TaskPriority m_priority;
+
+    void dispatch(Timer* timer, uint64_t due, TaskExecutor* executor, TaskPriority priority);
+
+ protected:
+    virtual void timersChanged();
+
+ public:
+    TimerManager();
+    virtual ~TimerManager();
+
+    /**
+     * Run timer callbacks on the executor, so firing a timer only queues
+     * it and a slow callback can't delay the others. By default they're
+     * run on the timer thread. Don't delete a Timer while its callback may
+     * still be queued.
+     */
+    void setExecutor(TaskExecutor* executor, TaskPriority priority = TASK_PRIORITY_NORMAL);
+    TaskExecutor* getExecutor() { return m_executor; }
 
     virtual bool main();
 };
@@ -31,6 +31,7 @@
 #include <map>
 
 #include <geek/core-logger.h>
+#include <geek/core-sync.h>
 #include <geek/core-thread.h>
 #include <geek/gfx-surface.h>
 
@@ -43,6 +44,8 @@ class FontHandle;
 class FontManager : public Geek::Logger
 {
  private:
+    // Written while scanning, read every time a font is opened
+    Geek::RWLock m_fontFamiliesLock;
     std::map<std::string, FontFamily*> m_fontFamilies;
 
     FT_Library m_library;
@@ -52,6 +55,7 @@ class FontManager : public Geek::Logger
     FTC_ImageCache m_imageCache;
 
     bool addFontFile(std::string path);
+    FontFamily* findFontFamily(std::string familyName);
 
  public:
 
@@ -116,7 +120,7 @@ class FontFace
 
     int m_references;
     FT_Face m_face;
-    Geek::Mutex* m_mutex;
+    Geek::FastMutex m_mutex;
 
  public:
 
@@ -135,12 +139,12 @@ class FontFace
 
     void lock()
     {
-        m_mutex->lock();
+        m_mutex.lock();
     }
 
     void unlock()
     {
-        m_mutex->unlock();
+        m_mutex.unlock();
     }
 };
 
@@ -29,6 +29,11 @@
 
 namespace Geek
 {
+namespace Core
+{
+class TaskExecutor;
+}
+
 namespace Gfx
 {
 
@@ -61,6 +66,11 @@ class Surface : public Drawable, public Geek::Logger
 
     Geek::Gfx::Surface* scaleToFit(int width, int height, bool fp = false);
     Geek::Gfx::Surface* scale(float factor, bool fp = false);
+
+    /**
+     * As scale, but spreads the rows over the executor's workers
+     */
+    Geek::Gfx::Surface* scale(float factor, bool fp, Geek::Core::TaskExecutor* executor);
     void rotate(int angle);
 
     void setAlpha(float alpha);
@@ -0,0 +1,114 @@
+
+#include <geek/core-arena.h>
+
+#include <cstdlib>
+
+using namespace std;
+using namespace Geek;
+
+Arena::Arena(size_t blockSize)
+{
+    m_current = NULL;
+    m_free = NULL;
+    m_freeCount = 0;
+    m_blockSize = blockSize;
+}
+
+Arena::~Arena()
+{
+    reset();
+    while (m_free != NULL)
+    {
+        ArenaBlock* next = m_free->next;
+        free(m_free);
+        m_free = next;
+    }
+}
+
+void* Arena::allocSlow(size_t size, size_t align)
+{
+    ArenaBlock* block = NULL;
+
+    // Blocks are max_align_t aligned, so we only need padding for more
+    size_t needed = size;
+    if (align > alignof(max_align_t))
+    {
+        needed += align;
+    }
+
+    if (needed <= m_blockSize && m_free != NULL)
+    {
+        block = m_free;
+        m_free = block->next;
+        m_freeCount--;
+    }
+    else
+    {
+        // Oversized allocations get a block to themselves
+        size_t blockSize = m_blockSize;
+        if (needed > blockSize)
+        {
+            blockSize = needed;
+        }
+        block = (ArenaBlock*)malloc(sizeof(ArenaBlock) + blockSize);
+        if (block == NULL)
+        {
+            throw bad_alloc();
+        }
+        block->size = blockSize;
+    }
+
+    block->used = 0;
+    block->next = m_current;
+    m_current = block;
+
+    return alloc(size, align);
+}
+
+void Arena::releaseBlock(ArenaBlock* block)
+{
+    if (block->size == m_blockSize && m_freeCount < ARENA_MAX_FREE_BLOCKS)
+    {
+        block->next = m_free;
+        m_free = block;
+        m_freeCount++;
+    }
+    else
+    {
+        free(block);
+    }
+}
+
+void Arena::rewind(Mark mark)
+{
+    while (m_current != NULL && m_current != mark.block)
+    {
+        ArenaBlock* next = m_current->next;
+        releaseBlock(m_current);
+        m_current = next;
+    }
+
+    if (m_current != NULL)
+    {
+        m_current->used = mark.used;
+    }
+}
+
+void Arena::reset()
+{
+    Mark mark;
+    mark.block = NULL;
+    mark.used = 0;
+    rewind(mark);
+}
+
+size_t Arena::getUsed()
+{
+    size_t used = 0;
+    ArenaBlock* block;
+    for (block = m_current; block != NULL; block = block->next)
+    {
+        used += block->used;
+    }
+    return used;
+}
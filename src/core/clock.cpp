@@ -0,0 +1,45 @@
+
+#include <geek/core-clock.h>
+
+#include <thread>
+
+#include <errno.h>
+
+using namespace std;
+using namespace Geek;
+
+uint64_t Clock::getResolution()
+{
+#if defined(__linux__)
+    struct timespec ts;
+    clock_getres(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#else
+    return chrono::duration_cast<chrono::nanoseconds>(chrono::steady_clock::duration(1)).count();
+#endif
+}
+
+void Clock::sleep(uint64_t ns)
+{
+    sleepUntil(getTime() + ns);
+}
+
+void Clock::sleepUntil(uint64_t time)
+{
+#if defined(__linux__)
+    struct timespec ts;
+    ts.tv_sec = time / 1000000000ull;
+    ts.tv_nsec = time % 1000000000ull;
+
+    // Restart if a signal interrupts us
+    while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR)
+    {
+    }
+#else
+    uint64_t now = getTime();
+    if (time > now)
+    {
+        this_thread::sleep_for(chrono::nanoseconds(time - now));
+    }
+#endif
+}
@@ -1,3 +1,4 @@
+#include <cerrno>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -6,14 +7,38 @@
 #include <cassert>
 #include "utf8.h"
 
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include <geek/core-data.h>
 #include <geek/core-string.h>
+#include <geek/core-thread.h>
 
 using namespace std;
 using namespace Geek;
 
 #define CHUNK 16384
 
+// Lets zlib use the thread's scratch arena, which is rewound afterwards
+static voidpf arenaAlloc(voidpf opaque, uInt items, uInt size)
+{
+    // Exceptions can't unwind through zlib, it reports Z_MEM_ERROR instead
+    try
+    {
+        return ((Arena*)opaque)->alloc((size_t)items * size);
+    }
+    catch (const bad_alloc&)
+    {
+        return Z_NULL;
+    }
+}
+
+static void arenaFree(voidpf opaque, voidpf address)
+{
+}
+
 Data::Data()
     : Logger("Data")
 {
@@ -64,6 +89,71 @@ bool Data::load(string filename)
     return (res == 1);
 }
 
+bool Data::loadMapped(string filename, DataAccess access)
+{
+    clear();
+    log(DEBUG, "loadMapped: Loading: %s", filename.c_str());
+    int fd = open(filename.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        log(ERROR, "loadMapped: Failed to load: %s", filename.c_str());
+        return false;
+    }
+
+    struct stat stat;
+    if (fstat(fd, &stat) == -1 || (uint64_t)stat.st_size > UINT32_MAX)
+    {
+        log(ERROR, "loadMapped: Unable to map: %s", filename.c_str());
+        close(fd);
+        return false;
+    }
+
+    if (stat.st_size == 0)
+    {
+        // There's nothing to map
+        close(fd);
+        reset();
+        return true;
+    }
+
+    void* data = mmap(nullptr, stat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED)
+    {
+        log(ERROR, "loadMapped: Failed to map: %s: %s", filename.c_str(), strerror(errno));
+        return false;
+    }
+
+    int advice = MADV_NORMAL;
+    switch (access)
+    {
+        case ACCESS_SEQUENTIAL:
+            advice = MADV_SEQUENTIAL;
+            break;
+        case ACCESS_RANDOM:
+            advice = MADV_RANDOM;
+            break;
+        case ACCESS_WILLNEED:
+            advice = MADV_WILLNEED;
+            break;
+        default:
+            break;
+    }
+    if (advice != MADV_NORMAL)
+    {
+        // Only a hint, so it doesn't matter if it fails
+        madvise(data, stat.st_size, advice);
+    }
+
+    m_data = (char*)data;
+    m_length = stat.st_size;
+    m_bufferSize = m_length;
+    m_mapped = true;
+
+    reset();
+    return true;
+}
+
 bool Data::loadCompressed(string filename, DataCompression dataCompression)
 {
     clear();
@@ -75,10 +165,13 @@ bool Data::loadCompressed(string filename, DataCompression dataCompression)
         return false;
     }
 
+    Arena& arena = Thread::getArena();
+    ArenaScope scope(arena);
+
     z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+    strm.zalloc = arenaAlloc;
+    strm.zfree = arenaFree;
+    strm.opaque = &arena;
 
     int window = 15;
     if (dataCompression == AUTO)
@@ -100,8 +193,14 @@ bool Data::loadCompressed(string filename, DataCompression dataCompression)
         return false;
     }
 
-    auto in = new uint8_t[CHUNK];
-    auto out = new uint8_t[CHUNK];
+    auto in = (uint8_t*)arenaAlloc(&arena, CHUNK, 1);
+    auto out = (uint8_t*)arenaAlloc(&arena, CHUNK, 1);
+    if (in == Z_NULL || out == Z_NULL)
+    {
+        (void) inflateEnd(&strm);
+        fclose(file);
+        return false;
+    }
     int flush;
     do
     {
@@ -110,8 +209,6 @@ bool Data::loadCompressed(string filename, DataCompression dataCompression)
         {
             (void) inflateEnd(&strm);
             fclose(file);
-            delete[] in;
-            delete[] out;
             return false;
         }
         flush = feof(file) ? Z_FINISH : Z_NO_FLUSH;
@@ -151,10 +248,13 @@ bool Data::loadCompressed(char* data, unsigned int length, DataCompression dataC
 {
     clear();
 
+    Arena& arena = Thread::getArena();
+    ArenaScope scope(arena);
+
     z_stream strm;
-    strm.zalloc = Z_NULL;
-    strm.zfree = Z_NULL;
-    strm.opaque = Z_NULL;
+    strm.zalloc = arenaAlloc;
+    strm.zfree = arenaFree;
+    strm.opaque = &arena;
 
     int window = 15;
     if (dataCompression == AUTO)
@@ -176,8 +276,13 @@ bool Data::loadCompressed(char* data, unsigned int length, DataCompression dataC
     }
 
     auto ptr = data;
-    auto in = new uint8_t[CHUNK];
-    auto out = new uint8_t[CHUNK];
+    auto in = (uint8_t*)arenaAlloc(&arena, CHUNK, 1);
+    auto out = (uint8_t*)arenaAlloc(&arena, CHUNK, 1);
+    if (in == Z_NULL || out == Z_NULL)
+    {
+        (void) inflateEnd(&strm);
+        return false;
+    }
     int flush;
     while (length > 0)
     {
@@ -225,9 +330,17 @@ void Data::clear()
 {
     if (m_data != nullptr && !m_isSub)
     {
-        free(m_data);
+        if (m_mapped)
+        {
+            munmap(m_data, m_length);
+        }
+        else
+        {
+            free(m_data);
+        }
         m_data = nullptr;
     }
+    m_mapped = false;
     m_pos = nullptr;
     m_end = nullptr;
     m_length = 0;
@@ -528,7 +641,19 @@ bool Data::append(uint8_t* data, int length)
 
         m_bufferSize += grow;
 
-        m_data = (char*) realloc(m_data, m_bufferSize);
+        if (m_mapped)
+        {
+            // The mapping is read only, so move to a copy we own
+            char* copy = (char*) malloc(m_bufferSize);
+            memcpy(copy, m_data, m_length);
+            munmap(m_data, m_length);
+            m_data = copy;
+            m_mapped = false;
+        }
+        else
+        {
+            m_data = (char*) realloc(m_data, m_bufferSize);
+        }
 
         m_pos = m_data;
         m_end = m_data + m_length;
@@ -614,7 +739,16 @@ bool Data::writeCompressed(string file, DataCompression dataCompression)
         return false;
     }
 
-    auto outBuffer = new uint8_t[CHUNK];
+    Arena& arena = Thread::getArena();
+    ArenaScope scope(arena);
+    auto outBuffer = (uint8_t*)arenaAlloc(&arena, CHUNK, 1);
+    if (outBuffer == Z_NULL)
+    {
+        log(ERROR, "writeCompressed: Failed to allocate buffer");
+        (void) deflateEnd(&stream);
+        fclose(fd);
+        return false;
+    }
 
     do
     {
@@ -625,7 +759,6 @@ bool Data::writeCompressed(string file, DataCompression dataCompression)
         if (res == Z_STREAM_ERROR)
         {
             log(ERROR, "writeCompressed: Failed to deflate buffer");
-            delete[] outBuffer;
             fclose(fd);
             return false;
         }
@@ -637,8 +770,6 @@ bool Data::writeCompressed(string file, DataCompression dataCompression)
 
     (void) deflateEnd(&stream);
 
-    delete[] outBuffer;
-
     fclose(fd);
 
     return true;
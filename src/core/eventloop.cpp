@@ -0,0 +1,431 @@
+
+#include <geek/core-eventloop.h>
+
+#if defined(__linux__)
+
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/timerfd.h>
+
+using namespace std;
+using namespace Geek;
+using namespace Geek::Core;
+
+static thread_local EventLoop* g_currentLoop = NULL;
+
+static uint32_t toEpoll(unsigned int events)
+{
+    uint32_t epollEvents = 0;
+    if (events & EVENT_READ)
+    {
+        epollEvents |= EPOLLIN | EPOLLRDHUP;
+    }
+    if (events & EVENT_WRITE)
+    {
+        epollEvents |= EPOLLOUT;
+    }
+    if (events & EVENT_EDGE)
+    {
+        epollEvents |= EPOLLET;
+    }
+    return epollEvents;
+}
+
+static unsigned int fromEpoll(uint32_t epollEvents)
+{
+    unsigned int events = 0;
+    if (epollEvents & EPOLLIN)
+    {
+        events |= EVENT_READ;
+    }
+    if (epollEvents & EPOLLOUT)
+    {
+        events |= EVENT_WRITE;
+    }
+    if (epollEvents & EPOLLERR)
+    {
+        events |= EVENT_ERROR;
+    }
+    if (epollEvents & (EPOLLHUP | EPOLLRDHUP))
+    {
+        events |= EVENT_HANGUP;
+    }
+    return events;
+}
+
+EventLoop::EventLoop()
+    : Logger("EventLoop")
+{
+    m_stopped = false;
+    m_wakePending = false;
+    m_timerArmed = 0;
+
+    m_epollFd = epoll_create1(EPOLL_CLOEXEC);
+    m_timerFd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    m_wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (m_epollFd == -1 || m_timerFd == -1 || m_wakeFd == -1)
+    {
+        log(ERROR, "EventLoop: Failed to create fds: %s", strerror(errno));
+        closeFds();
+        return;
+    }
+
+    if (!control(EPOLL_CTL_ADD, m_timerFd, EVENT_READ) || !control(EPOLL_CTL_ADD, m_wakeFd, EVENT_READ))
+    {
+        closeFds();
+    }
+}
+
+EventLoop::~EventLoop()
+{
+    closeFds();
+}
+
+void EventLoop::closeFds()
+{
+    if (m_wakeFd != -1)
+    {
+        close(m_wakeFd);
+        m_wakeFd = -1;
+    }
+    if (m_timerFd != -1)
+    {
+        close(m_timerFd);
+        m_timerFd = -1;
+    }
+    if (m_epollFd != -1)
+    {
+        close(m_epollFd);
+        m_epollFd = -1;
+    }
+}
+
+EventLoop* EventLoop::getCurrent()
+{
+    return g_currentLoop;
+}
+
+bool EventLoop::control(int op, int fd, unsigned int events)
+{
+    if (m_epollFd == -1)
+    {
+        return false;
+    }
+
+    struct epoll_event event = {};
+    event.events = toEpoll(events);
+    event.data.fd = fd;
+    if (epoll_ctl(m_epollFd, op, fd, &event) == -1)
+    {
+        log(ERROR, "control: Failed to update fd %d: %s", fd, strerror(errno));
+        return false;
+    }
+    return true;
+}
+
+bool EventLoop::addFd(int fd, unsigned int events, EventCallback callback)
+{
+    shared_ptr<Handler> handler = make_shared<Handler>();
+    handler->fd = fd;
+    handler->events = events;
+    handler->callback = callback;
+
+    LockGuard<FastMutex> guard(m_handlersMutex);
+    if (m_handlers.count(fd) > 0 || !control(EPOLL_CTL_ADD, fd, events))
+    {
+        return false;
+    }
+    m_handlers[fd] = handler;
+    return true;
+}
+
+bool EventLoop::modifyFd(int fd, unsigned int events)
+{
+    LockGuard<FastMutex> guard(m_handlersMutex);
+    unordered_map<int, shared_ptr<Handler>>::iterator it = m_handlers.find(fd);
+    if (it == m_handlers.end() || !control(EPOLL_CTL_MOD, fd, events))
+    {
+        return false;
+    }
+    it->second->events = events;
+    return true;
+}
+
+bool EventLoop::removeFd(int fd)
+{
+    LockGuard<FastMutex> guard(m_handlersMutex);
+    if (m_handlers.erase(fd) == 0)
+    {
+        return false;
+    }
+    return control(EPOLL_CTL_DEL, fd, 0);
+}
+
+void EventLoop::post(function<void()> func)
+{
+    {
+        LockGuard<FastMutex> guard(m_postedMutex);
+        m_posted.push_back(func);
+    }
+
+    // The loop will get to it before it next waits
+    if (!isInLoop() && !m_wakePending.exchange(true))
+    {
+        wake();
+    }
+}
+
+void EventLoop::wake()
+{
+    if (!isValid())
+    {
+        return;
+    }
+
+    uint64_t value = 1;
+    ssize_t res = write(m_wakeFd, &value, sizeof(value));
+    (void)res; // Only fails if the counter is already huge, so we're awake
+}
+
+void EventLoop::stop()
+{
+    m_stopped = true;
+    wake();
+}
+
+void EventLoop::armTimer()
+{
+    uint64_t next = m_wheel.getNextEvent();
+    if (!isValid() || next == m_timerArmed)
+    {
+        return;
+    }
+
+    // Both use CLOCK_MONOTONIC, so the wheel's times can be used as they are.
+    // All zeros disarms it
+    struct itimerspec spec = {};
+    spec.it_value.tv_sec = next / 1000000000ull;
+    spec.it_value.tv_nsec = next % 1000000000ull;
+    if (timerfd_settime(m_timerFd, TFD_TIMER_ABSTIME, &spec, NULL) == -1)
+    {
+        log(ERROR, "armTimer: Failed to set timer: %s", strerror(errno));
+        return;
+    }
+    m_timerArmed = next;
+}
+
+void EventLoop::runTimers()
+{
+    uint64_t expirations;
+    ssize_t res = read(m_timerFd, &expirations, sizeof(expirations));
+    (void)res; // EAGAIN if it was re-armed since it went off
+
+    vector<Timer*> due;
+    vector<uint64_t> dueTimes;
+    {
+        LockGuard<Mutex> guard(*m_timersMutex);
+
+        // The timerfd isn't armed any more, whatever we think
+        m_timerArmed = 0;
+        m_wheel.expire(Clock::getTime(), due, dueTimes);
+        armTimer();
+    }
+
+    size_t i;
+    for (i = 0; i < due.size(); i++)
+    {
+        Timer* timer = due[i];
+        uint64_t dueTime = dueTimes[i];
+        Strand* strand = timer->getStrand();
+        if (strand != NULL)
+        {
+            strand->post([this, timer, dueTime]() { m_wheel.fire(timer, dueTime); });
+        }
+        else
+        {
+            m_wheel.fire(timer, dueTime);
+        }
+    }
+}
+
+void EventLoop::runPosted()
+{
+    // Clear this first, so anything posted after we take the queue wakes us
+    m_wakePending = false;
+
+    vector<function<void()>> posted;
+    {
+        LockGuard<FastMutex> guard(m_postedMutex);
+        posted.swap(m_posted);
+    }
+
+    for (function<void()>& func : posted)
+    {
+        func();
+    }
+}
+
+int EventLoop::runOnce(int timeoutms)
+{
+    if (!isValid())
+    {
+        return -1;
+    }
+
+    EventLoop* previous = g_currentLoop;
+    g_currentLoop = this;
+
+    // Anything posted from the loop itself didn't wake us
+    runPosted();
+
+    struct epoll_event events[EVENT_LOOP_MAX_EVENTS];
+    int count = epoll_wait(m_epollFd, events, EVENT_LOOP_MAX_EVENTS, timeoutms);
+    if (count == -1)
+    {
+        if (errno != EINTR)
+        {
+            log(ERROR, "runOnce: epoll_wait failed: %s", strerror(errno));
+        }
+        count = 0;
+    }
+
+    int handled = 0;
+    bool timers = false;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        int fd = events[i].data.fd;
+        if (fd == m_wakeFd)
+        {
+            uint64_t value;
+            ssize_t res = read(m_wakeFd, &value, sizeof(value));
+            (void)res;
+            continue;
+        }
+        if (fd == m_timerFd)
+        {
+            timers = true;
+            continue;
+        }
+
+        // Hold on to the handler, so it can be removed by its own callback
+        shared_ptr<Handler> handler;
+        {
+            LockGuard<FastMutex> guard(m_handlersMutex);
+            unordered_map<int, shared_ptr<Handler>>::iterator it = m_handlers.find(fd);
+            if (it != m_handlers.end())
+            {
+                handler = it->second;
+            }
+        }
+        if (handler != NULL)
+        {
+            handler->callback(fd, fromEpoll(events[i].events));
+            handled++;
+        }
+    }
+
+    if (timers)
+    {
+        runTimers();
+    }
+    runPosted();
+
+    g_currentLoop = previous;
+    return handled;
+}
+
+void EventLoop::run()
+{
+    if (!isValid())
+    {
+        log(ERROR, "run: The loop couldn't be set up");
+        return;
+    }
+
+    while (!m_stopped)
+    {
+        runOnce(-1);
+    }
+
+    // Used up, so the loop can be run again
+    m_stopped = false;
+}
+
+bool EventLoop::main()
+{
+    run();
+    return true;
+}
+
+EventLoopGroup::EventLoopGroup(int count, bool pin)
+{
+    int cpus = Thread::getCPUCount();
+    if (count <= 0)
+    {
+        count = cpus;
+    }
+
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        EventLoop* loop = new EventLoop();
+        loop->setName("EventLoop " + to_string(i));
+        if (pin && cpus > 0)
+        {
+            loop->setAffinity({i % cpus});
+        }
+        m_loops.push_back(loop);
+    }
+    m_next = 0;
+    m_started = false;
+}
+
+EventLoopGroup::~EventLoopGroup()
+{
+    stop();
+    for (EventLoop* loop : m_loops)
+    {
+        delete loop;
+    }
+}
+
+void EventLoopGroup::start()
+{
+    if (m_started)
+    {
+        return;
+    }
+    for (EventLoop* loop : m_loops)
+    {
+        loop->start();
+    }
+    m_started = true;
+}
+
+void EventLoopGroup::stop()
+{
+    if (!m_started)
+    {
+        return;
+    }
+    for (EventLoop* loop : m_loops)
+    {
+        loop->stop();
+    }
+    for (EventLoop* loop : m_loops)
+    {
+        loop->wait();
+    }
+    m_started = false;
+}
+
+EventLoop* EventLoopGroup::next()
+{
+    return m_loops.at(m_next++ % m_loops.size());
+}
+
+#endif
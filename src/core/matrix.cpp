@@ -20,6 +20,7 @@
 
 
 #include <geek/core-matrix.h>
+#include <geek/core-parallel.h>
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -81,17 +82,21 @@ void CentredMatrix::fill(
 
 void CentredMatrix::convolve_mat(const CentredMatrix* mata, const CentredMatrix* matb)
 {
-    int xr;
-    int yr;
-    int xa;
-    int ya;
+    convolve_mat(mata, matb, nullptr);
+}
 
-    for (yr = -m_radius; yr <= m_radius; yr++)
+void CentredMatrix::convolve_mat(const CentredMatrix* mata, const CentredMatrix* matb, Geek::Core::TaskExecutor* executor)
+{
+    auto convolveRow = [this, mata, matb](int64_t yr)
     {
+        int xr;
+        int xa;
+        int ya;
+
         for (xr = -m_radius; xr <= m_radius; xr++)
         {
-            const int ya_low = MAX (-mata->m_radius, -matb->m_radius - yr);
-            const int ya_high = MIN (mata->m_radius, matb->m_radius - yr);
+            const int ya_low = MAX (-mata->m_radius, -matb->m_radius - (int)yr);
+            const int ya_high = MIN (mata->m_radius, matb->m_radius - (int)yr);
             const int xa_low = MAX (-mata->m_radius, -matb->m_radius - xr);
             const int xa_high = MIN (mata->m_radius, matb->m_radius - xr);
             double val = 0.0;
@@ -105,6 +110,22 @@ void CentredMatrix::convolve_mat(const CentredMatrix* mata, const CentredMatrix*
             }
             set(xr, yr, val);
         }
+    };
+
+    if (executor == nullptr)
+    {
+        int64_t yr;
+        for (yr = -m_radius; yr <= m_radius; yr++)
+        {
+            convolveRow(yr);
+        }
+    }
+    else
+    {
+        // Small matrices will end up as a single chunk and run on this thread
+        int64_t rowCost = (int64_t)m_stride * mata->m_stride * mata->m_stride;
+        int64_t grain = MAX(1, 65536 / rowCost);
+        Geek::Core::parallelFor(executor, -m_radius, m_radius + 1, grain, convolveRow);
     }
 }
 
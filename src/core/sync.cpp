@@ -0,0 +1,72 @@
+
+#include <geek/core-sync.h>
+
+#if defined(__linux__)
+#include <errno.h>
+#include <time.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using namespace std;
+using namespace Geek;
+
+#if defined(__linux__)
+static int futexWait(atomic<int>* address, int value, const struct timespec* timeout = NULL)
+{
+    return syscall(SYS_futex, (int*)address, FUTEX_WAIT_PRIVATE, value, timeout, NULL, 0);
+}
+
+static void futexWake(atomic<int>* address, int count)
+{
+    syscall(SYS_futex, (int*)address, FUTEX_WAKE_PRIVATE, count, NULL, NULL, 0);
+}
+
+void FastMutex::lockSlow()
+{
+    // The holder may be about to release it, so spin a little first
+    int spins;
+    for (spins = 0; spins < FAST_MUTEX_SPINS; spins++)
+    {
+        if (m_state.load(std::memory_order_relaxed) == 0 && tryLock())
+        {
+            return;
+        }
+        cpuRelax();
+    }
+
+    // Mark it as contended, so whoever unlocks it knows to wake us
+    int state = m_state.exchange(2, memory_order_acquire);
+    while (state != 0)
+    {
+        futexWait(&m_state, 2);
+        state = m_state.exchange(2, memory_order_acquire);
+    }
+}
+
+void FastMutex::unlockSlow()
+{
+    futexWake(&m_state, 1);
+}
+
+bool FastCondVar::waitSlow(int sequence, int64_t timeoutms)
+{
+    if (timeoutms < 0)
+    {
+        futexWait(&m_sequence, sequence);
+        return true;
+    }
+
+    // FUTEX_WAIT's timeout is relative, and measured on CLOCK_MONOTONIC
+    struct timespec timeout;
+    timeout.tv_sec = timeoutms / 1000;
+    timeout.tv_nsec = (timeoutms % 1000) * 1000000L;
+    return futexWait(&m_sequence, sequence, &timeout) == 0 || errno != ETIMEDOUT;
+}
+
+void FastCondVar::wake(int count)
+{
+    futexWake(&m_sequence, count);
+}
+#endif
@@ -1,6 +1,12 @@
 
 #include <geek/core-tasks.h>
+#include <geek/core-clock.h>
 
+#include <algorithm>
+#include <chrono>
+#include <map>
+#include <mutex>
+#include <set>
 #include <thread>
 
 using namespace std;
@@ -8,15 +14,20 @@ using namespace Geek::Core;
 
 TaskExecutor::TaskExecutor()
 {
-    init(0);
+    init(0, TASK_EXECUTOR_TRANSIENT);
 }
 
 TaskExecutor::TaskExecutor(int maxWorkers)
 {
-    init(maxWorkers);
+    init(maxWorkers, TASK_EXECUTOR_TRANSIENT);
 }
 
-void TaskExecutor::init(int maxWorkers)
+TaskExecutor::TaskExecutor(int maxWorkers, TaskExecutorMode mode)
+{
+    init(maxWorkers, mode);
+}
+
+void TaskExecutor::init(int maxWorkers, TaskExecutorMode mode)
 {
     if (maxWorkers == 0)
     {
@@ -30,193 +41,1610 @@ void TaskExecutor::init(int maxWorkers)
     }
 
     m_maxWorkers = maxWorkers;
+    m_mode = mode;
+
+    m_statsEnabled = false;
+    m_tasksQueued = 0;
+    m_tasksCompleted = 0;
+    m_tasksCancelled = 0;
+    m_tasksExpired = 0;
+    m_shutdown = false;
+    m_pendingTasks = 0;
+    m_idleCount = 0;
+    m_queueing = 0;
+    m_queueCapacity = 0;
+    m_queuePolicy = TASK_QUEUE_BLOCK;
+    m_queued = 0;
+    m_capacityWaiters = 0;
+    m_trackTasks = true;
+    m_taskCount = 0;
     m_tasksMutex = Thread::createMutex();
     m_queueMutex = Thread::createMutex();
     m_workersMutex = Thread::createMutex();
     m_queueEmpty = Thread::createCondVar();
+    m_queueSpace = Thread::createCondVar();
+
+    if (isPersistent())
+    {
+        vector<vector<int>> nodes;
+        if (m_mode == TASK_EXECUTOR_NUMA)
+        {
+            nodes = Thread::getNumaNodes();
+        }
+
+        unsigned int i;
+        for (i = 0; i < m_maxWorkers; i++)
+        {
+            TaskWorker* worker = new TaskWorker(this, i);
+            worker->setName("geek-worker-" + to_string(i));
+            if (!nodes.empty())
+            {
+                // Spread workers evenly over the nodes
+                unsigned int node = i % nodes.size();
+                worker->setNode(node);
+                worker->setAffinity(nodes.at(node));
+            }
+            m_workers.push_back(worker);
+        }
+
+        // Steal from our neighbours first, and from other nodes last
+        for (TaskWorker* worker : m_workers)
+        {
+            vector<TaskWorker*> victims;
+            for (i = 1; i < m_maxWorkers; i++)
+            {
+                victims.push_back(m_workers.at((worker->getIndex() + i) % m_maxWorkers));
+            }
+            stable_partition(victims.begin(), victims.end(), [worker](TaskWorker* victim)
+            {
+                return victim->getNode() == worker->getNode();
+            });
+            worker->setVictims(victims);
+        }
+
+        for (TaskWorker* worker : m_workers)
+        {
+            worker->start();
+        }
+    }
 }
 
 TaskExecutor::~TaskExecutor()
 {
+    if (isPersistent())
+    {
+        m_queueMutex->lock();
+        m_shutdown = true;
+        m_queueMutex->unlock();
+
+        // Someone may have queued the last task and still be on their way
+        // out of queueTasks()
+        {
+            LockGuard<FastMutex> guard(m_queueingMutex);
+            m_queueingDone.waitUntil(m_queueingMutex, [this]() { return m_queueing == 0; });
+        }
+
+        for (TaskWorker* worker : m_workers)
+        {
+            worker->wake();
+        }
+
+        for (TaskWorker* worker : m_workers)
+        {
+            worker->wait();
+        }
+
+        // Anything left in the queues will never be run, so drop it
+        for (TaskWorker* worker : m_workers)
+        {
+            for (Task* task : worker->drainLocal())
+            {
+                m_queue.push(task);
+            }
+            delete worker;
+        }
+        m_workers.clear();
+
+        // Dropping a Task releases its dependents, which are queued for us
+        // to drop in turn
+        Task* task;
+        while ((task = m_queue.pop()) != NULL)
+        {
+            taskDequeued();
+            dropTask(task);
+            completeDropped(task);
+            removeTask(task);
+            task->release();
+        }
+
+        // Transient workers may still be on their way out when wait()
+        // returns, so we can only clean these up when we've joined them all
+        delete m_queueSpace;
+        delete m_queueEmpty;
+        delete m_workersMutex;
+        delete m_queueMutex;
+        delete m_tasksMutex;
+    }
+}
+
+TaskExecutor* TaskExecutor::getSharedExecutor()
+{
+    // This is never deleted, as it may still be in use while other static
+    // objects are being destroyed at exit
+    static TaskExecutor* sharedExecutor = NULL;
+    static once_flag sharedOnce;
+
+    call_once(sharedOnce, []()
+    {
+        int workers = (int)std::thread::hardware_concurrency() - 1;
+        if (workers < 1)
+        {
+            workers = 1;
+        }
+        TaskExecutorMode mode = TASK_EXECUTOR_WORK_STEALING;
+        if (Thread::getNumaNodes().size() > 1)
+        {
+            mode = TASK_EXECUTOR_NUMA;
+        }
+        sharedExecutor = new TaskExecutor(workers, mode);
+    });
+
+    return sharedExecutor;
+}
+
+bool TaskExecutor::addTask(Task* task, TaskPriority priority)
+{
+    task->setPriority(priority);
+    return addTask(task);
 }
 
 bool TaskExecutor::addTask(Task* task)
 {
-    unsigned int size;
+    if (!reserveCapacity(1, m_queuePolicy == TASK_QUEUE_BLOCK))
+    {
+        return false;
+    }
+    acceptTasks(&task, 1);
+    queueTasks(&task, 1);
+    return true;
+}
 
-    m_workersMutex->lock();
-    size = m_workers.size();
-    m_workersMutex->unlock();
+bool TaskExecutor::tryAddTask(Task* task)
+{
+    if (!reserveCapacity(1, false))
+    {
+        return false;
+    }
+    acceptTasks(&task, 1);
+    queueTasks(&task, 1);
+    return true;
+}
 
-    m_tasksMutex->lock();
-    m_tasks.push_back(task);
-    m_tasksMutex->unlock();
+bool TaskExecutor::forceAddTask(Task* task)
+{
+    if (m_queueCapacity > 0)
+    {
+        m_queued++;
+    }
+    acceptTasks(&task, 1);
+    queueTasks(&task, 1);
+    return true;
+}
 
-    if (size < m_maxWorkers)
+bool TaskExecutor::addTasks(const vector<Task*>& tasks)
+{
+    if (tasks.empty())
     {
-        startTask(task);
+        return true;
     }
-    else
+
+    if (!reserveCapacity(tasks.size(), m_queuePolicy == TASK_QUEUE_BLOCK))
     {
-        m_queuedSignal.emit(task);
+        return false;
+    }
 
-        m_queueMutex->lock();
-        task->setState(TASK_QUEUED);
-        m_queue.push_back(task);
-        m_queueMutex->unlock();
+    // Copy, as once queued the tasks may complete and be deleted
+    vector<Task*> queue = tasks;
+    acceptTasks(queue.data(), queue.size());
+    queueTasks(queue.data(), queue.size());
+    return true;
+}
+
+bool TaskExecutor::addGraph(TaskGraph* graph)
+{
+    if (!graph->isValid())
+    {
+        return false;
+    }
+
+    if (!reserveCapacity(graph->size(), m_queuePolicy == TASK_QUEUE_BLOCK))
+    {
+        return false;
+    }
+
+    vector<Task*> tasks = graph->release();
+    acceptTasks(tasks.data(), tasks.size());
+
+    // Work out what can run before queueing anything, as once a task is
+    // queued it (and its dependents) may complete and be deleted
+    vector<Task*> ready;
+    for (Task* task : tasks)
+    {
+        if (task->getPendingDependencies() == 0)
+        {
+            ready.push_back(task);
+        }
+        else
+        {
+            task->setState(TASK_WAITING);
+        }
     }
 
+    queueTasks(ready.data(), ready.size());
+
     return true;
 }
 
-void TaskExecutor::wait()
+void TaskExecutor::setQueueCapacity(size_t capacity, TaskQueuePolicy policy)
+{
+    m_queueCapacity = capacity;
+    m_queuePolicy = policy;
+}
+
+bool TaskExecutor::reserveCapacity(size_t count, bool block)
 {
+    if (m_queueCapacity == 0)
+    {
+        return true;
+    }
+
+    // Our own workers can't wait for space, as they may be what frees it
+    TaskWorker* current = TaskWorker::getCurrentWorker();
+    if (current != NULL && current->getExecutor() == this)
+    {
+        m_queued += count;
+        return true;
+    }
+
     while (true)
     {
-        m_queueMutex->lock();
-        bool queueEmpty = m_queue.empty();
-        m_queueMutex->unlock();
-        if (queueEmpty)
+        // An empty queue always has room, so batches bigger than the
+        // capacity can still get in
+        size_t queued = m_queued;
+        if (queued == 0 || queued + count <= m_queueCapacity)
         {
-            m_workersMutex->lock();
-            bool workersEmpty = m_workers.empty();
-            m_workersMutex->unlock();
-            if (workersEmpty)
+            if (m_queued.compare_exchange_weak(queued, queued + count))
             {
-                break;
+                return true;
             }
+            continue;
+        }
+
+        if (!block)
+        {
+            return false;
         }
-        m_queueEmpty->wait();
+
+        m_queueMutex->lock();
+        m_capacityWaiters++;
+        m_queueSpace->waitUntil(m_queueMutex, [this, count]()
+        {
+            size_t queued = m_queued;
+            return queued == 0 || queued + count <= m_queueCapacity;
+        });
+        m_capacityWaiters--;
+        m_queueMutex->unlock();
     }
 }
 
-void TaskExecutor::startTask(Task* task)
+void TaskExecutor::taskDequeued()
 {
-    TaskWorker* taskWorker = new TaskWorker(this, task);
+    if (m_queueCapacity == 0)
+    {
+        return;
+    }
 
-    m_workersMutex->lock();
-    m_workers.push_back(taskWorker);
-    m_workersMutex->unlock();
+    m_queued--;
 
-    m_startedSignal.emit(task);
-    taskWorker->start();
+    // Pairs with the increment in reserveCapacity(), so either we see the
+    // waiter or it sees the space we've freed
+    if (m_capacityWaiters > 0)
+    {
+        m_queueMutex->lock();
+        m_queueSpace->broadcast();
+        m_queueMutex->unlock();
+    }
 }
 
-void TaskExecutor::taskComplete(TaskWorker* worker)
+void TaskExecutor::acceptTasks(Task** tasks, size_t count)
 {
-    m_workersMutex->lock();
-    //printf("TaskExecutor::taskComplete: Clearing worker...\n");
+    m_taskCount += count;
+    if (m_trackTasks)
+    {
+        m_tasksMutex->lock();
+        m_tasks.insert(m_tasks.end(), tasks, tasks + count);
+        m_tasksMutex->unlock();
+    }
 
-    m_tasksMutex->lock();
-    vector<Task*>::iterator taskIt;
-    for (taskIt = m_tasks.begin(); taskIt != m_tasks.end(); ++taskIt)
+    if (isPersistent())
+    {
+        m_pendingTasks += count;
+    }
+}
+
+void TaskExecutor::queueTask(Task* task)
+{
+    queueTasks(&task, 1);
+}
+
+void TaskExecutor::queueTasks(Task** tasks, size_t count)
+{
+    size_t i;
+    if (m_statsEnabled)
     {
-        if (*taskIt == worker->getTask())
+        uint64_t now = Task::getTime();
+        m_tasksQueued += count;
+        for (i = 0; i < count; i++)
         {
-            m_tasks.erase(taskIt);
-            break;
+            tasks[i]->setQueuedTime(now);
         }
     }
-    m_tasksMutex->unlock();
 
-    // Remove the completed worker from our list
-    vector<TaskWorker*>::iterator it;
-    for (it = m_workers.begin(); it != m_workers.end(); ++it)
+    if (!isPersistent())
     {
-        if (*it == worker)
+        for (i = 0; i < count; i++)
         {
-            m_workers.erase(it);
-            break;
+            startOrQueueTask(tasks[i]);
         }
+        return;
     }
 
-    m_queueMutex->lock();
-    if (!m_queue.empty())
+    // Once pushed, the tasks may complete and the executor be destroyed
+    // before we return, so let the destructor know we're still here
+    m_queueing++;
+
+    TaskWorker* current = TaskWorker::getCurrentWorker();
+    bool local = isWorkStealing() && current != NULL && current->getExecutor() == this;
+
+    for (i = 0; i < count; i++)
     {
-        //printf("TaskExecutor::taskComplete: Queue is not empty! Workers size=%lu\n", m_workers.size());
-        if (m_workers.size() < m_maxWorkers)
-        {
-            m_workersMutex->unlock();
+        Task* task = tasks[i];
+        m_queuedSignal.emit(task);
+        task->setState(TASK_QUEUED);
 
-            //printf("TaskExecutor::taskComplete: Starting another task...\n");
-            Task* next = m_queue.front();
-            m_queue.pop_front();
-            m_queueMutex->unlock();
-            startTask(next);
+        if (local && task->getPriority() == TASK_PRIORITY_NORMAL)
+        {
+            // Keep tasks spawned by our workers local to that worker. Other
+            // priorities go on the shared queue so they're ordered properly
+            current->pushLocal(task);
         }
         else
         {
-            m_workersMutex->unlock();
-            m_queueMutex->unlock();
+            m_queue.push(task);
         }
     }
-    else
+
+    // Pairs with the fence in nextTask(), so either we see the idle
+    // worker or it sees our task
+    atomic_thread_fence(memory_order_seq_cst);
+    if (m_idleCount > 0)
     {
-        //printf("TaskExecutor::taskComplete: Queue is empty!\n");
-        bool workersEmpty = m_workers.empty();
-        m_workersMutex->unlock();
-        m_queueMutex->unlock();
+        wakeIdleWorkers(count);
+    }
 
-        if (workersEmpty)
-        {
-            // No other workers, either!
-            printf("TaskExecutor::taskComplete: ... and no more workers!\n");
-            m_queueEmpty->signal();
-        }
+    LockGuard<FastMutex> guard(m_queueingMutex);
+    if (--m_queueing == 0 && m_shutdown)
+    {
+        m_queueingDone.broadcast();
     }
-    //printf("TaskExecutor::taskComplete: Done!\n");
 }
 
-unsigned int TaskExecutor::getTaskCount()
+void TaskExecutor::startOrQueueTask(Task* task)
 {
-    unsigned int count = 0;
+    unsigned int size;
 
-    m_tasksMutex->lock();
-    count = m_tasks.size();
-    m_tasksMutex->unlock();
+    m_workersMutex->lock();
+    size = m_workers.size();
+    m_workersMutex->unlock();
+
+    if (size < m_maxWorkers)
+    {
+        startTask(task);
+    }
+    else
+    {
+        m_queuedSignal.emit(task);
 
-    return count;
+        m_queueMutex->lock();
+        task->setState(TASK_QUEUED);
+        m_queue.push(task);
+        m_queueMutex->unlock();
+    }
 }
 
-vector<TaskInfo> TaskExecutor::getTaskInfo()
+void TaskExecutor::releaseDependents(Task* task)
 {
-    vector<TaskInfo> results;
-
-    m_tasksMutex->lock();
-    for (Task* task : m_tasks)
+    for (Task* dependent : task->getDependents())
     {
-        TaskInfo info;
-        info.title = task->getTitle();
-        info.state = task->getState();
-        results.push_back(info);
+        if (dependent->dependencyComplete())
+        {
+            queueTask(dependent);
+        }
     }
-    m_tasksMutex->unlock();
-
-    return results;
 }
 
-TaskWorker::TaskWorker(TaskExecutor* executor, Task* task)
+void TaskExecutor::wait()
 {
-    m_executor = executor;
-    m_task = task;
+    if (isPersistent())
+    {
+        m_queueMutex->lock();
+        m_queueEmpty->waitUntil(m_queueMutex, [this]() { return m_pendingTasks == 0; });
+        m_queueMutex->unlock();
+        return;
+    }
+
+    // taskComplete() takes m_workersMutex before m_queueMutex, so we must too
+    m_workersMutex->lock();
+    m_queueEmpty->waitUntil(m_workersMutex, [this]()
+    {
+        m_queueMutex->lock();
+        bool queueEmpty = m_queue.empty();
+        m_queueMutex->unlock();
+        return queueEmpty && m_workers.empty();
+    });
+    m_workersMutex->unlock();
 }
 
-TaskWorker::~TaskWorker()
+void TaskExecutor::startTask(Task* task)
 {
+    TaskWorker* taskWorker = new TaskWorker(this, task);
+
+    m_workersMutex->lock();
+    m_workers.push_back(taskWorker);
+    m_workersMutex->unlock();
+
+    taskWorker->start();
 }
 
-bool TaskWorker::main()
+void TaskExecutor::removeTask(Task* task)
 {
-    //printf("TaskWorker::main: Running task...\n");
-    m_task->setState(TASK_RUNNING);
-    m_task->startedSignal().emit(m_task);
+    m_taskCount--;
+    if (!m_trackTasks)
+    {
+        return;
+    }
 
-    m_task->run();
+    m_tasksMutex->lock();
+    vector<Task*>::iterator taskIt;
+    for (taskIt = m_tasks.begin(); taskIt != m_tasks.end(); ++taskIt)
+    {
+        if (*taskIt == task)
+        {
+            m_tasks.erase(taskIt);
+            break;
+        }
+    }
+    m_tasksMutex->unlock();
+}
+
+uint64_t Task::getTime()
+{
+    return Clock::getTime();
+}
+
+void TaskExecutor::recordStats(Task* task)
+{
+    m_tasksCompleted++;
+
+    // Tasks started before stats were enabled won't have been timestamped
+    if (task->getQueuedTime() != 0 && task->getStartTime() >= task->getQueuedTime())
+    {
+        m_queueWaitHistogram.record(task->getStartTime() - task->getQueuedTime());
+    }
+    m_runTimeHistogram.record(task->getFinishTime() - task->getStartTime());
+}
+
+bool TaskExecutor::dropTask(Task* task)
+{
+    if (task->isCancelled())
+    {
+        m_tasksCancelled++;
+    }
+    else if (task->getDeadline() != 0 && task->isExpired(Task::getTime()))
+    {
+        m_tasksExpired++;
+    }
+    else if (m_shutdown)
+    {
+        m_tasksCancelled++;
+    }
+    else
+    {
+        return false;
+    }
+
+    task->setState(TASK_CANCELLED);
+    task->dropped();
+    return true;
+}
+
+void TaskExecutor::completeDropped(Task* task)
+{
+    task->emitComplete();
+    m_completeSignal.emit(task);
+    releaseDependents(task);
+}
+
+TaskExecutorStats TaskExecutor::getStats()
+{
+    TaskExecutorStats stats;
+    stats.maxWorkers = m_maxWorkers;
+    stats.tasksQueued = m_tasksQueued;
+    stats.tasksCompleted = m_tasksCompleted;
+    stats.tasksCancelled = m_tasksCancelled;
+    stats.tasksExpired = m_tasksExpired;
+    stats.queueWait = m_queueWaitHistogram.snapshot();
+    stats.runTime = m_runTimeHistogram.snapshot();
+
+    if (isPersistent())
+    {
+        m_workersMutex->lock();
+        for (TaskWorker* worker : m_workers)
+        {
+            stats.workers.push_back(worker->getStats());
+        }
+        m_workersMutex->unlock();
+    }
+
+    return stats;
+}
+
+void TaskExecutor::resetStats()
+{
+    m_tasksQueued = 0;
+    m_tasksCompleted = 0;
+    m_tasksCancelled = 0;
+    m_tasksExpired = 0;
+    m_queueWaitHistogram.reset();
+    m_runTimeHistogram.reset();
+
+    if (isPersistent())
+    {
+        m_workersMutex->lock();
+        for (TaskWorker* worker : m_workers)
+        {
+            worker->resetStats();
+        }
+        m_workersMutex->unlock();
+    }
+}
+
+void TaskExecutor::wakeIdleWorkers(size_t count)
+{
+    vector<TaskWorker*> idleWorkers;
+    m_queueMutex->lock();
+    while (!m_idleWorkers.empty() && idleWorkers.size() < count)
+    {
+        idleWorkers.push_back(m_idleWorkers.back());
+        m_idleWorkers.pop_back();
+        m_idleCount--;
+    }
+    m_queueMutex->unlock();
+
+    for (TaskWorker* idleWorker : idleWorkers)
+    {
+        idleWorker->wake();
+    }
+}
+
+Task* TaskExecutor::findTask(TaskWorker* worker)
+{
+    Task* task = NULL;
+    if (isWorkStealing() && m_queue.size(TASK_PRIORITY_HIGH) == 0)
+    {
+        // High priority tasks on the shared queue go before our own
+        task = worker->popLocal();
+        if (task != NULL)
+        {
+            return task;
+        }
+    }
+
+    task = m_queue.pop();
+
+    if (task == NULL && isWorkStealing())
+    {
+        task = worker->popLocal();
+    }
+
+    if (task == NULL && isWorkStealing())
+    {
+        // Try everyone else, nearest first
+        for (TaskWorker* victim : worker->getVictims())
+        {
+            task = victim->steal();
+            if (task != NULL)
+            {
+                break;
+            }
+        }
+    }
+
+    return task;
+}
+
+Task* TaskExecutor::nextTask(TaskWorker* worker)
+{
+    while (!m_shutdown)
+    {
+        Task* task = findTask(worker);
+        if (task != NULL)
+        {
+            return task;
+        }
+
+        m_queueMutex->lock();
+        if (m_shutdown)
+        {
+            m_queueMutex->unlock();
+            break;
+        }
+        m_idleWorkers.push_back(worker);
+        m_idleCount++;
+        m_queueMutex->unlock();
+
+        // Something may have been queued while we were registering as idle
+        atomic_thread_fence(memory_order_seq_cst);
+        task = findTask(worker);
+        if (task == NULL)
+        {
+            worker->sleep();
+        }
+
+        // We may have found something rather than been woken
+        m_queueMutex->lock();
+        vector<TaskWorker*>::iterator it;
+        for (it = m_idleWorkers.begin(); it != m_idleWorkers.end(); ++it)
+        {
+            if (*it == worker)
+            {
+                m_idleWorkers.erase(it);
+                m_idleCount--;
+                break;
+            }
+        }
+        m_queueMutex->unlock();
+
+        if (task != NULL)
+        {
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+void TaskExecutor::taskComplete(TaskWorker* worker)
+{
+    if (isPersistent())
+    {
+        // Persistent workers stay alive, we just need to know when we're idle
+        if (--m_pendingTasks == 0)
+        {
+            // Take the lock, so we can't signal between a waiter checking
+            // m_pendingTasks and starting to wait
+            m_queueMutex->lock();
+            m_queueEmpty->broadcast();
+            m_queueMutex->unlock();
+        }
+        return;
+    }
+
+    m_workersMutex->lock();
+    //printf("TaskExecutor::taskComplete: Clearing worker...\n");
+
+    // Remove the completed worker from our list
+    vector<TaskWorker*>::iterator it;
+    for (it = m_workers.begin(); it != m_workers.end(); ++it)
+    {
+        if (*it == worker)
+        {
+            m_workers.erase(it);
+            break;
+        }
+    }
+
+    m_queueMutex->lock();
+    if (!m_queue.empty())
+    {
+        //printf("TaskExecutor::taskComplete: Queue is not empty! Workers size=%lu\n", m_workers.size());
+        if (m_workers.size() < m_maxWorkers)
+        {
+            m_workersMutex->unlock();
+
+            //printf("TaskExecutor::taskComplete: Starting another task...\n");
+            Task* next = m_queue.pop();
+            m_queueMutex->unlock();
+            if (next != NULL)
+            {
+                startTask(next);
+            }
+        }
+        else
+        {
+            m_workersMutex->unlock();
+            m_queueMutex->unlock();
+        }
+    }
+    else
+    {
+        //printf("TaskExecutor::taskComplete: Queue is empty!\n");
+        bool workersEmpty = m_workers.empty();
+        if (workersEmpty)
+        {
+            // No other workers, either! Signal before unlocking, as once
+            // wait() can see that we're done, the executor may be deleted
+            m_queueEmpty->broadcast();
+        }
+        m_workersMutex->unlock();
+        m_queueMutex->unlock();
+    }
+    //printf("TaskExecutor::taskComplete: Done!\n");
+}
+
+void TaskExecutor::setStarvationLimit(unsigned int limit)
+{
+    m_queue.setStarvationLimit(limit);
+}
+
+unsigned int TaskExecutor::getQueuedCount(TaskPriority priority)
+{
+    return m_queue.size(priority);
+}
+
+unsigned int TaskExecutor::getTaskCount()
+{
+    return m_taskCount;
+}
+
+vector<TaskInfo> TaskExecutor::getTaskInfo()
+{
+    vector<TaskInfo> results;
+    if (!m_trackTasks)
+    {
+        return results;
+    }
+
+    m_tasksMutex->lock();
+    for (Task* task : m_tasks)
+    {
+        TaskInfo info;
+        info.title = task->getTitle();
+        info.state = task->getState();
+        info.priority = task->getPriority();
+        results.push_back(info);
+    }
+    m_tasksMutex->unlock();
+
+    return results;
+}
+
+// Serve a lower priority after it has been passed over this many times
+#define DEFAULT_STARVATION_LIMIT 8
+
+// Each priority's ring holds this many tasks before spilling over
+#define TASK_RING_SIZE 1024
+
+TaskPriorityQueue::TaskPriorityQueue()
+{
+    int i;
+    for (i = 0; i < TASK_PRIORITY_COUNT; i++)
+    {
+        m_rings[i] = new MPMCQueue<Task*>(TASK_RING_SIZE);
+        m_overflowSize[i] = 0;
+        m_size[i] = 0;
+        m_skipped[i] = 0;
+    }
+    m_starvationLimit = DEFAULT_STARVATION_LIMIT;
+}
+
+TaskPriorityQueue::~TaskPriorityQueue()
+{
+    int i;
+    for (i = 0; i < TASK_PRIORITY_COUNT; i++)
+    {
+        delete m_rings[i];
+    }
+}
+
+void TaskPriorityQueue::push(Task* task)
+{
+    int priority = task->getPriority();
+
+    // Count it first, so that size() never goes negative
+    m_size[priority]++;
+
+    // Once we've overflowed, keep going to the overflow so that we stay
+    // in order until it has drained
+    if (m_overflowSize[priority] == 0 && m_rings[priority]->push(task))
+    {
+        return;
+    }
+
+    m_overflowMutex.lock();
+    m_overflow[priority].push_back(task);
+    m_overflowSize[priority]++;
+    m_overflowMutex.unlock();
+}
+
+bool TaskPriorityQueue::pop(int priority, Task*& task)
+{
+    if (m_size[priority] == 0)
+    {
+        return false;
+    }
+
+    if (m_rings[priority]->pop(task))
+    {
+        m_size[priority]--;
+        return true;
+    }
+
+    if (m_overflowSize[priority] == 0)
+    {
+        return false;
+    }
+
+    bool found = false;
+    m_overflowMutex.lock();
+    if (!m_overflow[priority].empty())
+    {
+        task = m_overflow[priority].front();
+        m_overflow[priority].pop_front();
+        m_overflowSize[priority]--;
+        m_size[priority]--;
+        found = true;
+    }
+    m_overflowMutex.unlock();
+
+    return found;
+}
+
+Task* TaskPriorityQueue::pop()
+{
+    Task* task;
+    int priority;
+
+    // Anything that has been passed over too many times goes first
+    for (priority = 0; priority < TASK_PRIORITY_COUNT - 1; priority++)
+    {
+        if (m_skipped[priority] >= m_starvationLimit && pop(priority, task))
+        {
+            m_skipped[priority] = 0;
+            return task;
+        }
+    }
+
+    for (priority = TASK_PRIORITY_COUNT - 1; priority >= 0; priority--)
+    {
+        if (pop(priority, task))
+        {
+            m_skipped[priority] = 0;
+
+            int lower;
+            for (lower = 0; lower < priority; lower++)
+            {
+                if (m_size[lower] > 0)
+                {
+                    m_skipped[lower]++;
+                }
+            }
+            return task;
+        }
+    }
+
+    return NULL;
+}
+
+size_t TaskPriorityQueue::size()
+{
+    size_t total = 0;
+    int priority;
+    for (priority = 0; priority < TASK_PRIORITY_COUNT; priority++)
+    {
+        total += m_size[priority];
+    }
+    return total;
+}
+
+deque<Task*> TaskPriorityQueue::drain()
+{
+    deque<Task*> tasks;
+    Task* task;
+    while ((task = pop()) != NULL)
+    {
+        tasks.push_back(task);
+    }
+    return tasks;
+}
+
+TaskGraph::TaskGraph()
+{
+}
+
+TaskGraph::~TaskGraph()
+{
+    // Anything that wasn't handed to an executor is still ours
+    for (Task* task : m_tasks)
+    {
+        task->release();
+    }
+}
+
+void TaskGraph::addTask(Task* task)
+{
+    m_tasks.push_back(task);
+}
+
+void TaskGraph::addTask(Task* task, initializer_list<Task*> dependencies)
+{
+    m_tasks.push_back(task);
+    for (Task* dependsOn : dependencies)
+    {
+        task->addDependency(dependsOn);
+    }
+}
+
+void TaskGraph::addDependency(Task* task, Task* dependsOn)
+{
+    task->addDependency(dependsOn);
+}
+
+bool TaskGraph::isValid()
+{
+    set<Task*> members(m_tasks.begin(), m_tasks.end());
+    map<Task*, int> pending;
+    deque<Task*> ready;
+
+    for (Task* task : m_tasks)
+    {
+        pending[task] = task->getPendingDependencies();
+    }
+
+    for (Task* task : m_tasks)
+    {
+        for (Task* dependent : task->getDependents())
+        {
+            if (members.find(dependent) == members.end())
+            {
+                // Only tasks within the graph may depend on each other
+                return false;
+            }
+        }
+        if (pending[task] == 0)
+        {
+            ready.push_back(task);
+        }
+    }
+
+    // Walk the graph in the order it would run. Anything left over is
+    // either part of a cycle or depends on a task outside of the graph
+    size_t visited = 0;
+    while (!ready.empty())
+    {
+        Task* task = ready.front();
+        ready.pop_front();
+        visited++;
+
+        for (Task* dependent : task->getDependents())
+        {
+            if (--pending[dependent] == 0)
+            {
+                ready.push_back(dependent);
+            }
+        }
+    }
+
+    return visited == m_tasks.size();
+}
+
+vector<Task*> TaskGraph::release()
+{
+    vector<Task*> tasks;
+    tasks.swap(m_tasks);
+    return tasks;
+}
+
+TaskHistogram::TaskHistogram()
+{
+    reset();
+}
+
+void TaskHistogram::record(uint64_t value)
+{
+    int bucket = 0;
+    if (value > 0)
+    {
+        bucket = TASK_HISTOGRAM_BUCKETS - __builtin_clzll(value);
+        if (bucket >= TASK_HISTOGRAM_BUCKETS)
+        {
+            bucket = TASK_HISTOGRAM_BUCKETS - 1;
+        }
+    }
+
+    m_buckets[bucket].fetch_add(1, memory_order_relaxed);
+    m_total.fetch_add(value, memory_order_relaxed);
+    m_count.fetch_add(1, memory_order_relaxed);
+
+    uint64_t max = m_max.load(memory_order_relaxed);
+    while (value > max && !m_max.compare_exchange_weak(max, value, memory_order_relaxed))
+    {
+    }
+}
+
+void TaskHistogram::reset()
+{
+    m_count = 0;
+    m_total = 0;
+    m_max = 0;
+
+    int i;
+    for (i = 0; i < TASK_HISTOGRAM_BUCKETS; i++)
+    {
+        m_buckets[i] = 0;
+    }
+}
+
+TaskHistogramSnapshot TaskHistogram::snapshot()
+{
+    TaskHistogramSnapshot snapshot;
+    snapshot.count = 0;
+    snapshot.total = m_total.load(memory_order_relaxed);
+    snapshot.max = m_max.load(memory_order_relaxed);
+
+    // Count the buckets rather than using m_count, so that the buckets
+    // always add up, even if something was recorded while we were copying
+    int i;
+    for (i = 0; i < TASK_HISTOGRAM_BUCKETS; i++)
+    {
+        snapshot.buckets[i] = m_buckets[i].load(memory_order_relaxed);
+        snapshot.count += snapshot.buckets[i];
+    }
+
+    return snapshot;
+}
+
+uint64_t TaskHistogramSnapshot::getPercentile(double percentile)
+{
+    if (count == 0)
+    {
+        return 0;
+    }
+
+    uint64_t target = (uint64_t)(percentile / 100.0 * (double)count);
+    if (target < 1)
+    {
+        target = 1;
+    }
+
+    uint64_t seen = 0;
+    int i;
+    for (i = 0; i < TASK_HISTOGRAM_BUCKETS; i++)
+    {
+        seen += buckets[i];
+        if (seen >= target)
+        {
+            if (i == 0)
+            {
+                return 0;
+            }
+            uint64_t upper = ((uint64_t)1 << i) - 1;
+            return upper < max ? upper : max;
+        }
+    }
+    return max;
+}
+
+double TaskExecutorStats::getUtilisation()
+{
+    uint64_t busy = 0;
+    uint64_t total = 0;
+    for (TaskWorkerStats& worker : workers)
+    {
+        busy += worker.busyTime;
+        total += worker.busyTime + worker.idleTime;
+    }
+    return total > 0 ? (double)busy / (double)total : 0.0;
+}
+
+// Never deleted, as tasks may be released by the shared executor's
+// workers after static destructors have run
+static MPMCQueue<InlineTask*>* getInlineTaskPool()
+{
+    static MPMCQueue<InlineTask*>* pool = new MPMCQueue<InlineTask*>(INLINE_TASK_POOL_SIZE);
+    return pool;
+}
+
+InlineTask::InlineTask()
+{
+    m_invoke = NULL;
+    m_destroy = NULL;
+    m_drop = NULL;
+}
+
+InlineTask::~InlineTask()
+{
+    if (m_destroy != NULL)
+    {
+        m_destroy(m_storage);
+    }
+}
+
+InlineTask* InlineTask::acquire()
+{
+    InlineTask* task;
+    if (getInlineTaskPool()->pop(task))
+    {
+        return task;
+    }
+    return new InlineTask();
+}
+
+void InlineTask::release()
+{
+    m_destroy(m_storage);
+    m_invoke = NULL;
+    m_destroy = NULL;
+    m_drop = NULL;
+    reset();
+
+    if (!getInlineTaskPool()->push(this))
+    {
+        delete this;
+    }
+}
+
+TaskGroupState::TaskGroupState(TaskExecutor* executor)
+{
+    m_executor = executor;
+    m_mutex = Thread::createMutex();
+    m_cond = Thread::createCondVar();
+    m_pending = 0;
+}
+
+TaskGroupState::~TaskGroupState()
+{
+    delete m_cond;
+    delete m_mutex;
+}
+
+void TaskGroupState::push(Task* task)
+{
+    m_pending++;
+
+    LockGuard<Mutex> lock(*m_mutex);
+    task->setState(TASK_QUEUED);
+    m_queue.push_back(task);
+    m_cond->broadcast();
+}
+
+Task* TaskGroupState::pop()
+{
+    LockGuard<Mutex> lock(*m_mutex);
+    if (m_queue.empty())
+    {
+        return NULL;
+    }
+
+    Task* task = m_queue.front();
+    m_queue.pop_front();
+    return task;
+}
+
+// Run a Task that the executor doesn't know about, such as one belonging
+// to a TaskGroup or Strand
+static void runMember(TaskExecutor* executor, Task* task)
+{
+    if (!executor->dropTask(task))
+    {
+        task->setState(TASK_RUNNING);
+        task->emitStarted();
+
+        task->run();
+    }
+
+    task->emitComplete();
+    task->release();
+}
+
+void TaskGroupState::run(Task* task)
+{
+    runMember(m_executor, task);
+
+    if (--m_pending == 0)
+    {
+        LockGuard<Mutex> lock(*m_mutex);
+        m_cond->broadcast();
+    }
+}
+
+void TaskGroupState::wait()
+{
+    while (m_pending > 0)
+    {
+        // Help out with anything that hasn't been started yet
+        Task* task = pop();
+        if (task != NULL)
+        {
+            run(task);
+            continue;
+        }
+
+        // Everything left is already running somewhere else
+        LockGuard<Mutex> lock(*m_mutex);
+        m_cond->waitUntil(m_mutex, [this] { return m_pending == 0 || !m_queue.empty(); });
+    }
+}
+
+// The executor just gets a stand in that runs whichever member is next, if
+// the waiter hasn't already run them all. If the stand in is dropped, the
+// member is run, and so dropped, straight away
+struct TaskGroupRunner
+{
+    shared_ptr<TaskGroupState> state;
+
+    void operator()()
+    {
+        Task* next = state->pop();
+        if (next != NULL)
+        {
+            state->run(next);
+        }
+    }
+
+    void dropped() { (*this)(); }
+};
+
+TaskGroup::TaskGroup(TaskExecutor* executor)
+{
+    m_executor = executor;
+    m_state = make_shared<TaskGroupState>(executor);
+}
+
+TaskGroup::~TaskGroup()
+{
+    wait();
+}
+
+void TaskGroup::addTask(Task* task)
+{
+    m_state->push(task);
+
+    InlineTask* runner = InlineTask::create(TaskGroupRunner{m_state});
+    runner->setPriority(task->getPriority());
+    if (!m_executor->addTask(runner))
+    {
+        // The executor is full, but the member stays in our queue for
+        // whoever waits on the group
+        runner->release();
+    }
+}
+
+void TaskGroup::wait()
+{
+    m_state->wait();
+}
+
+StrandState::StrandState(TaskExecutor* executor)
+{
+    m_executor = executor;
+    m_priority = TASK_PRIORITY_NORMAL;
+    m_count = 0;
+}
+
+StrandState::~StrandState()
+{
+}
+
+void StrandState::push(Task* task)
+{
+    {
+        LockGuard<FastMutex> lock(m_mutex);
+        task->setState(TASK_QUEUED);
+        m_queue.push_back(task);
+    }
+
+    if (m_count.fetch_add(1) == 0)
+    {
+        schedule();
+    }
+}
+
+// Runs a batch of the strand's Tasks. If the runner is dropped, the rest of
+// the strand is run straight away, and so dropped too
+struct StrandRunner
+{
+    shared_ptr<StrandState> state;
+
+    void operator()() { state->runBatch(); }
+    void dropped() { state->drain(); }
+};
+
+void StrandState::schedule()
+{
+    // The strand's tasks have already been accepted, so this can't be
+    // refused for lack of space
+    InlineTask* runner = InlineTask::create(StrandRunner{shared_from_this()});
+    runner->setPriority(m_priority);
+    m_executor->forceAddTask(runner);
+}
+
+void StrandState::runBatch()
+{
+    int i;
+    for (i = 0; i < STRAND_BATCH_SIZE; i++)
+    {
+        Task* task;
+        {
+            LockGuard<FastMutex> lock(m_mutex);
+            task = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        runMember(m_executor, task);
+
+        if (m_count.fetch_sub(1) == 1)
+        {
+            // Empty, the next push will schedule us again
+            return;
+        }
+    }
+
+    // Give other work a turn before carrying on
+    schedule();
+}
+
+void StrandState::drain()
+{
+    while (true)
+    {
+        Task* task;
+        {
+            LockGuard<FastMutex> lock(m_mutex);
+            task = m_queue.front();
+            m_queue.pop_front();
+        }
+
+        runMember(m_executor, task);
+
+        if (m_count.fetch_sub(1) == 1)
+        {
+            return;
+        }
+    }
+}
+
+Strand::Strand(TaskExecutor* executor)
+{
+    m_state = make_shared<StrandState>(executor);
+}
+
+Strand::~Strand()
+{
+}
+
+void Strand::addTask(Task* task)
+{
+    m_state->push(task);
+}
+
+static thread_local TaskWorker* g_currentWorker = NULL;
+
+TaskWorker::TaskWorker(TaskExecutor* executor, Task* task)
+{
+    m_executor = executor;
+    m_task = task;
+    m_index = 0;
+    m_node = 0;
+    m_wakeMutex = NULL;
+    m_wakeCondVar = NULL;
+    m_woken = false;
+    resetStats();
+}
+
+TaskWorker::TaskWorker(TaskExecutor* executor, unsigned int index)
+{
+    m_executor = executor;
+    m_task = NULL;
+    m_index = index;
+    m_node = 0;
+    m_wakeMutex = Thread::createMutex();
+    m_wakeCondVar = Thread::createCondVar();
+    m_woken = false;
+    resetStats();
+}
+
+TaskWorker::~TaskWorker()
+{
+    if (m_wakeCondVar != NULL)
+    {
+        delete m_wakeCondVar;
+        delete m_wakeMutex;
+    }
+}
+
+TaskWorkerStats TaskWorker::getStats()
+{
+    TaskWorkerStats stats;
+    stats.index = m_index;
+    stats.tasksRun = m_tasksRun;
+    stats.busyTime = m_busyTime;
+    stats.idleTime = m_idleTime;
+    return stats;
+}
+
+void TaskWorker::resetStats()
+{
+    m_tasksRun = 0;
+    m_busyTime = 0;
+    m_idleTime = 0;
+}
+
+TaskWorker* TaskWorker::getCurrentWorker()
+{
+    return g_currentWorker;
+}
+
+void TaskWorker::wake()
+{
+    if (m_wakeCondVar != NULL)
+    {
+        m_wakeMutex->lock();
+        m_woken = true;
+        m_wakeCondVar->signal();
+        m_wakeMutex->unlock();
+    }
+}
+
+void TaskWorker::sleep()
+{
+    // A wake that arrives before we start waiting is remembered
+    m_wakeMutex->lock();
+    m_wakeCondVar->waitUntil(m_wakeMutex, [this]() { return m_woken; });
+    m_woken = false;
+    m_wakeMutex->unlock();
+}
+
+void TaskWorker::pushLocal(Task* task)
+{
+    m_localMutex.lock();
+    m_localQueue.push_back(task);
+    m_localMutex.unlock();
+}
+
+Task* TaskWorker::popLocal()
+{
+    // We take our newest task, it's most likely to still be in the cache
+    Task* task = NULL;
+    m_localMutex.lock();
+    if (!m_localQueue.empty())
+    {
+        task = m_localQueue.back();
+        m_localQueue.pop_back();
+    }
+    m_localMutex.unlock();
+    return task;
+}
+
+Task* TaskWorker::steal()
+{
+    // Thieves take the oldest task
+    Task* task = NULL;
+    m_localMutex.lock();
+    if (!m_localQueue.empty())
+    {
+        task = m_localQueue.front();
+        m_localQueue.pop_front();
+    }
+    m_localMutex.unlock();
+    return task;
+}
+
+deque<Task*> TaskWorker::drainLocal()
+{
+    deque<Task*> tasks;
+    m_localMutex.lock();
+    tasks.swap(m_localQueue);
+    m_localMutex.unlock();
+    return tasks;
+}
+
+void TaskWorker::runTask(Task* task)
+{
+    m_executor->taskDequeued();
+
+    if (m_executor->dropTask(task))
+    {
+        m_executor->completeDropped(task);
+        return;
+    }
+
+    m_executor->startedSignal().emit(task);
 
-    m_task->completeSignal().emit(m_task);
-    m_executor->completeSignal().emit(m_task);
+    bool stats = m_executor->getStatsEnabled();
+    if (stats)
+    {
+        task->setStartTime(Task::getTime());
+    }
+
+    task->setState(TASK_RUNNING);
+    task->emitStarted();
+
+    task->run();
+
+    if (stats)
+    {
+        task->setFinishTime(Task::getTime());
+        m_busyTime += task->getFinishTime() - task->getStartTime();
+        m_tasksRun++;
+        m_executor->recordStats(task);
+    }
+
+    task->emitComplete();
+    m_executor->completeSignal().emit(task);
+
+    // Anything waiting on us may now be able to run
+    m_executor->releaseDependents(task);
+}
+
+bool TaskWorker::main()
+{
+    if (m_executor->getMode() != TASK_EXECUTOR_TRANSIENT)
+    {
+        g_currentWorker = this;
+        Arena& arena = Thread::getArena();
+        while (true)
+        {
+            uint64_t idleStart = 0;
+            if (m_executor->getStatsEnabled())
+            {
+                idleStart = Task::getTime();
+            }
+
+            Task* task = m_executor->nextTask(this);
+            if (task == NULL)
+            {
+                // Shutting down
+                break;
+            }
+
+            if (idleStart != 0)
+            {
+                m_idleTime += Task::getTime() - idleStart;
+            }
+
+            m_task = task;
+            runTask(task);
+            m_task = NULL;
+
+            m_executor->removeTask(task);
+            task->release();
+
+            // Scratch allocations don't outlive their task
+            arena.reset();
+
+            m_executor->taskComplete(this);
+        }
+        g_currentWorker = NULL;
+        return true;
+    }
+
+    //printf("TaskWorker::main: Running task...\n");
+    runTask(m_task);
 
-    delete m_task;
+    // Make sure nobody can find the task before we delete it
+    m_executor->removeTask(m_task);
+    m_task->release();
 
     //printf("TaskWorker::main: Task complete...\n");
 
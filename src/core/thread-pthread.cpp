@@ -1,6 +1,21 @@
 #include "thread-pthread.h"
 
+#include <geek/core-clock.h>
+
 #include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <fstream>
+#include <sstream>
+#include <limits.h>
+#include <stdlib.h>
+
+#if defined(__linux__)
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
 
 using namespace std;
 using namespace Geek;
@@ -28,42 +43,90 @@ void PThreadMutex::unlock()
 
 PThreadCondVar::PThreadCondVar()
 {
-    pthread_cond_init(&m_cond, NULL);
-    pthread_mutex_init(&m_condMutex, NULL);
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+#if defined(__linux__)
+    // Timeouts shouldn't be affected by the wall clock changing
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+#endif
+    pthread_cond_init(&m_cond, &attr);
+    pthread_condattr_destroy(&attr);
 }
 
 PThreadCondVar::~PThreadCondVar()
 {
     pthread_cond_destroy(&m_cond);
-    pthread_mutex_destroy(&m_condMutex);
 }
 
-bool PThreadCondVar::wait(uint64_t timeoutms)
+bool PThreadCondVar::wait(Mutex* mutex)
 {
-    if (timeoutms == 0)
-    {
-        pthread_cond_wait(&m_cond, &m_condMutex);
-    }
-    else
-    {
-        struct timeval tv;
-        struct timespec ts;
-        gettimeofday(&tv, NULL);
+    PThreadMutex* pthreadMutex = static_cast<PThreadMutex*>(mutex);
+    return pthread_cond_wait(&m_cond, pthreadMutex->getMutex()) == 0;
+}
+
+bool PThreadCondVar::wait(Mutex* mutex, uint64_t timeoutms)
+{
+    PThreadMutex* pthreadMutex = static_cast<PThreadMutex*>(mutex);
 
-        ts.tv_sec = tv.tv_sec;
-        ts.tv_nsec = tv.tv_usec * 1000l;
+    struct timespec ts;
+#if defined(__linux__)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+#else
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec;
+    ts.tv_nsec = tv.tv_usec * 1000l;
+#endif
 
-        // Add the timeout
-        ts.tv_nsec += timeoutms * 1000000L; 
+    // Add the timeout
+    ts.tv_sec += timeoutms / 1000;
+    ts.tv_nsec += (timeoutms % 1000) * 1000000L;
 
-        // Handle overflow
-        ts.tv_sec += ts.tv_nsec / 1000000000L;  
-        ts.tv_nsec = ts.tv_nsec % 1000000000L;  
+    // Handle overflow
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec = ts.tv_nsec % 1000000000L;
 
-        pthread_cond_timedwait(&m_cond, &m_condMutex, &ts);
-    }
+    return pthread_cond_timedwait(&m_cond, pthreadMutex->getMutex(), &ts) == 0;
+}
 
-    return true;
+bool PThreadCondVar::waitUntilTime(Mutex* mutex, uint64_t time)
+{
+    PThreadMutex* pthreadMutex = static_cast<PThreadMutex*>(mutex);
+
+    struct timespec ts;
+#if defined(__linux__)
+    // We wait on CLOCK_MONOTONIC, the same as Clock
+    ts.tv_sec = time / 1000000000ull;
+    ts.tv_nsec = time % 1000000000ull;
+#else
+    uint64_t now = Clock::getTime();
+    uint64_t timeout = time > now ? time - now : 0;
+
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    ts.tv_sec = tv.tv_sec + timeout / 1000000000ull;
+    ts.tv_nsec = tv.tv_usec * 1000l + timeout % 1000000000ull;
+    ts.tv_sec += ts.tv_nsec / 1000000000L;
+    ts.tv_nsec = ts.tv_nsec % 1000000000L;
+#endif
+
+    return pthread_cond_timedwait(&m_cond, pthreadMutex->getMutex(), &ts) == 0;
+}
+
+bool PThreadCondVar::wait()
+{
+    m_legacyMutex.lock();
+    bool res = wait(&m_legacyMutex);
+    m_legacyMutex.unlock();
+    return res;
+}
+
+bool PThreadCondVar::wait(uint64_t timeoutms)
+{
+    m_legacyMutex.lock();
+    bool res = timeoutms == 0 ? wait(&m_legacyMutex) : wait(&m_legacyMutex, timeoutms);
+    m_legacyMutex.unlock();
+    return res;
 }
 
 bool PThreadCondVar::signal()
@@ -73,6 +136,13 @@ bool PThreadCondVar::signal()
     return true;
 }
 
+bool PThreadCondVar::broadcast()
+{
+    pthread_cond_broadcast(&m_cond);
+
+    return true;
+}
+
 static void* pthreadentry(void* args)
 {
     Thread* t = (Thread*)args;
@@ -84,20 +154,174 @@ PThreadThread::PThreadThread(Thread* thread)
     : ThreadImpl(thread)
 {
     m_thread = thread;
+    m_started = false;
 }
 
 PThreadThread::~PThreadThread()
 {
 }
 
-void PThreadThread::start()
+bool PThreadThread::start()
+{
+    const ThreadAttributes& attributes = m_thread->getAttributes();
+
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    if (attributes.stackSize > 0)
+    {
+        size_t stackSize = attributes.stackSize;
+        // glibc 2.34 made this a call to sysconf(), which returns a long
+        if (stackSize < (size_t)PTHREAD_STACK_MIN)
+        {
+            stackSize = PTHREAD_STACK_MIN;
+        }
+        pthread_attr_setstacksize(&attr, stackSize);
+    }
+
+    if (pthread_create(&m_pthread, &attr, pthreadentry, m_thread) != 0)
+    {
+        pthread_attr_destroy(&attr);
+        return false;
+    }
+    pthread_attr_destroy(&attr);
+
+    m_started = true;
+    return true;
+}
+
+void PThreadThread::applyAttributes()
+{
+    const ThreadAttributes& attributes = m_thread->getAttributes();
+
+    if (!attributes.name.empty())
+    {
+#if defined(__APPLE__)
+        pthread_setname_np(attributes.name.c_str());
+#elif defined(__linux__)
+        pthread_setname_np(pthread_self(), attributes.name.substr(0, 15).c_str());
+#endif
+    }
+
+#if defined(__linux__)
+    if (!attributes.affinity.empty())
+    {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        for (int cpu : attributes.affinity)
+        {
+            if (cpu >= 0 && cpu < CPU_SETSIZE)
+            {
+                CPU_SET(cpu, &cpus);
+            }
+        }
+        pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+    }
+#endif
+
+    if (attributes.priority != THREAD_PRIORITY_NORMAL)
+    {
+#if defined(__linux__)
+        // Linux ignores pthread priorities for normal threads, but each
+        // thread has its own nice value. Raising it may need privileges
+        int nice = attributes.priority == THREAD_PRIORITY_HIGH ? -5 : 10;
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), nice);
+#else
+        int policy;
+        struct sched_param param;
+        pthread_getschedparam(pthread_self(), &policy, &param);
+        if (attributes.priority == THREAD_PRIORITY_HIGH)
+        {
+            param.sched_priority = sched_get_priority_max(policy);
+        }
+        else
+        {
+            param.sched_priority = sched_get_priority_min(policy);
+        }
+        pthread_setschedparam(pthread_self(), policy, &param);
+#endif
+    }
+}
+
+int PThreadThread::getCPUCount()
+{
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus > 0 ? (int)cpus : 1;
+}
+
+#if defined(__linux__)
+// Parse a list of CPUs or nodes like "0-3,8-11"
+static vector<int> parseCPUList(string list)
 {
-    pthread_create(&m_pthread, NULL, pthreadentry, m_thread);
+    vector<int> cpus;
+    stringstream stream(list);
+    string range;
+    while (getline(stream, range, ','))
+    {
+        if (range.empty())
+        {
+            continue;
+        }
+
+        size_t dash = range.find('-');
+        int first = atoi(range.c_str());
+        int last = dash != string::npos ? atoi(range.c_str() + dash + 1) : first;
+        int cpu;
+        for (cpu = first; cpu <= last; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+    }
+    return cpus;
+}
+#endif
+
+vector<vector<int>> PThreadThread::getNumaNodes()
+{
+    vector<vector<int>> nodes;
+
+#if defined(__linux__)
+    string online;
+    ifstream onlineFile("/sys/devices/system/node/online");
+    getline(onlineFile, online);
+
+    for (int node : parseCPUList(online))
+    {
+        string list;
+        ifstream file("/sys/devices/system/node/node" + to_string(node) + "/cpulist");
+        getline(file, list);
+
+        // Memory only nodes have no CPUs
+        vector<int> cpus = parseCPUList(list);
+        if (!cpus.empty())
+        {
+            nodes.push_back(cpus);
+        }
+    }
+#endif
+
+    if (nodes.empty())
+    {
+        vector<int> cpus;
+        int count = getCPUCount();
+        int cpu;
+        for (cpu = 0; cpu < count; cpu++)
+        {
+            cpus.push_back(cpu);
+        }
+        nodes.push_back(cpus);
+    }
+
+    return nodes;
 }
 
 void PThreadThread::wait()
 {
+    if (!m_started)
+    {
+        return;
+    }
     pthread_join(m_pthread, NULL);
+    m_started = false;
 }
 
 Mutex* PThreadThread::createMutex()
@@ -35,33 +35,48 @@ class PThreadMutex : public Geek::Mutex
 
     bool lock();
     void unlock();
+
+    pthread_mutex_t* getMutex() { return &m_mutex; }
 };
 
 class PThreadCondVar : public Geek::CondVar
 {
  private:
     pthread_cond_t m_cond;
-    pthread_mutex_t m_condMutex;
+
+    // Only used by the deprecated waits that don't take a Mutex
+    PThreadMutex m_legacyMutex;
 
  public:
     PThreadCondVar();
     virtual ~PThreadCondVar();
 
-    virtual bool wait(uint64_t timeoutms);
+    virtual bool wait(Geek::Mutex* mutex);
+    virtual bool wait(Geek::Mutex* mutex, uint64_t timeoutms);
+    virtual bool waitUntilTime(Geek::Mutex* mutex, uint64_t time);
     virtual bool signal();
+    virtual bool broadcast();
+
+    virtual bool wait();
+    virtual bool wait(uint64_t timeoutms);
 };
 
 class PThreadThread : public Geek::ThreadImpl
 {
  private:
     pthread_t m_pthread;
+    bool m_started;
 
  public:
     PThreadThread(Geek::Thread* thread);
     virtual ~PThreadThread();
 
-    void start();
+    bool start();
     void wait();
+    void applyAttributes();
+
+    static int getCPUCount();
+    static std::vector<std::vector<int>> getNumaNodes();
 
     Geek::Mutex* createMutex();
     Geek::CondVar* createCondVar();
@@ -2,6 +2,8 @@
 
 #include "thread-pthread.h"
 
+#include <atomic>
+
 using namespace std;
 using namespace Geek;
 
@@ -17,21 +19,47 @@ CondVar::~CondVar()
 {
 }
 
-bool CondVar::wait()
+
+static atomic<unsigned int> g_nextThreadLocalKey(0);
+
+ThreadContext::ThreadContext()
 {
-    return wait(0);
 }
 
-bool CondVar::wait(uint64_t timeoutms)
+ThreadContext::~ThreadContext()
 {
-    return false;
+    // Newest first, as they may depend on older values
+    size_t i;
+    for (i = m_values.size(); i > 0; i--)
+    {
+        if (m_values[i - 1] != NULL)
+        {
+            m_destructors[i - 1](m_values[i - 1]);
+        }
+    }
 }
 
-bool CondVar::signal()
+ThreadContext* ThreadContext::getCurrent()
 {
-    return false;
+    static thread_local ThreadContext context;
+    return &context;
+}
+
+unsigned int ThreadContext::createKey()
+{
+    return g_nextThreadLocalKey++;
 }
 
+void ThreadContext::setValue(unsigned int key, void* value, void (*destructor)(void*))
+{
+    if (key >= m_values.size())
+    {
+        m_values.resize(key + 1, NULL);
+        m_destructors.resize(key + 1, NULL);
+    }
+    m_values[key] = value;
+    m_destructors[key] = destructor;
+}
 
 Thread::Thread()
 {
@@ -51,9 +79,9 @@ void Thread::addListener(FObject* w)
 }
 #endif
 
-void Thread::start()
+bool Thread::start()
 {
-    m_impl->start();
+    return m_impl->start();
 }
 
 void Thread::wait()
@@ -65,6 +93,7 @@ bool Thread::entry()
 {
     bool res;
     m_state = THREAD_RUNNING;
+    m_impl->applyAttributes();
     res = main();
     m_state = THREAD_COMPLETE;
 
@@ -89,6 +118,16 @@ bool Thread::main()
 }
 
 
+int Thread::getCPUCount()
+{
+    return PThreadThread::getCPUCount();
+}
+
+vector<vector<int>> Thread::getNumaNodes()
+{
+    return PThreadThread::getNumaNodes();
+}
+
 Mutex* Thread::createMutex()
 {
     return new PThreadMutex();
@@ -1,191 +1,660 @@
 
 #include <geek/core-timers.h>
 
-#include <sys/time.h>
+#include <algorithm>
 
 using namespace std;
 using namespace Geek;
 using namespace Geek::Core;
 
-static uint64_t getTimestamp()
+void Timer::recordLateness(uint64_t lateness)
 {
-    timeval tv;
-    gettimeofday(&tv, NULL);
+    m_fired++;
+    m_lastLateness = lateness;
+    m_totalLateness += lateness;
 
-    uint64_t millis;
-    millis = tv.tv_sec * 1000l;
-    millis += tv.tv_usec / 1000l;
+    uint64_t max = m_maxLateness;
+    while (lateness > max && !m_maxLateness.compare_exchange_weak(max, lateness))
+    {
+    }
+}
 
-    return millis;
+TimerStats Timer::getStats()
+{
+    TimerStats stats;
+    stats.fired = m_fired;
+    stats.lastLateness = m_lastLateness;
+    stats.maxLateness = m_maxLateness;
+    stats.totalLateness = m_totalLateness;
+    return stats;
 }
 
-TimerManager::TimerManager()
+void Timer::resetStats()
 {
-    m_condVar = Thread::createCondVar();
-    m_timersMutex = Thread::createMutex();
+    m_fired = 0;
+    m_lastLateness = 0;
+    m_maxLateness = 0;
+    m_totalLateness = 0;
 }
 
-TimerManager::~TimerManager()
+void Timer::recordFrame(uint64_t start)
 {
+    if (m_frames == NULL)
+    {
+        return;
+    }
+
+    LockGuard<FastMutex> guard(m_frames->mutex);
+    if (m_frames->lastStart != 0 && start > m_frames->lastStart)
+    {
+        m_frames->times[m_frames->pos] = start - m_frames->lastStart;
+        m_frames->pos = (m_frames->pos + 1) % TIMER_FRAME_WINDOW;
+        if (m_frames->count < TIMER_FRAME_WINDOW)
+        {
+            m_frames->count++;
+        }
+    }
+    m_frames->lastStart = start;
+    m_frames->frames++;
 }
 
-void TimerManager::addTimer(Timer* timer)
+void Timer::recordSkipped(uint64_t skipped)
 {
-    uint64_t now = getTimestamp();
-    timer->setNextRun(now + timer->getPeriod());
-    timer->setActive(true);
+    if (m_frames != NULL)
+    {
+        LockGuard<FastMutex> guard(m_frames->mutex);
+        m_frames->skipped += skipped;
+    }
+}
 
-    m_timersMutex->lock();
-    m_timers.push_back(timer);
-    m_timersMutex->unlock();
+TimerFrameStats Timer::getFrameStats()
+{
+    TimerFrameStats stats = {};
+    if (m_frames == NULL)
+    {
+        return stats;
+    }
 
-    m_condVar->signal();
+    vector<uint64_t> times;
+    {
+        LockGuard<FastMutex> guard(m_frames->mutex);
+        stats.frames = m_frames->frames;
+        stats.skipped = m_frames->skipped;
+        times.assign(m_frames->times, m_frames->times + m_frames->count);
+    }
+
+    if (times.empty())
+    {
+        return stats;
+    }
+
+    uint64_t total = 0;
+    stats.minFrameTime = times.at(0);
+    for (uint64_t time : times)
+    {
+        total += time;
+        stats.minFrameTime = min(stats.minFrameTime, time);
+        stats.maxFrameTime = max(stats.maxFrameTime, time);
+    }
+    stats.meanFrameTime = total / times.size();
+
+    size_t p99 = (times.size() * 99 + 99) / 100 - 1;
+    nth_element(times.begin(), times.begin() + p99, times.end());
+    stats.p99FrameTime = times.at(p99);
+
+    return stats;
 }
 
-void TimerManager::resetTimer(Timer* timer)
+void Timer::resetFrameStats()
 {
-    m_timersMutex->lock();
-    uint64_t now = getTimestamp();
-    timer->setNextRun(now + timer->getPeriod());
-    m_timersMutex->unlock();
+    if (m_frames != NULL)
+    {
+        LockGuard<FastMutex> guard(m_frames->mutex);
+        m_frames->count = 0;
+        m_frames->pos = 0;
+        m_frames->lastStart = 0;
+        m_frames->frames = 0;
+        m_frames->skipped = 0;
+    }
+}
 
-    m_condVar->signal();
+/**
+ * The first tick at or after a time, so we never fire early
+ */
+static uint64_t toTick(uint64_t time)
+{
+    return (time + TIMER_WHEEL_TICK_NS - 1) / TIMER_WHEEL_TICK_NS;
 }
 
-void TimerManager::cancelTimer(Timer* timer)
+/**
+ * Picks the tick between first and last with the most trailing zero bits.
+ * Timers whose windows overlap tend to pick the same one, so they fire
+ * together
+ */
+static uint64_t coalesce(uint64_t first, uint64_t last)
 {
-    timer->setActive(false);
+    if (last <= first)
+    {
+        return first;
+    }
 
-    m_timersMutex->lock();
-    vector<Timer*>::iterator it;
-    for (it = m_timers.begin(); it != m_timers.end(); ++it)
+    // Keep the bits above where they first differ
+    unsigned int bit = 63 - __builtin_clzll((first - 1) ^ last);
+    return last & ~((1ull << bit) - 1);
+}
+
+TimerWheel::TimerWheel()
+{
+    unsigned int level;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
     {
-        if (timer == *it)
+        unsigned int slot;
+        for (slot = 0; slot < TIMER_WHEEL_SLOTS; slot++)
         {
-            m_timers.erase(it);
-            break;
+            m_slots[level][slot] = NULL;
         }
+        m_occupied[level] = 0;
     }
-    m_timersMutex->unlock();
+    m_time = Clock::getTime() / TIMER_WHEEL_TICK_NS;
+    m_timerCount = 0;
+
+    resetStats();
 }
 
-Timer* TimerManager::findTimer(std::string id)
+void TimerWheel::add(Timer* timer, uint64_t now)
 {
-    Timer* result = NULL;
-    m_timersMutex->lock();
-    for (Timer* timer : m_timers)
+    addAt(timer, now + timer->getPeriodMicros() * 1000ull);
+}
+
+void TimerWheel::addAt(Timer* timer, uint64_t time)
+{
+    if (timer->m_scheduled)
     {
-        if (timer->getId() == id)
-        {
-            result = timer;
-            break;
-        }
+        unschedule(timer);
+    }
+    else
+    {
+        index(timer);
+    }
+    timer->setNextRun(time);
+    timer->setActive(true);
+    schedule(timer);
+}
+
+void TimerWheel::reset(Timer* timer, uint64_t now)
+{
+    timer->setNextRun(now + timer->getPeriodMicros() * 1000ull);
+    if (timer->m_scheduled)
+    {
+        unschedule(timer);
+        schedule(timer);
     }
-    m_timersMutex->unlock();
-    return result;
 }
 
-class TimerThread : public Thread
+void TimerWheel::cancel(Timer* timer)
 {
- private:
-    Timer* m_timer;
+    if (timer->m_scheduled)
+    {
+        unschedule(timer);
+        unindex(timer);
+    }
+}
+
+Timer* TimerWheel::find(std::string id)
+{
+    unordered_multimap<string, Timer*>::iterator it = m_timersById.find(id);
+    if (it != m_timersById.end())
+    {
+        return it->second;
+    }
+    return NULL;
+}
+
+void TimerWheel::resetStats()
+{
+    m_stats.wakeups = 0;
+    m_stats.timersFired = 0;
+    m_stats.wakeupsSaved = 0;
+}
 
- public:
-    TimerThread(Timer* timer)
+void TimerWheel::schedule(Timer* timer)
+{
+    uint64_t due = timer->getNextRun();
+    uint64_t expires = coalesce(toTick(due), (due + timer->getSlackMicros() * 1000ull) / TIMER_WHEEL_TICK_NS);
+    timer->m_wheelExpires = expires;
+    if (expires <= m_time)
     {
-        m_timer = timer;
+        // Overdue, run it on the next tick
+        expires = m_time + 1;
     }
 
-    virtual ~TimerThread()
+    // Find the lowest level that reaches far enough
+    uint64_t delta = expires - m_time;
+    unsigned int level = 0;
+    while (level < TIMER_WHEEL_LEVELS - 1 && delta >= (1ull << (TIMER_WHEEL_BITS * (level + 1))))
     {
+        level++;
     }
 
-    virtual bool main()
+    uint64_t limit = 1ull << (TIMER_WHEEL_BITS * TIMER_WHEEL_LEVELS);
+    if (delta >= limit)
     {
-        m_timer->signal().emit(m_timer);
-        return true;
+        // Beyond the top of the wheel, so we'll come back to it later
+        expires = m_time + limit - 1;
     }
-};
 
-bool TimerManager::main()
+    unsigned int slot = (expires >> (TIMER_WHEEL_BITS * level)) & TIMER_WHEEL_MASK;
+    timer->m_wheelLevel = level;
+    timer->m_wheelSlot = slot;
+    timer->m_wheelPrev = NULL;
+    timer->m_wheelNext = m_slots[level][slot];
+    if (timer->m_wheelNext != NULL)
+    {
+        timer->m_wheelNext->m_wheelPrev = timer;
+    }
+    m_slots[level][slot] = timer;
+    m_occupied[level] |= 1ull << slot;
+
+    timer->m_scheduled = true;
+    m_timerCount++;
+}
+
+void TimerWheel::unschedule(Timer* timer)
 {
-    while (true)
+    unsigned int level = timer->m_wheelLevel;
+    unsigned int slot = timer->m_wheelSlot;
+    if (timer->m_wheelPrev != NULL)
     {
-        m_timersMutex->lock();
-        vector<Timer*>::iterator it;
-        vector<Timer*> removeTimers;
-        vector<Timer*> emitSignals;
+        timer->m_wheelPrev->m_wheelNext = timer->m_wheelNext;
+    }
+    else
+    {
+        m_slots[level][slot] = timer->m_wheelNext;
+    }
+    if (timer->m_wheelNext != NULL)
+    {
+        timer->m_wheelNext->m_wheelPrev = timer->m_wheelPrev;
+    }
+    if (m_slots[level][slot] == NULL)
+    {
+        m_occupied[level] &= ~(1ull << slot);
+    }
+
+    timer->m_wheelPrev = NULL;
+    timer->m_wheelNext = NULL;
+    timer->m_scheduled = false;
+    m_timerCount--;
+}
+
+void TimerWheel::index(Timer* timer)
+{
+    if (!timer->getId().empty())
+    {
+        m_timersById.insert(make_pair(timer->getId(), timer));
+    }
+}
 
-        uint64_t next = getTimestamp() + (60 * 1000);
-        for (it = m_timers.begin(); it != m_timers.end(); ++it)
+void TimerWheel::unindex(Timer* timer)
+{
+    if (timer->getId().empty())
+    {
+        return;
+    }
+
+    auto range = m_timersById.equal_range(timer->getId());
+    unordered_multimap<string, Timer*>::iterator it;
+    for (it = range.first; it != range.second; ++it)
+    {
+        if (it->second == timer)
+        {
+            m_timersById.erase(it);
+            break;
+        }
+    }
+}
+
+uint64_t TimerWheel::getNextTick()
+{
+    uint64_t next = 0;
+
+    unsigned int level;
+    for (level = 0; level < TIMER_WHEEL_LEVELS; level++)
+    {
+        uint64_t occupied = m_occupied[level];
+        if (occupied == 0)
+        {
+            continue;
+        }
+
+        // Slots are visited in order, starting just after the current one
+        unsigned int shift = TIMER_WHEEL_BITS * level;
+        uint64_t window = m_time >> shift;
+        unsigned int start = (window + 1) & TIMER_WHEEL_MASK;
+        if (start != 0)
         {
-            Timer* timer = *it;
-            uint64_t now = getTimestamp();
-            bool remove = false;
-            if (timer->getNextRun() <= now)
+            occupied = (occupied >> start) | (occupied << (TIMER_WHEEL_SLOTS - start));
+        }
+
+        uint64_t event = (window + 1 + __builtin_ctzll(occupied)) << shift;
+        if (next == 0 || event < next)
+        {
+            next = event;
+        }
+    }
+
+    return next;
+}
+
+uint64_t TimerWheel::getNextEvent()
+{
+    return getNextTick() * TIMER_WHEEL_TICK_NS;
+}
+
+void TimerWheel::advance(uint64_t now, vector<Timer*>& due)
+{
+    // Only ticks that have completely passed
+    now /= TIMER_WHEEL_TICK_NS;
+
+    while (m_time < now)
+    {
+        // Skip straight to the next tick that has anything to do
+        uint64_t next = getNextTick();
+        if (next == 0 || next > now)
+        {
+            m_time = now;
+            break;
+        }
+        m_time = next;
+
+        // Move timers down from any level whose slot has come round
+        unsigned int level;
+        for (level = 1; level < TIMER_WHEEL_LEVELS; level++)
+        {
+            unsigned int shift = TIMER_WHEEL_BITS * level;
+            if ((m_time & ((1ull << shift) - 1)) != 0)
             {
-                // Fire!
-                emitSignals.push_back(timer);
+                break;
+            }
 
-                if (timer->getType() == TIMER_PERIODIC)
+            unsigned int slot = (m_time >> shift) & TIMER_WHEEL_MASK;
+            Timer* timer = m_slots[level][slot];
+            while (timer != NULL)
+            {
+                Timer* nextTimer = timer->m_wheelNext;
+                unschedule(timer);
+                if (timer->m_wheelExpires <= m_time)
                 {
-                    timer->setNextRun(now + timer->getPeriod());
+                    // Due now, and schedule() would treat it as overdue
+                    due.push_back(timer);
                 }
                 else
                 {
-                    timer->setActive(false);
-                    removeTimers.push_back(timer);
-                    remove = true;
-                    //continue; // Don't process next run time
+                    schedule(timer);
                 }
+                timer = nextTimer;
             }
+        }
 
-            // Next run is imminent?
-            if (!remove && timer->getNextRun() < next)
-            {
-                next = timer->getNextRun();
-            }
+        unsigned int slot = m_time & TIMER_WHEEL_MASK;
+        while (m_slots[0][slot] != NULL)
+        {
+            Timer* timer = m_slots[0][slot];
+            unschedule(timer);
+            due.push_back(timer);
         }
+    }
+}
+
+void TimerWheel::expire(uint64_t now, vector<Timer*>& due, vector<uint64_t>& dueTimes)
+{
+    size_t first = due.size();
+    advance(now, due);
 
-        // Clean up finished ONE SHOT timers
-        for (Timer* timer : removeTimers)
+    size_t i;
+    for (i = first; i < due.size(); i++)
+    {
+        Timer* timer = due[i];
+        uint64_t dueTime = timer->getNextRun();
+        uint64_t period = timer->getPeriodMicros() * 1000ull;
+        dueTimes.push_back(dueTime);
+        if (timer->getType() == TIMER_PERIODIC || (timer->getType() == TIMER_FIXED_RATE && period == 0))
         {
-            vector<Timer*>::iterator removeIt;
-            for (removeIt = m_timers.begin(); removeIt != m_timers.end(); ++removeIt)
+            timer->setNextRun(now + period);
+            schedule(timer);
+        }
+        else if (timer->getType() == TIMER_FIXED_RATE)
+        {
+            // Stay on the timeline, however late this run was
+            uint64_t next = dueTime + period;
+            if (next <= now)
             {
-                if (*removeIt == timer)
+                uint64_t missed = (now - next) / period + 1;
+                uint64_t skip = missed;
+                if (timer->getCatchUp() == TIMER_CATCH_UP)
                 {
-                    m_timers.erase(removeIt);
-                    break;
+                    skip = missed > TIMER_MAX_CATCH_UP ? missed - TIMER_MAX_CATCH_UP : 0;
                 }
+                next += skip * period;
+                timer->recordSkipped(skip);
             }
+            timer->setNextRun(next);
+            schedule(timer);
+        }
+        else
+        {
+            timer->setActive(false);
+            unindex(timer);
         }
+    }
+
+    if (due.size() > first)
+    {
+        // Without slack, each distinct due time would be a wakeup
+        vector<uint64_t> dueTicks;
+        for (i = first; i < dueTimes.size(); i++)
+        {
+            dueTicks.push_back(toTick(dueTimes[i]));
+        }
+        sort(dueTicks.begin(), dueTicks.end());
+        size_t distinct = unique(dueTicks.begin(), dueTicks.end()) - dueTicks.begin();
+
+        m_stats.wakeups++;
+        m_stats.timersFired += due.size() - first;
+        m_stats.wakeupsSaved += distinct - 1;
+    }
+}
+
+void TimerWheel::fire(Timer* timer, uint64_t due)
+{
+    uint64_t now = Clock::getTime();
+    uint64_t lateness = now > due ? now - due : 0;
+    timer->recordLateness(lateness);
+    timer->recordFrame(now);
+    m_lateness.record(lateness);
+
+    timer->signal().emit(timer);
+}
+
+TimerScheduler::TimerScheduler()
+{
+    m_timersMutex = Thread::createMutex();
+}
+
+TimerScheduler::~TimerScheduler()
+{
+    delete m_timersMutex;
+}
+
+void TimerScheduler::addTimer(Timer* timer)
+{
+    uint64_t now = Clock::getTime();
+
+    m_timersMutex->lock();
+    m_wheel.add(timer, now);
+    timersChanged();
+    m_timersMutex->unlock();
+}
+
+void TimerScheduler::addTimerAt(Timer* timer, uint64_t time)
+{
+    m_timersMutex->lock();
+    m_wheel.addAt(timer, time);
+    timersChanged();
+    m_timersMutex->unlock();
+}
+
+void TimerScheduler::resetTimer(Timer* timer)
+{
+    m_timersMutex->lock();
+    m_wheel.reset(timer, Clock::getTime());
+    timersChanged();
+    m_timersMutex->unlock();
+}
+
+void TimerScheduler::cancelTimer(Timer* timer)
+{
+    timer->setActive(false);
+
+    m_timersMutex->lock();
+    m_wheel.cancel(timer);
+    timersChanged();
+    m_timersMutex->unlock();
+}
+
+bool TimerScheduler::isScheduled(Timer* timer)
+{
+    m_timersMutex->lock();
+    bool scheduled = m_wheel.isScheduled(timer);
+    m_timersMutex->unlock();
+    return scheduled;
+}
+
+Timer* TimerScheduler::findTimer(std::string id)
+{
+    m_timersMutex->lock();
+    Timer* result = m_wheel.find(id);
+    m_timersMutex->unlock();
+    return result;
+}
+
+TimerManagerStats TimerScheduler::getStats()
+{
+    m_timersMutex->lock();
+    TimerManagerStats stats = m_wheel.getStats();
+    m_timersMutex->unlock();
+    return stats;
+}
+
+void TimerScheduler::resetStats()
+{
+    m_timersMutex->lock();
+    m_wheel.resetStats();
+    m_timersMutex->unlock();
+}
+
+size_t TimerScheduler::getTimerCount()
+{
+    m_timersMutex->lock();
+    size_t count = m_wheel.getTimerCount();
+    m_timersMutex->unlock();
+    return count;
+}
+
+TimerManager::TimerManager()
+{
+    m_condVar = Thread::createCondVar();
+    m_timersChanged = false;
+
+    m_executor = NULL;
+    m_priority = TASK_PRIORITY_NORMAL;
+}
+
+TimerManager::~TimerManager()
+{
+}
+
+void TimerManager::timersChanged()
+{
+    m_timersChanged = true;
+    m_condVar->signal();
+}
+
+void TimerManager::setExecutor(TaskExecutor* executor, TaskPriority priority)
+{
+    m_timersMutex->lock();
+    m_executor = executor;
+    m_priority = priority;
+    m_timersMutex->unlock();
+}
+
+void TimerManager::dispatch(Timer* timer, uint64_t due, TaskExecutor* executor, TaskPriority priority)
+{
+    Strand* strand = timer->getStrand();
+    if (strand != NULL)
+    {
+        strand->post([this, timer, due]() { m_wheel.fire(timer, due); });
+    }
+    else if (executor != NULL)
+    {
+        // Timers have already been accepted, so ignore the queue capacity
+        // rather than block the timer thread
+        InlineTask* task = InlineTask::create([this, timer, due]() { m_wheel.fire(timer, due); });
+        task->setPriority(priority);
+        executor->forceAddTask(task);
+    }
+    else
+    {
+        m_wheel.fire(timer, due);
+    }
+}
+
+bool TimerManager::main()
+{
+    while (true)
+    {
+        vector<Timer*> emitSignals;
+        vector<uint64_t> dueTimes;
+
+        m_timersMutex->lock();
+        m_timersChanged = false;
+
+        m_wheel.expire(Clock::getTime(), emitSignals, dueTimes);
+
+        uint64_t next = m_wheel.getNextEvent();
+        TaskExecutor* executor = m_executor;
+        TaskPriority priority = m_priority;
         m_timersMutex->unlock();
 
-        for (Timer* timer : emitSignals)
+        // Callbacks may be slow, so dispatch without holding the lock
+
+        size_t i;
+        for (i = 0; i < emitSignals.size(); i++)
         {
-#if 0
-            TimerThread* thread = new TimerThread(timer);
-            thread->start();
-#else
-            timer->signal().emit(timer);
-            if (timer->getType() == TIMER_ONE_SHOT)
-            {
-                //delete timer;
-            }
-#endif
+            dispatch(emitSignals[i], dueTimes[i], executor, priority);
         }
 
-        uint64_t now = getTimestamp();
-        uint64_t wait = next - now;
+        if (!emitSignals.empty())
+        {
+            // Firing may have taken a while, check again before sleeping
+            continue;
+        }
 
-        if (emitSignals.empty() && wait > 0)
+        // Sleep until the next timer is due, or the timers change
+        m_timersMutex->lock();
+        if (next == 0)
+        {
+            m_condVar->waitUntil(m_timersMutex, [this]() { return m_timersChanged; });
+        }
+        else
         {
 #if 0
-            printf("TimerManager::main: Waiting %llu ms\n", wait);
+            printf("TimerManager::main: Waiting %llu ns\n", next - Clock::getTime());
 #endif
-            m_condVar->wait(wait);
+            while (!m_timersChanged && Clock::getTime() < next)
+            {
+                m_condVar->waitUntilTime(m_timersMutex, next);
+            }
         }
+        m_timersMutex->unlock();
     }
 }
-
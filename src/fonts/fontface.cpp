@@ -43,8 +43,6 @@ FontFace::FontFace(
 
     m_references = 0;
     m_face = NULL;
-
-    m_mutex = Thread::createMutex();
 }
 
 FontFace::~FontFace()
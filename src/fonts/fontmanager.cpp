@@ -156,14 +156,19 @@ FontHandle* FontManager::openFont(string familyName, string style, int size)
         style.c_str(),
         size);
 #endif
-    FontFamily* family = getFontFamily(familyName);
-    if (family == NULL)
+    FontFace* face = NULL;
     {
-        log(ERROR, "openFont: Failed to find font family: %s", familyName.c_str());
-        return NULL;
+        ReadGuard guard(m_fontFamiliesLock);
+        FontFamily* family = findFontFamily(familyName);
+        if (family == NULL)
+        {
+            log(ERROR, "openFont: Failed to find font family: %s", familyName.c_str());
+            return NULL;
+        }
+
+        face = family->getFace(style);
     }
 
-    FontFace* face = family->getFace(style);
     if (face == NULL)
     {
         log(ERROR, "openFont: Failed to find font style: %s", familyName.c_str());
@@ -203,24 +208,27 @@ bool FontManager::addFontFile(string path)
 #endif
 
         string familyName(face->family_name);
-        FontFamily* family = getFontFamily(familyName);
 
-        if (family == NULL)
         {
-            family = new FontFamily(familyName);
-            m_fontFamilies.insert(make_pair(familyName, family));
-        }
+            WriteGuard guard(m_fontFamiliesLock);
+            FontFamily* family = findFontFamily(familyName);
+            if (family == NULL)
+            {
+                family = new FontFamily(familyName);
+                m_fontFamilies.insert(make_pair(familyName, family));
+            }
 
-        FontFace* fontFace = new FontFace(
-            this,
-            family,
-            path,
-            index,
-            face->style_name,
-            face->height,
-            face->units_per_EM);
+            FontFace* fontFace = new FontFace(
+                this,
+                family,
+                path,
+                index,
+                face->style_name,
+                face->height,
+                face->units_per_EM);
 
-        family->addFace(fontFace);
+            family->addFace(fontFace);
+        }
         FT_Done_Face(face);
     }
 
@@ -228,6 +236,12 @@ bool FontManager::addFontFile(string path)
 }
 
 FontFamily* FontManager::getFontFamily(string familyName)
+{
+    ReadGuard guard(m_fontFamiliesLock);
+    return findFontFamily(familyName);
+}
+
+FontFamily* FontManager::findFontFamily(string familyName)
 {
      FontFamily* family = NULL;
      map<string, FontFamily*>::iterator it;
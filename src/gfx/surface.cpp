@@ -27,6 +27,7 @@
 #include <geek/gfx-surface.h>
 #include <geek/core-compiler.h>
 #include <geek/core-data.h>
+#include <geek/core-parallel.h>
 
 using namespace std;
 using namespace Geek;
@@ -458,6 +459,11 @@ Surface* Surface::scaleToFit(int width, int height, bool fp)
 }
 
 Surface* Surface::scale(float factor, bool fp)
+{
+    return scale(factor, fp, nullptr);
+}
+
+Surface* Surface::scale(float factor, bool fp, Geek::Core::TaskExecutor* executor)
 {
     unsigned int width = (int)((float)m_width * factor);
     unsigned int height = (int)((float)m_height * factor);
@@ -474,10 +480,10 @@ Surface* Surface::scale(float factor, bool fp)
     auto data = (uint32_t*)scaled->getData();
     auto srcdata = (uint8_t*)getData();
 
-    unsigned int y;
-    for (y = 0; y < height; y++)
+    auto scaleRow = [&](int64_t y)
     {
         int blockY = floor((float)y * stepY);
+        uint32_t* row = data + (y * width);
         unsigned int x;
         for (x = 0; x < width; x++)
         {
@@ -540,8 +546,23 @@ Surface* Surface::scale(float factor, bool fp)
 #endif
             }
 
-            *(data++) = (avg[3] << 24 | avg[2] << 16) | (avg[1] << 8) | (avg[0] << 0);
+            *(row++) = (avg[3] << 24 | avg[2] << 16) | (avg[1] << 8) | (avg[0] << 0);
         }
+    };
+
+    if (executor == nullptr)
+    {
+        unsigned int y;
+        for (y = 0; y < height; y++)
+        {
+            scaleRow(y);
+        }
+    }
+    else
+    {
+        // Give each chunk enough pixels to be worth handing to another thread
+        int64_t grain = MAX(1, 16384 / (int)MAX(width, 1u));
+        Geek::Core::parallelFor(executor, 0, height, grain, scaleRow);
     }
 
     return scaled;
@@ -0,0 +1,78 @@
+
+#include <geek/core-arena.h>
+
+#include <cstring>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek;
+
+struct Point
+{
+    int x;
+    int y;
+
+    Point(int x, int y) : x(x), y(y) {}
+};
+
+TEST(Arena, AllocTest)
+{
+    Arena arena(1024);
+    EXPECT_EQ(0, arena.getUsed());
+
+    uint8_t* bytes = arena.alloc<uint8_t>(3);
+    memset(bytes, 1, 3);
+
+    // Aligned, even after an odd sized allocation
+    double* d = arena.alloc<double>(4);
+    EXPECT_EQ(0, (uintptr_t)d % alignof(double));
+
+    void* wide = arena.alloc(16, 256);
+    EXPECT_EQ(0, (uintptr_t)wide % 256);
+
+    Point* point = arena.create<Point>(1, 2);
+    EXPECT_EQ(1, point->x);
+    EXPECT_EQ(2, point->y);
+
+    // Doesn't fit in a block
+    uint8_t* big = arena.alloc<uint8_t>(4096);
+    memset(big, 2, 4096);
+    EXPECT_GE(arena.getUsed(), 4096 + 3 + 4 * sizeof(double));
+
+    arena.reset();
+    EXPECT_EQ(0, arena.getUsed());
+}
+
+TEST(Arena, ScopeTest)
+{
+    Arena arena(256);
+    arena.alloc(10);
+    size_t used = arena.getUsed();
+
+    {
+        ArenaScope scope(arena);
+        int i;
+        for (i = 0; i < 100; i++)
+        {
+            arena.alloc(100);
+        }
+        EXPECT_GE(arena.getUsed(), used + 100 * 100);
+
+        {
+            ArenaScope inner(arena);
+            arena.alloc(1000);
+        }
+    }
+    EXPECT_EQ(used, arena.getUsed());
+
+}
+
+TEST(Arena, ReuseTest)
+{
+    // Rewound blocks are kept for next time
+    Arena arena(256);
+    void* first = arena.alloc(200);
+    arena.reset();
+    EXPECT_EQ(first, arena.alloc(200));
+}
@@ -0,0 +1,129 @@
+
+#include <geek/core-async.h>
+
+#include <gtest/gtest.h>
+
+#ifdef GEEK_HAVE_COROUTINES
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <stdexcept>
+#include <vector>
+
+#include <stdlib.h>
+#include <unistd.h>
+
+using namespace std;
+using namespace Geek;
+using namespace Geek::Core;
+
+static AsyncTask<int> square(int value)
+{
+    co_await asyncSleep(1);
+    co_return value * value;
+}
+
+static AsyncTask<int> sumOfSquares(int a, int b)
+{
+    int x = co_await square(a);
+    int y = co_await square(b);
+    co_return x + y;
+}
+
+static AsyncTask<void> sleeper(atomic<int>* count)
+{
+    co_await asyncSleep(20);
+    (*count)++;
+}
+
+static AsyncTask<int> thrower()
+{
+    co_await asyncSleep(1);
+    throw runtime_error("failed");
+    co_return 0;
+}
+
+TEST(Async, BasicTest)
+{
+    TaskExecutor executor(2, TASK_EXECUTOR_WORK_STEALING);
+
+    AsyncTask<int> task = sumOfSquares(3, 4);
+    task.start(&executor);
+    EXPECT_EQ(25, task.get());
+    EXPECT_TRUE(task.isReady());
+
+    // Not started, so runs on this thread until it first suspends
+    EXPECT_EQ(41, sumOfSquares(4, 5).get());
+
+    EXPECT_THROW(thrower().get(), runtime_error);
+}
+
+TEST(Async, SleepTest)
+{
+    // Far more sleeping tasks than workers
+    TaskExecutor executor(2, TASK_EXECUTOR_POOL);
+    executor.setTaskTracking(false);
+
+    atomic<int> count(0);
+    auto start = chrono::steady_clock::now();
+    {
+        vector<AsyncTask<void>> tasks;
+        int i;
+        for (i = 0; i < 1000; i++)
+        {
+            tasks.push_back(sleeper(&count));
+            tasks.back().start(&executor);
+        }
+    }
+    auto elapsed = chrono::steady_clock::now() - start;
+
+    EXPECT_EQ(1000, count.load());
+    EXPECT_LT(chrono::duration_cast<chrono::milliseconds>(elapsed).count(), 5000);
+}
+
+static AsyncTask<int> awaitFuture(TaskExecutor* executor)
+{
+    int value = co_await executor->submit([]() { return 42; });
+    co_return value + 1;
+}
+
+static AsyncTask<int> blocking()
+{
+    int value = co_await asyncBlocking([]() { return 7; });
+    co_return value;
+}
+
+TEST(Async, AwaitTest)
+{
+    TaskExecutor executor(2, TASK_EXECUTOR_POOL);
+
+    AsyncTask<int> future = awaitFuture(&executor);
+    future.start(&executor);
+    EXPECT_EQ(43, future.get());
+
+    EXPECT_EQ(7, blocking().get());
+}
+
+static AsyncTask<uint32_t> readLength(string filename)
+{
+    unique_ptr<Data> data(co_await asyncReadFile(filename));
+    co_return data != nullptr ? data->getLength() : 0;
+}
+
+TEST(Async, ReadFileTest)
+{
+    char filename[] = "/tmp/geek-async-XXXXXX";
+    int fd = mkstemp(filename);
+    ASSERT_GE(fd, 0);
+    ASSERT_EQ(5, write(fd, "hello", 5));
+    close(fd);
+
+    EXPECT_EQ(5, readLength(filename).get());
+    EXPECT_EQ(0, readLength("/nonexistent/geek-async").get());
+
+    unlink(filename);
+}
+
+#endif
@@ -0,0 +1,35 @@
+
+#include <geek/core-clock.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek;
+
+TEST(Clock, MonotonicTest)
+{
+    uint64_t last = Clock::getTime();
+    int i;
+    for (i = 0; i < 10000; i++)
+    {
+        uint64_t now = Clock::getTime();
+        EXPECT_GE(now, last);
+        last = now;
+    }
+
+    EXPECT_LE(Clock::getResolution(), 1000000ull);
+    EXPECT_NEAR(Clock::getMicros(), Clock::getTime() / 1000ull, 1000);
+}
+
+TEST(Clock, SleepTest)
+{
+    uint64_t start = Clock::getTime();
+    Clock::sleep(2000000ull);
+    EXPECT_GE(Clock::getTime() - start, 2000000ull);
+
+    // Sub-ms, and already passed
+    uint64_t deadline = Clock::getTime() + 250000ull;
+    Clock::sleepUntil(deadline);
+    EXPECT_GE(Clock::getTime(), deadline);
+    Clock::sleepUntil(start);
+}
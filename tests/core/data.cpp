@@ -0,0 +1,83 @@
+
+#include <geek/core-data.h>
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <unistd.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek;
+
+static string writeTempFile(const char* contents, size_t length)
+{
+    char path[] = "/tmp/geek-data-XXXXXX";
+    int fd = mkstemp(path);
+    if (fd == -1)
+    {
+        return "";
+    }
+    ssize_t res = write(fd, contents, length);
+    close(fd);
+    if (res != (ssize_t)length)
+    {
+        return "";
+    }
+    return path;
+}
+
+TEST(Data, LoadMappedTest)
+{
+    const char contents[] = "\x01\x02\x03\x04hello\0world\n";
+    string path = writeTempFile(contents, sizeof(contents) - 1);
+    ASSERT_FALSE(path.empty());
+
+    Data loaded;
+    ASSERT_TRUE(loaded.load(path));
+
+    Data data;
+    ASSERT_TRUE(data.loadMapped(path, ACCESS_SEQUENTIAL));
+    EXPECT_TRUE(data.isMapped());
+    ASSERT_EQ(loaded.getLength(), data.getLength());
+    EXPECT_EQ(0, memcmp(loaded.getData(), data.getData(), data.getLength()));
+
+    data.setEndian(BIG);
+    EXPECT_EQ(0x01020304u, data.read32());
+    EXPECT_EQ("hello", data.readString(6));
+    EXPECT_EQ("world", data.readLine());
+    EXPECT_TRUE(data.eof());
+
+    Data* sub = data.getSubData(4, 5);
+    EXPECT_EQ("hello", sub->readString(5));
+    delete sub;
+
+    // Appending moves it to a private copy
+    EXPECT_TRUE(data.append8('!'));
+    EXPECT_FALSE(data.isMapped());
+    EXPECT_EQ(loaded.getLength() + 1, data.getLength());
+    EXPECT_EQ('!', data.getData()[data.getLength() - 1]);
+    EXPECT_EQ(0, memcmp(loaded.getData(), data.getData(), loaded.getLength()));
+
+    data.clear();
+    EXPECT_EQ(0, data.getLength());
+
+    unlink(path.c_str());
+}
+
+TEST(Data, LoadMappedEmptyTest)
+{
+    string path = writeTempFile("", 0);
+    ASSERT_FALSE(path.empty());
+
+    Data data;
+    EXPECT_TRUE(data.loadMapped(path));
+    EXPECT_FALSE(data.isMapped());
+    EXPECT_EQ(0, data.getLength());
+    EXPECT_TRUE(data.eof());
+    unlink(path.c_str());
+
+    EXPECT_FALSE(data.loadMapped(path));
+}
@@ -0,0 +1,260 @@
+
+#include <geek/core-eventloop.h>
+
+#if defined(__linux__)
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <unistd.h>
+#include <sys/resource.h>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek;
+using namespace Geek::Core;
+
+TEST(EventLoop, FdTest)
+{
+    EventLoop loop;
+
+    int fds[2];
+    ASSERT_EQ(0, pipe(fds));
+
+    string received;
+    unsigned int seen = 0;
+    EXPECT_TRUE(loop.addFd(fds[0], EVENT_READ, [&](int fd, unsigned int events)
+    {
+        seen |= events;
+        char buffer[16];
+        ssize_t len = read(fd, buffer, sizeof(buffer));
+        if (len > 0)
+        {
+            received.append(buffer, len);
+        }
+    }));
+    EXPECT_FALSE(loop.addFd(fds[0], EVENT_READ, [](int, unsigned int) {}));
+
+    // Nothing ready yet
+    EXPECT_EQ(0, loop.runOnce(0));
+
+    ASSERT_EQ(5, write(fds[1], "hello", 5));
+    EXPECT_EQ(1, loop.runOnce(1000));
+    EXPECT_EQ("hello", received);
+    EXPECT_TRUE(seen & EVENT_READ);
+
+    close(fds[1]);
+    EXPECT_EQ(1, loop.runOnce(1000));
+    EXPECT_TRUE(seen & EVENT_HANGUP);
+
+    EXPECT_TRUE(loop.removeFd(fds[0]));
+    EXPECT_FALSE(loop.removeFd(fds[0]));
+    EXPECT_EQ(0, loop.runOnce(0));
+    close(fds[0]);
+}
+
+// Run in a child process, as it leaves no fds free for anything else
+static bool runInvalidLoop()
+{
+    int lowest = dup(0);
+    if (lowest == -1)
+    {
+        return false;
+    }
+    close(lowest);
+    struct rlimit limit;
+    getrlimit(RLIMIT_NOFILE, &limit);
+    limit.rlim_cur = lowest;
+    if (setrlimit(RLIMIT_NOFILE, &limit) != 0)
+    {
+        return false;
+    }
+
+    EventLoop loop;
+    if (loop.isValid())
+    {
+        return false;
+    }
+
+    bool ok = true;
+    ok &= !loop.addFd(0, EVENT_READ, [](int, unsigned int) {});
+    ok &= !loop.modifyFd(0, EVENT_WRITE);
+    ok &= !loop.removeFd(0);
+
+    Timer timer(TIMER_ONE_SHOT, 1);
+    loop.addTimer(&timer);
+    loop.post([]() {});
+    ok &= loop.runOnce(0) == -1;
+
+    // Returns rather than spinning
+    loop.run();
+    loop.cancelTimer(&timer);
+    return ok;
+}
+
+TEST(EventLoopDeathTest, InvalidTest)
+{
+    EXPECT_EXIT(_exit(runInvalidLoop() ? 0 : 1), ::testing::ExitedWithCode(0), "");
+}
+
+TEST(EventLoop, PostTest)
+{
+    EventLoop* loop = new EventLoop();
+    loop->start();
+
+    const int count = 1000;
+    atomic<int> ran(0);
+    atomic<int> wrongThread(0);
+    vector<thread> threads;
+    int t;
+    for (t = 0; t < 4; t++)
+    {
+        threads.emplace_back([loop, &ran, &wrongThread]()
+        {
+            int i;
+            for (i = 0; i < count; i++)
+            {
+                loop->post([loop, &ran, &wrongThread]()
+                {
+                    if (!loop->isInLoop())
+                    {
+                        wrongThread++;
+                    }
+                    ran++;
+                });
+            }
+        });
+    }
+    for (thread& thread : threads)
+    {
+        thread.join();
+    }
+
+    uint64_t end = Clock::getMillis() + 2000;
+    while (ran < count * 4 && Clock::getMillis() < end)
+    {
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    EXPECT_EQ(count * 4, ran.load());
+    EXPECT_EQ(0, wrongThread.load());
+    EXPECT_FALSE(loop->isInLoop());
+
+    loop->stop();
+    loop->wait();
+    EXPECT_TRUE(loop->isComplete());
+    delete loop;
+}
+
+TEST(EventLoop, TimerTest)
+{
+    EventLoop* loop = new EventLoop();
+    loop->start();
+
+    atomic<int> oneShot(0);
+    atomic<int> periodic(0);
+    atomic<int> early(0);
+    atomic<int> wrongThread(0);
+    Timer once("once", TIMER_ONE_SHOT, 20);
+    once.signal().connect(sigc::slot<void, Timer*>([&](Timer* timer)
+    {
+        if (Clock::getTime() < timer->getNextRun())
+        {
+            early++;
+        }
+        if (!loop->isInLoop())
+        {
+            wrongThread++;
+        }
+        oneShot++;
+    }));
+    Timer repeat(TIMER_PERIODIC, 5);
+    repeat.signal().connect(sigc::slot<void, Timer*>([&](Timer*) { periodic++; }));
+
+    // The same API as TimerManager
+    TimerScheduler* scheduler = loop;
+    scheduler->addTimer(&once);
+    scheduler->addTimer(&repeat);
+    EXPECT_EQ(&once, scheduler->findTimer("once"));
+    EXPECT_EQ(2, scheduler->getTimerCount());
+
+    this_thread::sleep_for(chrono::milliseconds(100));
+    EXPECT_EQ(1, oneShot.load());
+    EXPECT_EQ(0, early.load());
+    EXPECT_EQ(0, wrongThread.load());
+    EXPECT_FALSE(loop->isScheduled(&once));
+    EXPECT_EQ(NULL, loop->findTimer("once"));
+    EXPECT_GT(periodic.load(), 5);
+    // Counted as they expire, so before their callbacks run
+    uint64_t fired = oneShot + periodic;
+    EXPECT_GE(loop->getStats().timersFired, fired);
+
+    loop->cancelTimer(&repeat);
+    EXPECT_EQ(0, loop->getTimerCount());
+
+    // It may have been firing as it was cancelled
+    this_thread::sleep_for(chrono::milliseconds(10));
+    int stopped = periodic;
+    this_thread::sleep_for(chrono::milliseconds(30));
+    EXPECT_EQ(stopped, periodic.load());
+
+    loop->stop();
+    loop->wait();
+    delete loop;
+}
+
+TEST(EventLoop, GroupTest)
+{
+    EventLoopGroup group(4);
+    EXPECT_EQ(4, group.size());
+    group.start();
+
+    // Round robin
+    EXPECT_EQ(group.getLoop(0), group.next());
+    EXPECT_EQ(group.getLoop(1), group.next());
+
+    atomic<int> ran(0);
+    unsigned int i;
+    for (i = 0; i < group.size(); i++)
+    {
+        EventLoop* loop = group.getLoop(i);
+        loop->post([loop, &ran]()
+        {
+            if (EventLoop::getCurrent() == loop)
+            {
+                ran++;
+            }
+        });
+    }
+
+    uint64_t end = Clock::getMillis() + 2000;
+    while (ran < 4 && Clock::getMillis() < end)
+    {
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    EXPECT_EQ(4, ran.load());
+
+    group.stop();
+    for (i = 0; i < group.size(); i++)
+    {
+        EXPECT_TRUE(group.getLoop(i)->isComplete());
+    }
+
+    // Stopping isn't final
+    group.start();
+    atomic<int> restarted(0);
+    for (i = 0; i < group.size(); i++)
+    {
+        group.getLoop(i)->post([&restarted]() { restarted++; });
+    }
+    end = Clock::getMillis() + 2000;
+    while (restarted < 4 && Clock::getMillis() < end)
+    {
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+    EXPECT_EQ(4, restarted.load());
+    group.stop();
+}
+
+#endif
@@ -0,0 +1,103 @@
+
+#include <geek/core-mpmcqueue.h>
+#include <geek/core-thread.h>
+
+#include <atomic>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek::Core;
+
+TEST(MPMCQueue, BasicTest)
+{
+    MPMCQueue<int> queue(5);
+    EXPECT_EQ(8, queue.capacity());
+
+    int i;
+    for (i = 0; i < 8; i++)
+    {
+        EXPECT_TRUE(queue.push(i));
+    }
+    EXPECT_FALSE(queue.push(8));
+    EXPECT_EQ(8, queue.size());
+
+    for (i = 0; i < 8; i++)
+    {
+        int value = -1;
+        EXPECT_TRUE(queue.pop(value));
+        EXPECT_EQ(i, value);
+    }
+
+    int value;
+    EXPECT_FALSE(queue.pop(value));
+    EXPECT_EQ(0, queue.size());
+}
+
+class QueueThread : public Geek::Thread
+{
+    MPMCQueue<int>* m_queue;
+    bool m_producer;
+    std::atomic<int64_t>* m_total;
+
+ public:
+    QueueThread(MPMCQueue<int>* queue, bool producer, std::atomic<int64_t>* total)
+    {
+        m_queue = queue;
+        m_producer = producer;
+        m_total = total;
+    }
+
+    bool main() override
+    {
+        int i;
+        for (i = 1; i <= 10000; i++)
+        {
+            if (m_producer)
+            {
+                while (!m_queue->push(i))
+                {
+                    this_thread::yield();
+                }
+            }
+            else
+            {
+                int value;
+                while (!m_queue->pop(value))
+                {
+                    this_thread::yield();
+                }
+                (*m_total) += value;
+            }
+        }
+        return true;
+    }
+};
+
+TEST(MPMCQueue, ThreadTest)
+{
+    MPMCQueue<int> queue(64);
+    std::atomic<int64_t> total(0);
+
+    vector<QueueThread*> threads;
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        threads.push_back(new QueueThread(&queue, true, &total));
+        threads.push_back(new QueueThread(&queue, false, &total));
+    }
+    for (QueueThread* thread : threads)
+    {
+        thread->start();
+    }
+    for (QueueThread* thread : threads)
+    {
+        thread->wait();
+        delete thread;
+    }
+
+    EXPECT_EQ(4 * ((10000LL * 10001LL) / 2), total.load());
+    EXPECT_EQ(0, queue.size());
+}
@@ -0,0 +1,94 @@
+
+#include <geek/core-parallel.h>
+
+#include <atomic>
+#include <cstdio>
+#include <stdexcept>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek::Core;
+
+TEST(Parallel, ForTest)
+{
+    TaskExecutor executor(4, TASK_EXECUTOR_WORK_STEALING);
+
+    vector<int> values(100000, 0);
+    parallelFor(&executor, 0, values.size(), 0, [&values](int64_t i)
+    {
+        values[i] += (int)i;
+    });
+
+    int64_t i;
+    for (i = 0; i < (int64_t)values.size(); i++)
+    {
+        ASSERT_EQ(i, values[i]);
+    }
+
+    // Ranges that don't divide evenly, and empty ranges
+    std::atomic<int64_t> sum(0);
+    parallelFor(&executor, 10, 1011, 7, [&sum](int64_t i) { sum += i; });
+    EXPECT_EQ((1010 * 1011) / 2 - (9 * 10) / 2, sum.load());
+
+    parallelFor(&executor, 5, 5, 0, [&sum](int64_t i) { sum = -1; });
+    EXPECT_NE(-1, sum.load());
+
+    executor.wait();
+}
+
+TEST(Parallel, NestedTest)
+{
+    std::atomic<int> count(0);
+
+    // The callers take part, so nesting can't run out of workers
+    parallelFor(0, 16, 1, [&count](int64_t i)
+    {
+        parallelFor(0, 100, 1, [&count](int64_t j)
+        {
+            count++;
+        });
+    });
+
+    EXPECT_EQ(1600, count.load());
+}
+
+TEST(Parallel, ReduceTest)
+{
+    TaskExecutor executor(3, TASK_EXECUTOR_POOL);
+
+    int64_t sum = parallelReduce(
+        &executor,
+        0,
+        1000000,
+        0,
+        (int64_t)0,
+        [](int64_t i) { return i; },
+        [](int64_t a, int64_t b) { return a + b; });
+    EXPECT_EQ((999999LL * 1000000LL) / 2, sum);
+
+    int max = parallelReduce(
+        0,
+        1000,
+        16,
+        -1,
+        [](int64_t i) { return (int)((i * 7919) % 1000); },
+        [](int a, int b) { return a > b ? a : b; });
+    EXPECT_EQ(999, max);
+
+    executor.wait();
+}
+
+TEST(Parallel, ExceptionTest)
+{
+    EXPECT_THROW(
+        parallelFor(0, 1000, 10, [](int64_t i)
+        {
+            if (i == 500)
+            {
+                throw runtime_error("failed");
+            }
+        }),
+        runtime_error);
+}
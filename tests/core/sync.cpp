@@ -0,0 +1,288 @@
+
+#include <geek/core-sync.h>
+#include <geek/core-thread.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek;
+
+template <typename L>
+static void contend(L& lock)
+{
+    int count = 0;
+    vector<thread> threads;
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        threads.push_back(thread([&lock, &count]()
+        {
+            int j;
+            for (j = 0; j < 10000; j++)
+            {
+                LockGuard<L> guard(lock);
+                count++;
+            }
+        }));
+    }
+    for (thread& t : threads)
+    {
+        t.join();
+    }
+    EXPECT_EQ(40000, count);
+}
+
+TEST(Sync, SpinLockTest)
+{
+    SpinLock lock;
+    EXPECT_TRUE(lock.tryLock());
+    EXPECT_FALSE(lock.tryLock());
+    lock.unlock();
+
+    contend(lock);
+}
+
+TEST(Sync, FastMutexTest)
+{
+    FastMutex mutex;
+    EXPECT_TRUE(mutex.tryLock());
+    EXPECT_FALSE(mutex.tryLock());
+    mutex.unlock();
+
+    contend(mutex);
+
+    // Works with the existing Mutex too
+    Mutex* legacy = Thread::createMutex();
+    contend(*legacy);
+    delete legacy;
+}
+
+TEST(Sync, RWLockTest)
+{
+    RWLock lock;
+
+    // Trying a lock we already hold is undefined, so the contended tries
+    // come from another thread
+    {
+        ReadGuard first(lock);
+        thread other([&lock]()
+        {
+            EXPECT_TRUE(lock.tryLockRead());
+            EXPECT_FALSE(lock.tryLockWrite());
+            lock.unlockRead();
+        });
+        other.join();
+    }
+
+    {
+        WriteGuard guard(lock);
+        thread other([&lock]()
+        {
+            EXPECT_FALSE(lock.tryLockRead());
+            EXPECT_FALSE(lock.tryLockWrite());
+        });
+        other.join();
+    }
+
+    vector<int> values;
+    atomic<bool> done(false);
+    atomic<bool> torn(false);
+    thread writer([&]()
+    {
+        int i;
+        for (i = 0; i < 1000; i++)
+        {
+            WriteGuard guard(lock);
+            values.push_back(i);
+        }
+        done = true;
+    });
+
+    vector<thread> readers;
+    int i;
+    for (i = 0; i < 3; i++)
+    {
+        readers.push_back(thread([&]()
+        {
+            while (!done)
+            {
+                ReadGuard guard(lock);
+                if (!values.empty() && values.back() != (int)values.size() - 1)
+                {
+                    torn = true;
+                }
+            }
+        }));
+    }
+
+    writer.join();
+    for (thread& reader : readers)
+    {
+        reader.join();
+    }
+    EXPECT_FALSE(torn);
+    EXPECT_EQ(1000, values.size());
+}
+
+TEST(Sync, FastCondVarTest)
+{
+    FastMutex mutex;
+    FastCondVar cond;
+    int value = 0;
+
+    vector<thread> waiters;
+    atomic<int> woken(0);
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        waiters.push_back(thread([&]()
+        {
+            LockGuard<FastMutex> guard(mutex);
+            cond.waitUntil(mutex, [&value] { return value == 1; });
+            woken++;
+        }));
+    }
+
+    {
+        LockGuard<FastMutex> guard(mutex);
+        value = 1;
+        cond.broadcast();
+    }
+    for (thread& waiter : waiters)
+    {
+        waiter.join();
+    }
+    EXPECT_EQ(4, woken.load());
+
+    // Timeouts
+    LockGuard<FastMutex> guard(mutex);
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    EXPECT_FALSE(cond.waitUntil(mutex, [&value] { return value == 2; }, 20));
+    EXPECT_GE(chrono::steady_clock::now() - start, chrono::milliseconds(20));
+    EXPECT_TRUE(cond.waitUntil(mutex, [&value] { return value == 1; }, 20));
+}
+
+TEST(Sync, SemaphoreTest)
+{
+    Semaphore semaphore(2);
+    EXPECT_TRUE(semaphore.tryAcquire());
+    EXPECT_TRUE(semaphore.tryAcquire());
+    EXPECT_FALSE(semaphore.tryAcquire());
+
+    // Consumers wait for the producer
+    atomic<int> consumed(0);
+    vector<thread> consumers;
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        consumers.push_back(thread([&]()
+        {
+            int j;
+            for (j = 0; j < 100; j++)
+            {
+                semaphore.acquire();
+                consumed++;
+            }
+        }));
+    }
+
+    for (i = 0; i < 100; i++)
+    {
+        semaphore.release(4);
+    }
+
+    for (thread& consumer : consumers)
+    {
+        consumer.join();
+    }
+    EXPECT_EQ(400, consumed.load());
+    EXPECT_EQ(0, semaphore.getCount());
+}
+
+TEST(Sync, BarrierTest)
+{
+    const int count = 4;
+    Barrier barrier(count);
+    atomic<int> phase[3];
+    atomic<int> leaders(0);
+    atomic<bool> early(false);
+
+    int i;
+    for (i = 0; i < 3; i++)
+    {
+        phase[i] = 0;
+    }
+
+    vector<thread> threads;
+    for (i = 0; i < count; i++)
+    {
+        threads.push_back(thread([&]()
+        {
+            int p;
+            for (p = 0; p < 3; p++)
+            {
+                phase[p]++;
+                if (barrier.wait())
+                {
+                    leaders++;
+                }
+
+                // Everyone must have finished this phase
+                if (phase[p] != count)
+                {
+                    early = true;
+                }
+            }
+        }));
+    }
+
+    for (thread& t : threads)
+    {
+        t.join();
+    }
+    EXPECT_FALSE(early);
+    EXPECT_EQ(3, leaders.load());
+}
+
+TEST(Sync, LatchTest)
+{
+    Latch latch(3);
+    EXPECT_FALSE(latch.tryWait());
+
+    atomic<bool> opened(false);
+    thread waiter([&]()
+    {
+        latch.wait();
+        opened = true;
+    });
+
+    latch.countDown();
+    latch.countDown();
+    EXPECT_FALSE(opened);
+    latch.countDown();
+    waiter.join();
+
+    EXPECT_TRUE(opened);
+    EXPECT_TRUE(latch.tryWait());
+    latch.wait();
+}
+
+TEST(Sync, LatchLifetimeTest)
+{
+    // The waiter destroys the Latch as soon as it opens, which must be
+    // safe while countDown() is still returning
+    int i;
+    for (i = 0; i < 1000; i++)
+    {
+        Latch* latch = new Latch(1);
+        thread counter([latch]() { latch->countDown(); });
+        latch->wait();
+        delete latch;
+        counter.join();
+    }
+}
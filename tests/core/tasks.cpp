@@ -2,8 +2,10 @@
 #include <geek/core-tasks.h>
 #include <geek/core-random.h>
 
+#include <atomic>
 #include <cstdio>
 #include <cwchar>
+#include <thread>
 #include <unistd.h>
 
 #include <gtest/gtest.h>
@@ -72,3 +74,882 @@ TEST(Tasks, BasicTest)
     }
 }
 
+
+class CountTask : public Task
+{
+    std::atomic<int>* m_count;
+
+ public:
+    CountTask(std::atomic<int>* count) : Task(L"Count Task")
+    {
+        m_count = count;
+    }
+
+    ~CountTask() override = default;
+
+    void run() override
+    {
+        (*m_count)++;
+    }
+};
+
+TEST(Tasks, PoolTest)
+{
+    std::atomic<int> count(0);
+
+    TaskExecutor executor(4, TASK_EXECUTOR_POOL);
+    EXPECT_EQ(TASK_EXECUTOR_POOL, executor.getMode());
+
+    int i;
+    for (i = 0; i < 10000; i++)
+    {
+        executor.addTask(new CountTask(&count));
+    }
+
+    executor.wait();
+    EXPECT_EQ(10000, count.load());
+    EXPECT_EQ(0, executor.getTaskCount());
+    EXPECT_EQ(0, executor.getTaskInfo().size());
+
+    // The workers should still be around for the next batch
+    for (i = 0; i < 100; i++)
+    {
+        executor.addTask(new CountTask(&count));
+    }
+
+    executor.wait();
+    EXPECT_EQ(10100, count.load());
+}
+
+class SpawnTask : public Task
+{
+    TaskExecutor* m_executor;
+    std::atomic<int>* m_count;
+    int m_depth;
+
+ public:
+    SpawnTask(TaskExecutor* executor, std::atomic<int>* count, int depth) : Task(L"Spawn Task")
+    {
+        m_executor = executor;
+        m_count = count;
+        m_depth = depth;
+    }
+
+    ~SpawnTask() override = default;
+
+    void run() override
+    {
+        (*m_count)++;
+        if (m_depth > 0)
+        {
+            m_executor->addTask(new SpawnTask(m_executor, m_count, m_depth - 1));
+            m_executor->addTask(new SpawnTask(m_executor, m_count, m_depth - 1));
+        }
+    }
+};
+
+TEST(Tasks, WorkStealingTest)
+{
+    std::atomic<int> count(0);
+
+    TaskExecutor executor(4, TASK_EXECUTOR_WORK_STEALING);
+
+    // A binary tree of tasks, spawned from the workers themselves
+    executor.addTask(new SpawnTask(&executor, &count, 12));
+    executor.wait();
+    EXPECT_EQ((1 << 13) - 1, count.load());
+    EXPECT_EQ(0, executor.getTaskCount());
+
+    // And from outside
+    int i;
+    for (i = 0; i < 1000; i++)
+    {
+        executor.addTask(new CountTask(&count));
+    }
+    executor.wait();
+    EXPECT_EQ((1 << 13) - 1 + 1000, count.load());
+}
+
+TEST(Tasks, NumaTest)
+{
+    std::atomic<int> count(0);
+
+    TaskExecutor executor(4, TASK_EXECUTOR_NUMA);
+    executor.addTask(new SpawnTask(&executor, &count, 10));
+    executor.wait();
+    EXPECT_EQ((1 << 11) - 1, count.load());
+    EXPECT_EQ(0, executor.getTaskCount());
+}
+
+class OrderTask : public Task
+{
+    std::atomic<int>* m_sequence;
+    int* m_order;
+
+ public:
+    OrderTask(std::atomic<int>* sequence, int* order) : Task(L"Order Task")
+    {
+        m_sequence = sequence;
+        m_order = order;
+    }
+
+    ~OrderTask() override = default;
+
+    void run() override
+    {
+        usleep(1000);
+        *m_order = (*m_sequence)++;
+    }
+};
+
+TEST(Tasks, GraphTest)
+{
+    TaskExecutorMode modes[] = {TASK_EXECUTOR_TRANSIENT, TASK_EXECUTOR_POOL, TASK_EXECUTOR_WORK_STEALING, TASK_EXECUTOR_NUMA};
+    for (TaskExecutorMode mode : modes)
+    {
+        std::atomic<int> sequence(0);
+        int load = -1;
+        int decode1 = -1;
+        int decode2 = -1;
+        int save = -1;
+
+        TaskExecutor executor(4, mode);
+
+        // A diamond: load -> (decode1, decode2) -> save
+        TaskGraph graph;
+        Task* loadTask = new OrderTask(&sequence, &load);
+        Task* decode1Task = new OrderTask(&sequence, &decode1);
+        Task* decode2Task = new OrderTask(&sequence, &decode2);
+        Task* saveTask = new OrderTask(&sequence, &save);
+        graph.addTask(saveTask, {decode1Task, decode2Task});
+        graph.addTask(decode1Task, {loadTask});
+        graph.addTask(decode2Task, {loadTask});
+        graph.addTask(loadTask);
+
+        EXPECT_TRUE(executor.addGraph(&graph));
+        EXPECT_TRUE(graph.empty());
+
+        executor.wait();
+        EXPECT_EQ(0, load);
+        EXPECT_LT(load, decode1);
+        EXPECT_LT(load, decode2);
+        EXPECT_GT(save, decode1);
+        EXPECT_GT(save, decode2);
+        EXPECT_EQ(3, save);
+        EXPECT_EQ(0, executor.getTaskCount());
+    }
+}
+
+TEST(Tasks, GraphCycleTest)
+{
+    std::atomic<int> count(0);
+    TaskExecutor executor(2, TASK_EXECUTOR_POOL);
+
+    TaskGraph graph;
+    Task* a = new CountTask(&count);
+    Task* b = new CountTask(&count);
+    graph.addTask(a, {b});
+    graph.addTask(b, {a});
+
+    EXPECT_FALSE(graph.isValid());
+    EXPECT_FALSE(executor.addGraph(&graph));
+    EXPECT_EQ(2, graph.size());
+    EXPECT_EQ(0, executor.getTaskCount());
+}
+
+TEST(Tasks, FutureTest)
+{
+    TaskExecutor executor(2, TASK_EXECUTOR_POOL);
+
+    Future<int> future = executor.submit([]() { return 6 * 7; });
+    EXPECT_EQ(42, future.get());
+    EXPECT_TRUE(future.isReady());
+
+    // Chain some continuations, changing type along the way
+    Future<string> chained = executor.submit([]() { return 2; })
+        .then([](int i) { return i * 10; })
+        .then([](int i) { return to_string(i); });
+    EXPECT_EQ("20", chained.get());
+
+    // Continuations added after the result is ready still run
+    Future<int> ready = executor.submit([]() { return 1; });
+    ready.wait();
+    EXPECT_EQ(2, ready.then([](int i) { return i + 1; }).get());
+
+    // void results
+    std::atomic<int> count(0);
+    Future<void> voidFuture = executor.submit([&count]() { count++; })
+        .then([&count]() { count++; });
+    voidFuture.get();
+    EXPECT_EQ(2, count.load());
+
+    // Exceptions are passed along the chain without running continuations
+    Future<int> failed = executor.submit([]() -> int { throw runtime_error("failed"); })
+        .then([&count](int i) { count++; return i; });
+    EXPECT_THROW(failed.get(), runtime_error);
+    EXPECT_EQ(2, count.load());
+
+    // Waiting on one result doesn't need the whole executor to drain
+    Future<void> slow = executor.submit([]() { usleep(200000); });
+    Future<int> fast = executor.submit([]() { return 1; });
+    EXPECT_EQ(1, fast.get());
+    EXPECT_FALSE(slow.isReady());
+    slow.get();
+
+    executor.wait();
+}
+
+class GateTask : public Task
+{
+    std::atomic<bool>* m_open;
+
+ public:
+    GateTask(std::atomic<bool>* open) : Task(L"Gate Task")
+    {
+        m_open = open;
+    }
+
+    ~GateTask() override = default;
+
+    void run() override
+    {
+        while (!*m_open)
+        {
+            usleep(1000);
+        }
+    }
+};
+
+class RecordTask : public Task
+{
+    Geek::Mutex* m_mutex;
+    vector<TaskPriority>* m_order;
+
+ public:
+    RecordTask(Geek::Mutex* mutex, vector<TaskPriority>* order) : Task(L"Record Task")
+    {
+        m_mutex = mutex;
+        m_order = order;
+    }
+
+    ~RecordTask() override = default;
+
+    void run() override
+    {
+        m_mutex->lock();
+        m_order->push_back(getPriority());
+        m_mutex->unlock();
+    }
+};
+
+TEST(Tasks, PriorityTest)
+{
+    TaskExecutorMode modes[] = {TASK_EXECUTOR_TRANSIENT, TASK_EXECUTOR_POOL, TASK_EXECUTOR_WORK_STEALING, TASK_EXECUTOR_NUMA};
+    for (TaskExecutorMode mode : modes)
+    {
+        Geek::Mutex* mutex = Geek::Thread::createMutex();
+        vector<TaskPriority> order;
+        std::atomic<bool> open(false);
+
+        TaskExecutor executor(1, mode);
+        executor.setStarvationLimit(100);
+
+        // Keep the only worker busy while we fill the queues
+        executor.addTask(new GateTask(&open));
+        usleep(10000);
+
+        int i;
+        for (i = 0; i < 5; i++)
+        {
+            executor.addTask(new RecordTask(mutex, &order), TASK_PRIORITY_LOW);
+            executor.addTask(new RecordTask(mutex, &order), TASK_PRIORITY_NORMAL);
+            executor.addTask(new RecordTask(mutex, &order), TASK_PRIORITY_HIGH);
+        }
+        EXPECT_EQ(5, executor.getQueuedCount(TASK_PRIORITY_HIGH));
+
+        int high = 0;
+        for (TaskInfo info : executor.getTaskInfo())
+        {
+            if (info.priority == TASK_PRIORITY_HIGH)
+            {
+                EXPECT_EQ(TASK_QUEUED, info.state);
+                high++;
+            }
+        }
+        EXPECT_EQ(5, high);
+
+        open = true;
+        executor.wait();
+
+        ASSERT_EQ(15, order.size());
+        for (i = 0; i < 15; i++)
+        {
+            EXPECT_EQ((TaskPriority)(TASK_PRIORITY_HIGH - (i / 5)), order.at(i));
+        }
+        delete mutex;
+    }
+}
+
+TEST(Tasks, StarvationTest)
+{
+    Geek::Mutex* mutex = Geek::Thread::createMutex();
+    vector<TaskPriority> order;
+    std::atomic<bool> open(false);
+
+    TaskExecutor executor(1, TASK_EXECUTOR_POOL);
+    executor.setStarvationLimit(2);
+
+    executor.addTask(new GateTask(&open));
+    usleep(10000);
+
+    executor.addTask(new RecordTask(mutex, &order), TASK_PRIORITY_LOW);
+    int i;
+    for (i = 0; i < 10; i++)
+    {
+        executor.addTask(new RecordTask(mutex, &order), TASK_PRIORITY_HIGH);
+    }
+
+    open = true;
+    executor.wait();
+
+    // The low priority task only waits for the starvation limit
+    ASSERT_EQ(11, order.size());
+    EXPECT_EQ(TASK_PRIORITY_LOW, order.at(2));
+    delete mutex;
+}
+
+TEST(Tasks, UntrackedTest)
+{
+    std::atomic<int> count(0);
+
+    TaskExecutor executor(4, TASK_EXECUTOR_POOL);
+    executor.setTaskTracking(false);
+
+    std::atomic<bool> open(false);
+    executor.addTask(new GateTask(&open));
+
+    // More than fit in the queue's ring, so some will overflow
+    int i;
+    for (i = 0; i < 5000; i++)
+    {
+        executor.addTask(new CountTask(&count));
+    }
+    EXPECT_LT(0, executor.getTaskCount());
+    EXPECT_EQ(0, executor.getTaskInfo().size());
+
+    open = true;
+    executor.wait();
+    EXPECT_EQ(5000, count.load());
+    EXPECT_EQ(0, executor.getTaskCount());
+}
+
+TEST(Tasks, ManyProducersTest)
+{
+    std::atomic<int> count(0);
+
+    TaskExecutor executor(4, TASK_EXECUTOR_WORK_STEALING);
+    executor.setTaskTracking(false);
+
+    vector<Geek::Thread*> producers;
+    int i;
+    for (i = 0; i < 8; i++)
+    {
+        class Producer : public Geek::Thread
+        {
+            TaskExecutor* m_executor;
+            std::atomic<int>* m_count;
+
+         public:
+            Producer(TaskExecutor* executor, std::atomic<int>* count)
+            {
+                m_executor = executor;
+                m_count = count;
+            }
+
+            bool main() override
+            {
+                int j;
+                for (j = 0; j < 2000; j++)
+                {
+                    m_executor->addTask(new CountTask(m_count), (TaskPriority)(j % TASK_PRIORITY_COUNT));
+                }
+                return true;
+            }
+        };
+        producers.push_back(new Producer(&executor, &count));
+    }
+
+    for (Geek::Thread* producer : producers)
+    {
+        producer->start();
+    }
+    for (Geek::Thread* producer : producers)
+    {
+        producer->wait();
+        delete producer;
+    }
+
+    executor.wait();
+    EXPECT_EQ(8 * 2000, count.load());
+}
+
+TEST(Tasks, GroupTest)
+{
+    TaskExecutor executor(2, TASK_EXECUTOR_POOL);
+
+    // Something else that is keeping the executor busy
+    std::atomic<bool> open(false);
+    executor.addTask(new GateTask(&open));
+
+    std::atomic<int> count(0);
+    {
+        TaskGroup group(&executor);
+        int i;
+        for (i = 0; i < 100; i++)
+        {
+            group.addTask(new CountTask(&count));
+        }
+        group.run([&count]() { count++; });
+
+        group.wait();
+        EXPECT_EQ(101, count.load());
+        EXPECT_EQ(0, group.getPendingCount());
+    }
+
+    // The gate is still running, so the executor isn't idle
+    EXPECT_GT(executor.getTaskCount(), 0);
+
+    open = true;
+    executor.wait();
+}
+
+TEST(Tasks, GroupHelpTest)
+{
+    TaskExecutor executor(1, TASK_EXECUTOR_POOL);
+
+    // Block the only worker, so the group can only complete if the
+    // waiting thread runs its members itself
+    std::atomic<bool> open(false);
+    executor.addTask(new GateTask(&open));
+    usleep(10000);
+
+    std::atomic<int> count(0);
+    TaskGroup group(&executor);
+    int i;
+    for (i = 0; i < 10; i++)
+    {
+        group.addTask(new CountTask(&count));
+    }
+    group.wait();
+    EXPECT_EQ(10, count.load());
+
+    open = true;
+    executor.wait();
+}
+
+TEST(Tasks, PostTest)
+{
+    TaskExecutor executor(4, TASK_EXECUTOR_WORK_STEALING);
+    executor.setTaskTracking(false);
+
+    std::atomic<int> count(0);
+    int i;
+    for (i = 0; i < 10000; i++)
+    {
+        executor.post([&count]() { count++; });
+    }
+
+    // Too big to be stored inline
+    char big[INLINE_TASK_SIZE * 2] = {1};
+    executor.post([&count, big]() { count += big[0]; }, TASK_PRIORITY_HIGH);
+
+    executor.wait();
+    EXPECT_EQ(10001, count.load());
+}
+
+TEST(Tasks, ArenaTest)
+{
+    TaskExecutor executor(1, TASK_EXECUTOR_POOL);
+
+    // Every task sees an empty arena, whatever the last one left behind
+    std::atomic<int> clean(0);
+    int i;
+    for (i = 0; i < 100; i++)
+    {
+        executor.post([&clean]()
+        {
+            Geek::Arena& arena = Geek::Thread::getArena();
+            if (arena.getUsed() == 0)
+            {
+                clean++;
+            }
+            arena.alloc(1000);
+        });
+    }
+
+    executor.wait();
+    EXPECT_EQ(100, clean.load());
+}
+
+TEST(Tasks, InlineTaskTest)
+{
+    // Nothing is allocated until it's asked for
+    Task task;
+    EXPECT_EQ(L"", task.getTitle());
+    task.emitStarted();
+
+    int count = 0;
+    task.completeSignal().connect([&count](Task*) { count++; });
+    task.emitComplete();
+    EXPECT_EQ(1, count);
+
+    // Released tasks go back to the pool and are reset for reuse
+    InlineTask* first = InlineTask::create([&count]() { count++; });
+    first->setPriority(TASK_PRIORITY_HIGH);
+    first->run();
+    first->release();
+
+    InlineTask* second = InlineTask::create([&count]() { count += 2; });
+    EXPECT_EQ(TASK_CREATED, second->getState());
+    EXPECT_EQ(TASK_PRIORITY_NORMAL, second->getPriority());
+    second->run();
+    second->release();
+    EXPECT_EQ(4, count);
+}
+
+TEST(Tasks, HistogramTest)
+{
+    TaskHistogram histogram;
+    histogram.record(0);
+    histogram.record(1);
+    histogram.record(3);
+    histogram.record(1000);
+
+    TaskHistogramSnapshot snapshot = histogram.snapshot();
+    EXPECT_EQ(4, snapshot.count);
+    EXPECT_EQ(1004, snapshot.total);
+    EXPECT_EQ(1000, snapshot.max);
+    EXPECT_EQ(1, snapshot.buckets[0]);
+    EXPECT_EQ(1, snapshot.buckets[1]);
+    EXPECT_EQ(1, snapshot.buckets[2]);
+    EXPECT_EQ(1, snapshot.buckets[10]);
+
+    EXPECT_EQ(0, snapshot.getPercentile(25));
+    EXPECT_EQ(3, snapshot.getPercentile(75));
+    EXPECT_EQ(1000, snapshot.getPercentile(100));
+
+    histogram.reset();
+    EXPECT_EQ(0, histogram.snapshot().count);
+}
+
+TEST(Tasks, StatsTest)
+{
+    TaskExecutor executor(2, TASK_EXECUTOR_POOL);
+    executor.setStatsEnabled(true);
+
+    int i;
+    for (i = 0; i < 20; i++)
+    {
+        executor.post([]() { usleep(1000); });
+    }
+    executor.wait();
+
+    TaskExecutorStats stats = executor.getStats();
+    EXPECT_EQ(2, stats.maxWorkers);
+    EXPECT_EQ(20, stats.tasksQueued);
+    EXPECT_EQ(20, stats.tasksCompleted);
+    EXPECT_EQ(20, stats.runTime.count);
+    EXPECT_EQ(20, stats.queueWait.count);
+    EXPECT_GE(stats.runTime.getMean(), 1000000);
+
+    ASSERT_EQ(2, stats.workers.size());
+    EXPECT_EQ(20, stats.workers[0].tasksRun + stats.workers[1].tasksRun);
+    EXPECT_GT(stats.getUtilisation(), 0.0);
+
+    executor.resetStats();
+    EXPECT_EQ(0, executor.getStats().tasksCompleted);
+}
+
+class PollTask : public Task
+{
+    std::atomic<bool>* m_running;
+
+ public:
+    PollTask(std::atomic<bool>* running)
+    {
+        m_running = running;
+    }
+
+    void run() override
+    {
+        *m_running = true;
+        while (!isCancelled())
+        {
+            usleep(1000);
+        }
+        *m_running = false;
+    }
+};
+
+TEST(Tasks, CancelTest)
+{
+    TaskExecutor executor(1, TASK_EXECUTOR_POOL);
+
+    // Keep the only worker busy while we cancel things behind it
+    std::atomic<bool> open(false);
+    executor.addTask(new GateTask(&open));
+
+    std::atomic<int> count(0);
+    CancellationSource source;
+    int i;
+    for (i = 0; i < 10; i++)
+    {
+        executor.post([&count]() { count++; }, source.getToken());
+    }
+
+    int completed = 0;
+    Task* expiring = new CountTask(&count);
+    expiring->setTimeout(1);
+    expiring->completeSignal().connect([&completed](Task* task)
+    {
+        EXPECT_EQ(TASK_CANCELLED, task->getState());
+        completed++;
+    });
+    executor.addTask(expiring);
+
+    source.cancel();
+    usleep(10000);
+    open = true;
+    executor.wait();
+
+    EXPECT_EQ(0, count.load());
+    EXPECT_EQ(1, completed);
+
+    TaskExecutorStats stats = executor.getStats();
+    EXPECT_EQ(10, stats.tasksCancelled);
+    EXPECT_EQ(1, stats.tasksExpired);
+
+    // Running tasks can poll for cancellation
+    std::atomic<bool> running(false);
+    CancellationSource pollSource;
+    Task* poll = new PollTask(&running);
+    poll->setCancellationToken(pollSource.getToken());
+    executor.addTask(poll);
+    while (!running)
+    {
+        usleep(1000);
+    }
+    pollSource.cancel();
+    executor.wait();
+    EXPECT_FALSE(running);
+}
+
+class DropTask : public Task
+{
+    std::atomic<int>* m_dropped;
+
+ public:
+    DropTask(std::atomic<int>* dropped) : Task(L"Drop Task")
+    {
+        m_dropped = dropped;
+    }
+
+    ~DropTask() override = default;
+
+    void dropped() override
+    {
+        (*m_dropped)++;
+    }
+};
+
+TEST(Tasks, ShutdownTest)
+{
+    TaskExecutor* executor = new TaskExecutor(1, TASK_EXECUTOR_POOL);
+
+    // Keep the only worker busy until the executor is being destroyed
+    std::atomic<bool> open(false);
+    executor->addTask(new GateTask(&open));
+
+    Future<int> future = executor->submit([]() { return 1; });
+
+    // Dependents of a dropped task are dropped too
+    std::atomic<int> dropped(0);
+    TaskGraph graph;
+    Task* first = new DropTask(&dropped);
+    Task* second = new DropTask(&dropped);
+    graph.addTask(first);
+    graph.addTask(second, {first});
+    executor->addGraph(&graph);
+
+    std::atomic<int> count(0);
+    int completed = 0;
+    Strand strand(executor);
+    Task* member = new CountTask(&count);
+    member->completeSignal().connect([&completed](Task* task)
+    {
+        EXPECT_EQ(TASK_CANCELLED, task->getState());
+        completed++;
+    });
+    strand.addTask(member);
+    strand.post([&count]() { count++; });
+
+    TaskGroup group(executor);
+    group.addTask(new CountTask(&count));
+
+    thread opener([&open]()
+    {
+        usleep(100000);
+        open = true;
+    });
+    delete executor;
+    opener.join();
+
+    EXPECT_EQ(0, count.load());
+    EXPECT_EQ(2, dropped.load());
+    EXPECT_EQ(1, completed);
+    ASSERT_TRUE(future.isReady());
+    EXPECT_THROW(future.get(), std::runtime_error);
+}
+
+TEST(Tasks, StrandTest)
+{
+    TaskExecutor executor(4, TASK_EXECUTOR_WORK_STEALING);
+    executor.setTaskTracking(false);
+
+    // Each strand appends to its own vector without locking, and checks
+    // that nothing else from the same strand is running at the same time
+    const int strandCount = 3;
+    const int taskCount = 1000;
+    std::vector<int> results[strandCount];
+    std::atomic<int> running[strandCount];
+    std::atomic<bool> overlapped(false);
+
+    {
+        std::vector<Strand*> strands;
+        int i;
+        for (i = 0; i < strandCount; i++)
+        {
+            running[i] = 0;
+            strands.push_back(new Strand(&executor));
+        }
+
+        int j;
+        for (j = 0; j < taskCount; j++)
+        {
+            for (i = 0; i < strandCount; i++)
+            {
+                std::vector<int>* result = &results[i];
+                std::atomic<int>* count = &running[i];
+                strands[i]->post([result, count, &overlapped, j]()
+                {
+                    if (++(*count) != 1)
+                    {
+                        overlapped = true;
+                    }
+                    result->push_back(j);
+                    (*count)--;
+                });
+            }
+        }
+
+        // Queued tasks still run once the strand has gone
+        for (Strand* strand : strands)
+        {
+            delete strand;
+        }
+    }
+
+    executor.wait();
+    EXPECT_FALSE(overlapped);
+
+    int i;
+    for (i = 0; i < strandCount; i++)
+    {
+        ASSERT_EQ(taskCount, results[i].size());
+        int j;
+        for (j = 0; j < taskCount; j++)
+        {
+            EXPECT_EQ(j, results[i][j]);
+        }
+    }
+}
+
+TEST(Tasks, CapacityTest)
+{
+    TaskExecutor executor(1, TASK_EXECUTOR_POOL);
+    executor.setQueueCapacity(4, TASK_QUEUE_REJECT);
+
+    std::atomic<bool> open(false);
+    EXPECT_TRUE(executor.addTask(new GateTask(&open)));
+
+    // Wait for the gate to be started, so it no longer counts as queued
+    while (executor.getQueuedCount(TASK_PRIORITY_NORMAL) > 0)
+    {
+        usleep(1000);
+    }
+    usleep(10000);
+
+    std::atomic<int> count(0);
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        EXPECT_TRUE(executor.post([&count]() { count++; }));
+    }
+
+    // Full
+    Task* rejected = new CountTask(&count);
+    EXPECT_FALSE(executor.addTask(rejected));
+    EXPECT_FALSE(executor.tryAddTask(rejected));
+    EXPECT_FALSE(executor.addTasks({rejected}));
+    EXPECT_FALSE(executor.post([&count]() { count++; }));
+    EXPECT_THROW(executor.submit([]() { return 1; }).get(), std::runtime_error);
+    delete rejected;
+
+    open = true;
+    executor.wait();
+    EXPECT_EQ(4, count.load());
+}
+
+TEST(Tasks, BlockingCapacityTest)
+{
+    TaskExecutor executor(2, TASK_EXECUTOR_WORK_STEALING);
+    executor.setQueueCapacity(8, TASK_QUEUE_BLOCK);
+
+    // A fast producer is held back rather than queueing everything
+    std::atomic<int> count(0);
+    std::atomic<int> maxQueued(0);
+    int i;
+    for (i = 0; i < 200; i++)
+    {
+        executor.addTask(new CountTask(&count));
+        int queued = executor.getQueuedCount(TASK_PRIORITY_NORMAL);
+        if (queued > maxQueued)
+        {
+            maxQueued = queued;
+        }
+    }
+    executor.wait();
+    EXPECT_EQ(200, count.load());
+    EXPECT_LE(maxQueued.load(), 8);
+}
+
+TEST(Tasks, BatchTest)
+{
+    TaskExecutorMode modes[] = {TASK_EXECUTOR_TRANSIENT, TASK_EXECUTOR_POOL, TASK_EXECUTOR_WORK_STEALING};
+    for (TaskExecutorMode mode : modes)
+    {
+        TaskExecutor executor(4, mode);
+
+        std::atomic<int> count(0);
+        std::vector<Task*> batch;
+        int i;
+        for (i = 0; i < 100; i++)
+        {
+            batch.push_back(new CountTask(&count));
+        }
+        EXPECT_TRUE(executor.addTasks(batch));
+        EXPECT_TRUE(executor.addTasks({}));
+        executor.wait();
+        EXPECT_EQ(100, count.load());
+    }
+}
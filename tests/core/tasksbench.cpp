@@ -0,0 +1,177 @@
+
+#include <geek/core-tasks.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
+
+using namespace std;
+using namespace Geek::Core;
+
+/*
+ * Measures how TaskExecutor throughput scales from one worker up to the
+ * number of cores, for each of the persistent executor modes.
+ *
+ * Usage: tasks_bench [tasks] [work]
+ */
+
+static atomic<uint64_t> g_sink(0);
+
+static void doWork(int work)
+{
+    uint64_t x = work;
+    int i;
+    for (i = 0; i < work; i++)
+    {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+    g_sink += x;
+}
+
+class BenchTask : public Task
+{
+    int m_work;
+
+ public:
+    BenchTask(int work)
+    {
+        m_work = work;
+    }
+
+    void run() override
+    {
+        doWork(m_work);
+    }
+};
+
+class TreeTask : public Task
+{
+    TaskExecutor* m_executor;
+    int m_depth;
+    int m_work;
+
+ public:
+    TreeTask(TaskExecutor* executor, int depth, int work)
+    {
+        m_executor = executor;
+        m_depth = depth;
+        m_work = work;
+    }
+
+    void run() override
+    {
+        doWork(m_work);
+        if (m_depth > 0)
+        {
+            m_executor->addTask(new TreeTask(m_executor, m_depth - 1, m_work));
+            m_executor->addTask(new TreeTask(m_executor, m_depth - 1, m_work));
+        }
+    }
+};
+
+static double runFlat(TaskExecutorMode mode, int workers, int tasks, int work)
+{
+    TaskExecutor executor(workers, mode);
+    executor.setTaskTracking(false);
+
+    auto start = chrono::steady_clock::now();
+    int i;
+    for (i = 0; i < tasks; i++)
+    {
+        executor.addTask(new BenchTask(work));
+    }
+    executor.wait();
+    auto end = chrono::steady_clock::now();
+
+    return chrono::duration<double>(end - start).count();
+}
+
+static double runPost(TaskExecutorMode mode, int workers, int tasks, int work)
+{
+    TaskExecutor executor(workers, mode);
+    executor.setTaskTracking(false);
+
+    auto start = chrono::steady_clock::now();
+    int i;
+    for (i = 0; i < tasks; i++)
+    {
+        executor.post([work]() { doWork(work); });
+    }
+    executor.wait();
+    auto end = chrono::steady_clock::now();
+
+    return chrono::duration<double>(end - start).count();
+}
+
+static double runTree(TaskExecutorMode mode, int workers, int depth, int work)
+{
+    TaskExecutor executor(workers, mode);
+    executor.setTaskTracking(false);
+
+    auto start = chrono::steady_clock::now();
+    executor.addTask(new TreeTask(&executor, depth, work));
+    executor.wait();
+    auto end = chrono::steady_clock::now();
+
+    return chrono::duration<double>(end - start).count();
+}
+
+int main(int argc, char** argv)
+{
+    int tasks = 100000;
+    int work = 1000;
+    if (argc > 1)
+    {
+        tasks = atoi(argv[1]);
+    }
+    if (argc > 2)
+    {
+        work = atoi(argv[2]);
+    }
+
+    int depth = 0;
+    while ((2 << depth) - 1 < tasks)
+    {
+        depth++;
+    }
+    int treeTasks = (2 << depth) - 1;
+
+    int cpus = thread::hardware_concurrency();
+    if (cpus < 1)
+    {
+        cpus = 1;
+    }
+
+    printf("tasks_bench: tasks=%d, tree tasks=%d, work=%d, cpus=%d\n", tasks, treeTasks, work, cpus);
+    printf(
+        "%7s  %14s  %14s  %14s  %14s  %14s\n",
+        "workers",
+        "pool flat/s",
+        "steal flat/s",
+        "steal post/s",
+        "pool tree/s",
+        "steal tree/s");
+
+    int workers;
+    for (workers = 1; workers <= cpus; workers++)
+    {
+        double poolFlat = runFlat(TASK_EXECUTOR_POOL, workers, tasks, work);
+        double stealFlat = runFlat(TASK_EXECUTOR_WORK_STEALING, workers, tasks, work);
+        double stealPost = runPost(TASK_EXECUTOR_WORK_STEALING, workers, tasks, work);
+        double poolTree = runTree(TASK_EXECUTOR_POOL, workers, depth, work);
+        double stealTree = runTree(TASK_EXECUTOR_WORK_STEALING, workers, depth, work);
+
+        printf(
+            "%7d  %14.0f  %14.0f  %14.0f  %14.0f  %14.0f\n",
+            workers,
+            tasks / poolFlat,
+            tasks / stealFlat,
+            tasks / stealPost,
+            treeTasks / poolTree,
+            treeTasks / stealTree);
+    }
+
+    return 0;
+}
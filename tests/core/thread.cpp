@@ -0,0 +1,222 @@
+
+#include <geek/core-thread.h>
+
+#include <pthread.h>
+
+#include <chrono>
+#include <set>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek;
+
+class CondVarThread : public Thread
+{
+ public:
+    Mutex* mutex;
+    CondVar* condVar;
+    int* value;
+    int target;
+
+    bool main() override
+    {
+        mutex->lock();
+        condVar->waitUntil(mutex, [this]() { return *value >= target; });
+        mutex->unlock();
+        return true;
+    }
+};
+
+class ThreadLocalThread : public Thread
+{
+ public:
+    ThreadLocal<int>* local;
+    int value;
+
+    bool main() override
+    {
+        local->get() += 10;
+        value = local->get();
+        return true;
+    }
+};
+
+class AttributesThread : public Thread
+{
+ public:
+    string name;
+    set<int> cpus;
+
+    bool main() override
+    {
+#if defined(__linux__)
+        char buffer[16];
+        pthread_getname_np(pthread_self(), buffer, sizeof(buffer));
+        name = buffer;
+
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        pthread_getaffinity_np(pthread_self(), sizeof(set), &set);
+        int cpu;
+        for (cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        {
+            if (CPU_ISSET(cpu, &set))
+            {
+                cpus.insert(cpu);
+            }
+        }
+#endif
+        return true;
+    }
+};
+
+TEST(Thread, NumaTest)
+{
+    vector<vector<int>> nodes = Thread::getNumaNodes();
+    ASSERT_GE(nodes.size(), 1);
+
+    size_t cpus = 0;
+    for (vector<int>& node : nodes)
+    {
+        EXPECT_FALSE(node.empty());
+        cpus += node.size();
+    }
+    EXPECT_GE(cpus, 1);
+    EXPECT_GE(Thread::getCPUCount(), 1);
+}
+
+TEST(Thread, AttributesTest)
+{
+    int cpu = Thread::getNumaNodes().at(0).at(0);
+
+    AttributesThread thread;
+    thread.setName("geek-test-thread-name");
+    thread.setStackSize(256 * 1024);
+    thread.setAffinity({cpu});
+    thread.setPriority(THREAD_PRIORITY_LOW);
+    EXPECT_TRUE(thread.start());
+    thread.wait();
+    EXPECT_TRUE(thread.isComplete());
+
+#if defined(__linux__)
+    // Truncated to fit
+    EXPECT_EQ("geek-test-threa", thread.name);
+    EXPECT_EQ(set<int>({cpu}), thread.cpus);
+#endif
+}
+
+TEST(Thread, StartFailureTest)
+{
+    // Far too big a stack for there to be room for it
+    AttributesThread thread;
+    thread.setStackSize((size_t)1 << 50);
+    EXPECT_FALSE(thread.start());
+
+    // Nothing to wait for
+    thread.wait();
+    EXPECT_FALSE(thread.isComplete());
+}
+
+TEST(Thread, CondVarTest)
+{
+    Mutex* mutex = Thread::createMutex();
+    CondVar* condVar = Thread::createCondVar();
+    int value = 0;
+
+    // Signalling before anyone waits isn't lost, as the waiter checks
+    // the predicate first
+    mutex->lock();
+    value = 1;
+    condVar->signal();
+    mutex->unlock();
+
+    CondVarThread early;
+    early.mutex = mutex;
+    early.condVar = condVar;
+    early.value = &value;
+    early.target = 1;
+    early.start();
+    early.wait();
+    EXPECT_TRUE(early.isComplete());
+
+    // Broadcast wakes every waiter
+    vector<CondVarThread*> threads;
+    int i;
+    for (i = 0; i < 4; i++)
+    {
+        CondVarThread* thread = new CondVarThread();
+        thread->mutex = mutex;
+        thread->condVar = condVar;
+        thread->value = &value;
+        thread->target = 2;
+        thread->start();
+        threads.push_back(thread);
+    }
+
+    this_thread::sleep_for(chrono::milliseconds(20));
+    mutex->lock();
+    value = 2;
+    condVar->broadcast();
+    mutex->unlock();
+
+    for (CondVarThread* thread : threads)
+    {
+        thread->wait();
+        EXPECT_TRUE(thread->isComplete());
+        delete thread;
+    }
+
+    // Timeouts
+    mutex->lock();
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    EXPECT_FALSE(condVar->waitUntil(mutex, [&value]() { return value == 3; }, 20));
+    EXPECT_GE(chrono::steady_clock::now() - start, chrono::milliseconds(20));
+    EXPECT_TRUE(condVar->waitUntil(mutex, [&value]() { return value == 2; }, 20));
+    mutex->unlock();
+
+    delete condVar;
+    delete mutex;
+}
+
+TEST(Thread, LegacyCondVarTest)
+{
+    CondVar* condVar = Thread::createCondVar();
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+    // Nothing signals it, so it times out
+    chrono::steady_clock::time_point start = chrono::steady_clock::now();
+    EXPECT_FALSE(condVar->wait((uint64_t)20));
+    EXPECT_GE(chrono::steady_clock::now() - start, chrono::milliseconds(20));
+#pragma GCC diagnostic pop
+
+    delete condVar;
+}
+
+TEST(Thread, ThreadLocalTest)
+{
+    ThreadLocal<int> local([]() { return new int(5); });
+    *local = 1;
+
+    ThreadLocalThread thread;
+    thread.local = &local;
+    thread.start();
+    thread.wait();
+
+    // Each thread got its own
+    EXPECT_EQ(15, thread.value);
+    EXPECT_EQ(1, *local);
+
+    ThreadLocal<string> other;
+    other->append("hello");
+    EXPECT_EQ("hello", *other);
+    EXPECT_EQ(1, *local);
+
+    // The arena is per thread, too
+    Arena& arena = Thread::getArena();
+    EXPECT_EQ(&arena, &Thread::getArena());
+    ArenaScope scope(arena);
+    EXPECT_NE((void*)NULL, arena.alloc(128));
+}
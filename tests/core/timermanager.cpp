@@ -0,0 +1,379 @@
+
+#include <geek/core-timers.h>
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+
+#include <gtest/gtest.h>
+
+using namespace std;
+using namespace Geek;
+using namespace Geek::Core;
+
+static void waitFor(TimerManager* timerManager, uint64_t timeoutms)
+{
+    uint64_t end = Clock::getMillis() + timeoutms;
+    while (timerManager->getTimerCount() > 0 && Clock::getMillis() < end)
+    {
+        this_thread::sleep_for(chrono::milliseconds(5));
+    }
+}
+
+TEST(TimerManager, OneShotTest)
+{
+    // Never deleted, as the thread doesn't exit
+    TimerManager* timerManager = new TimerManager();
+    timerManager->start();
+
+    // Spread over the first two levels of the wheel
+    const int count = 200;
+    atomic<int> fired(0);
+    atomic<int> early(0);
+    vector<Timer*> timers;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        Timer* timer = new Timer(TIMER_ONE_SHOT, (i * 7) % 300);
+        timer->signal().connect(sigc::slot<void, Timer*>([&fired, &early](Timer* timer)
+        {
+            if (Clock::getTime() < timer->getNextRun())
+            {
+                early++;
+            }
+            fired++;
+        }));
+        timerManager->addTimer(timer);
+        timers.push_back(timer);
+    }
+
+    waitFor(timerManager, 2000);
+    EXPECT_EQ(count, fired.load());
+    EXPECT_EQ(0, early.load());
+    EXPECT_EQ(0, timerManager->getTimerCount());
+
+    for (Timer* timer : timers)
+    {
+        EXPECT_FALSE(timer->isActive());
+        EXPECT_FALSE(timerManager->isScheduled(timer));
+    }
+}
+
+TEST(TimerManager, PeriodicTest)
+{
+    TimerManager* timerManager = new TimerManager();
+    timerManager->start();
+
+    atomic<int> fired(0);
+    Timer timer(TIMER_PERIODIC, 10);
+    timer.signal().connect(sigc::slot<void, Timer*>([&fired](Timer*) { fired++; }));
+    timerManager->addTimer(&timer);
+
+    this_thread::sleep_for(chrono::milliseconds(205));
+    timerManager->cancelTimer(&timer);
+    int total = fired;
+    EXPECT_GE(total, 10);
+    EXPECT_LE(total, 21);
+
+    // Nothing more after cancelling
+    this_thread::sleep_for(chrono::milliseconds(30));
+    EXPECT_EQ(total, fired.load());
+    EXPECT_EQ(0, timerManager->getTimerCount());
+}
+
+TEST(TimerManager, MicrosTest)
+{
+    TimerManager* timerManager = new TimerManager();
+    timerManager->start();
+
+    atomic<int> fired(0);
+    Timer timer(TIMER_PERIODIC, 0);
+    timer.setPeriodMicros(500);
+    EXPECT_EQ(0, timer.getPeriod());
+    timer.signal().connect(sigc::slot<void, Timer*>([&fired](Timer*) { fired++; }));
+    timerManager->addTimer(&timer);
+
+    Clock::sleep(100 * 1000000ull);
+    timerManager->cancelTimer(&timer);
+
+    // Much more often than once per ms, allowing for a slow machine
+    EXPECT_GE(fired.load(), 100);
+    EXPECT_LE(fired.load(), 201);
+}
+
+TEST(TimerManager, AddAtTest)
+{
+    TimerManager* timerManager = new TimerManager();
+    timerManager->start();
+
+    atomic<int> fired(0);
+    atomic<int> early(0);
+    Timer timer(TIMER_ONE_SHOT, 1000);
+    timer.signal().connect(sigc::slot<void, Timer*>([&fired, &early](Timer* timer)
+    {
+        if (Clock::getTime() < timer->getNextRun())
+        {
+            early++;
+        }
+        fired++;
+    }));
+
+    // Runs at the time given, not a period from now
+    uint64_t when = Clock::getTime() + 20 * 1000000ull;
+    timerManager->addTimerAt(&timer, when);
+    EXPECT_EQ(when, timer.getNextRun());
+    EXPECT_EQ(1000, timer.getPeriod());
+
+    waitFor(timerManager, 500);
+    EXPECT_EQ(1, fired.load());
+    EXPECT_EQ(0, early.load());
+}
+
+TEST(TimerManager, ExecutorTest)
+{
+    // None of these are deleted, as queued callbacks may still refer to
+    // them after the test
+    TimerManager* timerManager = new TimerManager();
+    TaskExecutor* executor = new TaskExecutor(4, TASK_EXECUTOR_POOL);
+    timerManager->setExecutor(executor);
+    timerManager->start();
+
+    // A slow callback, serialised on its strand
+    atomic<int> running(0);
+    atomic<int> overlapped(0);
+    Timer* slow = new Timer(TIMER_PERIODIC, 20);
+    slow->setStrand(new Strand(executor));
+    slow->signal().connect(sigc::slot<void, Timer*>([&running, &overlapped](Timer*)
+    {
+        if (++running > 1)
+        {
+            overlapped++;
+        }
+        Clock::sleep(30 * 1000000ull);
+        running--;
+    }));
+
+    atomic<int> fast(0);
+    Timer* fastTimer = new Timer(TIMER_PERIODIC, 2);
+    fastTimer->signal().connect(sigc::slot<void, Timer*>([&fast](Timer*) { fast++; }));
+
+    timerManager->addTimer(slow);
+    timerManager->addTimer(fastTimer);
+    Clock::sleep(200 * 1000000ull);
+    timerManager->cancelTimer(slow);
+    timerManager->cancelTimer(fastTimer);
+
+    // Run on the timer thread, the slow timer would hold this up
+    EXPECT_GE(fast.load(), 40);
+    EXPECT_EQ(0, overlapped.load());
+
+    // Wait for the strand to drain before the counters go away
+    Clock::sleep(50 * 1000000ull);
+    while (slow->getStrand()->size() > 0)
+    {
+        Clock::sleep(10 * 1000000ull);
+    }
+    executor->wait();
+
+    TimerStats stats = fastTimer->getStats();
+    EXPECT_EQ((uint64_t)fast.load(), stats.fired);
+    EXPECT_LE(stats.lastLateness, stats.maxLateness);
+    EXPECT_LE(stats.getMeanLateness(), stats.maxLateness);
+
+    // The slow timer's callbacks queue up behind each other
+    EXPECT_GT(slow->getStats().maxLateness, 10 * 1000000ull);
+
+    TaskHistogramSnapshot lateness = timerManager->getLateness();
+    EXPECT_EQ(stats.fired + slow->getStats().fired, lateness.count);
+
+    fastTimer->resetStats();
+    EXPECT_EQ(0, fastTimer->getStats().fired);
+}
+
+TEST(TimerManager, SlackTest)
+{
+    TimerManager* timerManager = new TimerManager();
+    timerManager->start();
+
+    // Due every 0.5ms, but happy to be up to 20ms late
+    const int count = 100;
+    atomic<int> fired(0);
+    atomic<int> early(0);
+    atomic<uint64_t> maxLateness(0);
+    vector<Timer*> timers;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        Timer* timer = new Timer(TIMER_ONE_SHOT, 0);
+        timer->setPeriodMicros(1000 + i * 500);
+        timer->setSlack(20);
+        EXPECT_EQ(20000, timer->getSlackMicros());
+        timer->signal().connect(sigc::slot<void, Timer*>([&](Timer* timer)
+        {
+            uint64_t now = Clock::getTime();
+            if (now < timer->getNextRun())
+            {
+                early++;
+            }
+            else if (now - timer->getNextRun() > maxLateness)
+            {
+                maxLateness = now - timer->getNextRun();
+            }
+            fired++;
+        }));
+        timers.push_back(timer);
+    }
+    for (Timer* timer : timers)
+    {
+        timerManager->addTimer(timer);
+    }
+
+    waitFor(timerManager, 2000);
+    EXPECT_EQ(count, fired.load());
+    EXPECT_EQ(0, early.load());
+
+    // Within the slack, allowing for a slow machine
+    EXPECT_LT(maxLateness.load(), 40 * 1000000ull);
+
+    TimerManagerStats stats = timerManager->getStats();
+    EXPECT_EQ(count, stats.timersFired);
+    EXPECT_LE(stats.wakeups, 20);
+    EXPECT_GE(stats.wakeupsSaved, 50);
+
+    timerManager->resetStats();
+    EXPECT_EQ(0, timerManager->getStats().wakeups);
+}
+
+TEST(TimerManager, FixedRateTest)
+{
+    TimerManager* timerManager = new TimerManager();
+    timerManager->start();
+
+    const uint64_t period = 5000000ull;
+    FastMutex timelineMutex;
+    vector<uint64_t> timeline;
+
+    Timer timer(TIMER_FIXED_RATE, 5);
+    timer.signal().connect(sigc::slot<void, Timer*>([&timelineMutex, &timeline](Timer* timer)
+    {
+        // The next run has already been scheduled
+        {
+            LockGuard<FastMutex> guard(timelineMutex);
+            timeline.push_back(timer->getNextRun());
+        }
+
+        // Would push a TIMER_PERIODIC timer back every time
+        Clock::sleep(1000000ull);
+    }));
+    uint64_t added = Clock::getTime();
+    timerManager->addTimer(&timer);
+
+    Clock::sleep(203 * 1000000ull);
+    timerManager->cancelTimer(&timer);
+    Clock::sleep(10 * 1000000ull);
+
+    TimerFrameStats stats = timer.getFrameStats();
+    LockGuard<FastMutex> guard(timelineMutex);
+    ASSERT_GE(stats.frames, 2u);
+    ASSERT_EQ(stats.frames, timeline.size());
+
+    // Every run is a whole number of periods after it was added, however
+    // late the ones before it ran
+    EXPECT_LT((timeline.at(0) - added) % period, 1000000ull);
+    size_t i;
+    for (i = 1; i < timeline.size(); i++)
+    {
+        EXPECT_GT(timeline.at(i), timeline.at(i - 1));
+        EXPECT_EQ(0, (timeline.at(i) - timeline.at(0)) % period);
+    }
+
+    // Any periods without a run were skipped, not lost
+    uint64_t periods = (timeline.back() - timeline.at(0)) / period;
+    EXPECT_EQ(periods, stats.frames - 1 + stats.skipped);
+    EXPECT_GE(stats.frames + stats.skipped, 35);
+    EXPECT_LE(stats.frames + stats.skipped, 41);
+
+    EXPECT_LE(stats.minFrameTime, stats.meanFrameTime);
+    EXPECT_LE(stats.meanFrameTime, stats.p99FrameTime);
+    EXPECT_LE(stats.p99FrameTime, stats.maxFrameTime);
+
+    timer.resetFrameStats();
+    EXPECT_EQ(0, timer.getFrameStats().frames);
+
+    // Other timers don't keep frame stats
+    Timer periodic(TIMER_PERIODIC, 5);
+    EXPECT_EQ(0, periodic.getFrameStats().frames);
+}
+
+TEST(TimerManager, CatchUpTest)
+{
+    TimerManager* timerManager = new TimerManager();
+    timerManager->start();
+
+    // Each frame takes longer than the period, on the timer thread
+    Timer skip(TIMER_FIXED_RATE, 5);
+    skip.signal().connect(sigc::slot<void, Timer*>([](Timer*) { Clock::sleep(12 * 1000000ull); }));
+    timerManager->addTimer(&skip);
+    Clock::sleep(200 * 1000000ull);
+    timerManager->cancelTimer(&skip);
+    Clock::sleep(20 * 1000000ull);
+
+    TimerFrameStats skipStats = skip.getFrameStats();
+    EXPECT_GT(skipStats.skipped, 0);
+    EXPECT_LE(skipStats.frames, 18);
+
+    // Missed ticks run straight after each other instead
+    Timer catchUp(TIMER_FIXED_RATE, 5);
+    catchUp.setCatchUp(TIMER_CATCH_UP);
+    catchUp.signal().connect(sigc::slot<void, Timer*>([](Timer*) { Clock::sleep(12 * 1000000ull); }));
+    timerManager->addTimer(&catchUp);
+    Clock::sleep(200 * 1000000ull);
+    timerManager->cancelTimer(&catchUp);
+    Clock::sleep(20 * 1000000ull);
+
+    TimerFrameStats catchUpStats = catchUp.getFrameStats();
+    EXPECT_GE(catchUpStats.frames, 14);
+    EXPECT_GT(catchUpStats.minFrameTime, 11000000ull);
+    EXPECT_LT(catchUpStats.meanFrameTime, 15000000ull);
+}
+
+TEST(TimerManager, CancelTest)
+{
+    // Not started, so nothing fires while we're adding
+    TimerManager timerManager;
+
+    const int count = 20000;
+    vector<Timer*> timers;
+    int i;
+    for (i = 0; i < count; i++)
+    {
+        // From a few ms to beyond the top of the wheel
+        uint64_t period = (uint64_t)1 << (i % 40);
+        Timer* timer = new Timer("timer-" + to_string(i), TIMER_ONE_SHOT, period);
+        timerManager.addTimer(timer);
+        timers.push_back(timer);
+    }
+    EXPECT_EQ(count, timerManager.getTimerCount());
+    EXPECT_EQ(timers.at(1234), timerManager.findTimer("timer-1234"));
+
+    for (i = 0; i < count; i += 2)
+    {
+        timerManager.cancelTimer(timers.at(i));
+    }
+    EXPECT_EQ(count / 2, timerManager.getTimerCount());
+    EXPECT_EQ(NULL, timerManager.findTimer("timer-1234"));
+    EXPECT_EQ(timers.at(1235), timerManager.findTimer("timer-1235"));
+
+    // Resetting moves it without adding another
+    timerManager.resetTimer(timers.at(1));
+    EXPECT_EQ(count / 2, timerManager.getTimerCount());
+    EXPECT_TRUE(timerManager.isScheduled(timers.at(1)));
+
+    for (Timer* timer : timers)
+    {
+        timerManager.cancelTimer(timer);
+        delete timer;
+    }
+    EXPECT_EQ(0, timerManager.getTimerCount());
+    EXPECT_EQ(NULL, timerManager.findTimer("timer-1235"));
+}